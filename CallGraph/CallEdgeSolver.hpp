@@ -0,0 +1,117 @@
+#ifndef CALL_EDGE_SOLVER_HPP
+#define CALL_EDGE_SOLVER_HPP
+
+#include <vector>
+
+// Derive call site and function entry counts from the ones that are
+// measured, using two kinds of equations:
+//
+//   a call site that runs exactly once per invocation of its caller
+//   has the entry count of the caller;
+//
+//   the entry count of a closed function, one that is only entered by
+//   calls from the binary, is the sum of its incoming direct call sites
+//   plus the indirect calls to it.
+//
+// CallGraph uses it to pick the counters to insert and CallGraphTool
+// uses it to reconstruct the call graph from the counters.
+struct SolverFunction {
+    bool closed;
+    double dynamicCalls;
+    std::vector<int> onceSites;
+    std::vector<int> inSites;
+};
+
+struct SolverSite {
+    int caller;
+    // -1 if the callee is not a function of the binary
+    int callee;
+    bool once;
+};
+
+class CallEdgeSolver {
+    struct Item {
+        bool closed;
+        int index;
+    };
+    std::vector<Item> work;
+
+public:
+    std::vector<SolverFunction> funcs;
+    std::vector<SolverSite> sites;
+    std::vector<bool> entryKnown, siteKnown;
+    std::vector<double> entryCount, siteCount;
+    // Derived counts that came out negative and were clamped to 0,
+    // which means a function assumed closed is entered from elsewhere
+    int negative;
+
+    void init() {
+        entryKnown.assign(funcs.size(), false);
+        entryCount.assign(funcs.size(), 0);
+        siteKnown.assign(sites.size(), false);
+        siteCount.assign(sites.size(), 0);
+        negative = 0;
+        work.clear();
+    }
+
+    void setEntry(int f, double v) {
+        if (entryKnown[f]) return;
+        entryKnown[f] = true;
+        entryCount[f] = v;
+        for (auto s : funcs[f].onceSites) {
+            work.push_back(Item{false, s});
+        }
+        if (funcs[f].closed) work.push_back(Item{true, f});
+    }
+
+    void setSite(int s, double v) {
+        if (siteKnown[s]) return;
+        siteKnown[s] = true;
+        siteCount[s] = v;
+        if (sites[s].once) work.push_back(Item{false, s});
+        int g = sites[s].callee;
+        if (g >= 0 && funcs[g].closed) work.push_back(Item{true, g});
+    }
+
+    void propagate() {
+        while (!work.empty()) {
+            Item item = work.back();
+            work.pop_back();
+            if (!item.closed) {
+                int s = item.index;
+                int f = sites[s].caller;
+                if (entryKnown[f] && !siteKnown[s]) {
+                    setSite(s, entryCount[f]);
+                } else if (siteKnown[s] && !entryKnown[f]) {
+                    setEntry(f, siteCount[s]);
+                }
+                continue;
+            }
+            int g = item.index;
+            int unknown = entryKnown[g] ? 0 : 1;
+            int unknownSite = -1;
+            double sum = funcs[g].dynamicCalls;
+            for (auto s : funcs[g].inSites) {
+                if (siteKnown[s]) {
+                    sum += siteCount[s];
+                } else {
+                    ++unknown;
+                    unknownSite = s;
+                }
+            }
+            if (unknown != 1) continue;
+            if (!entryKnown[g]) {
+                setEntry(g, sum);
+            } else {
+                double v = entryCount[g] - sum;
+                if (v < 0) {
+                    ++negative;
+                    v = 0;
+                }
+                setSite(unknownSite, v);
+            }
+        }
+    }
+};
+
+#endif
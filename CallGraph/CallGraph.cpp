@@ -6,12 +6,55 @@
 #include "BPatch_object.h"
 #include "BPatch_point.h"
 
+#include "PatchCFG.h"
+#include "PatchMgr.h"
+#include "Point.h"
+#include "Snippet.h"
+
+#include "CallEdgeSolver.hpp"
+
+#include <algorithm>
+#include <cstring>
+
 using namespace Dyninst;
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
 
 BPatch bpatch;
 BPatch_binaryEdit *binEdit;
 BPatch_image* image;
 
+bool closedWorld = false;
+bool cct = false;
+uint64_t sample_period = 0;
+std::string input_filename;
+std::string output_filename;
+std::string edge_table_filename;
+std::string plan_filename;
+std::string latency_filename;
+
+// Count by incrementing a slot in the counter array:
+// f0 48 ff 05 xx xx xx xx    lock incq disp32(%rip)
+// or, without the lock prefix, when an approximate count is enough:
+// 48 ff 05 xx xx xx xx       incq disp32(%rip)
+// Flags are not preserved across calls and are dead at function entries,
+// so the snippet can clobber them at both without saving them.
+class EdgeCounterSnippet : public Dyninst::PatchAPI::Snippet {
+    Dyninst::Address slot;
+    bool atomic;
+public:
+    EdgeCounterSnippet(Dyninst::Address s, bool a): slot(s), atomic(a) {}
+    bool generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) override {
+        const int InstLength = atomic ? 8 : 7;
+        unsigned char code[8] = {0xf0, 0x48, 0xff, 0x05};
+        int32_t disp = ((int64_t)slot) - (InstLength + buf.curAddr());
+        *(int32_t*)(&code[4]) = disp;
+        buf.copy(atomic ? code : code + 1, InstLength);
+        return true;
+    }
+    const char* snippetName() const override { return "calledge"; }
+};
+
 BPatch_function* FindFunction(BPatch_image *image, const char* name) {
     std::vector<BPatch_function*> funcs;
     image->findFunction(name , funcs);
@@ -19,39 +62,507 @@ BPatch_function* FindFunction(BPatch_image *image, const char* name) {
     return funcs[0];
 }
 
-int main(int argc, char** argv) {
-    binEdit = bpatch.openBinary(argv[1]);
-    image = binEdit->getImage();
-    std::vector<BPatch_function*>* funcs = image->getProcedures();
-    BPatch_function* main_func = FindFunction(image, "__do_global_dtors_aux");
-
-    binEdit->loadLibrary("libcg.so");
+void parse_command_line(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--edge-table") == 0) {
+            i += 1;
+            edge_table_filename = std::string(argv[i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--minimal-counters") == 0) {
+            i += 1;
+            plan_filename = std::string(argv[i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--sample-period") == 0) {
+            i += 1;
+            sample_period = strtoull(argv[i], NULL, 10);
+            continue;
+        }
+        if (strcmp(argv[i], "--closed-world") == 0) {
+            closedWorld = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--latency") == 0) {
+            i += 1;
+            latency_filename = std::string(argv[i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--cct") == 0) {
+            cct = true;
+            continue;
+        }
+        if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+        if (input_filename == "") {
+            input_filename = std::string(argv[i]);
+        } else {
+            output_filename = std::string(argv[i]);
+        }
+    }
+    if (input_filename == "" || output_filename == "") {
+        fprintf(stderr, "Usage: %s [--edge-table file] [--minimal-counters plan [--closed-world]] [--sample-period n] [--cct] [--latency functions] input output\n", argv[0]);
+        exit(1);
+    }
+    if (cct && (sample_period > 0 || plan_filename != "" || edge_table_filename != "")) {
+        fprintf(stderr, "--cct cannot be used with other counting modes\n");
+        exit(1);
+    }
+    if (latency_filename != "" && (cct || sample_period > 0 || plan_filename != "" || edge_table_filename != "")) {
+        fprintf(stderr, "--latency cannot be used with other counting modes\n");
+        exit(1);
+    }
+}
 
-    BPatch_function* call_graph_func = FindFunction(image, "call_edge");
-    BPatch_function* print_func = FindFunction(image, "print_call_graph");
-    
-    for (auto f : *funcs) {
+// Calls that return go through cct_enter before the call and cct_exit
+// after it, both with the call site, which move the thread's position
+// in the calling context tree of libcg. Tail calls and calls that never return get no probes:
+// the callee then runs in the context of its caller, and no cct_exit
+// is missed.
+void BuildCallingContextTree(std::vector<BPatch_function*>& funcs) {
+    BPatch_function* enter_func = FindFunction(image, "cct_enter");
+    BPatch_function* exit_func = FindFunction(image, "cct_exit");
+    int sites = 0;
+    for (auto f : funcs) {
         std::vector<BPatch_point*> points;
         f->getCallPoints(points);
         BPatch_constExpr from_addr( (uint64_t)(f->getBaseAddr()) );
         for (auto p : points) {
+            PatchBlock* b = Dyninst::PatchAPI::convert(p, BPatch_callBefore)->block();
+            bool returns = false;
+            for (auto e : b->targets()) {
+                if (e->type() == Dyninst::ParseAPI::CALL_FT) returns = true;
+            }
+            if (!returns) continue;
+
             vector<BPatch_snippet *> args;
             args.push_back(&from_addr);
+            // Call sites are named by their return address, like in
+            // the CodeCoverage --pgo-inline file
+            BPatch_constExpr* callsite = new BPatch_constExpr((uint64_t)(b->end()));
+            args.push_back(callsite);
             BPatch_function * callee = p->getCalledFunction();
             if (callee == NULL) {
                 args.push_back(new BPatch_dynamicTargetExpr());
             } else {
                 args.push_back(new BPatch_constExpr((uint64_t)(callee->getBaseAddr())));
             }
-            BPatch_funcCallExpr call_edge(*call_graph_func, args);
-            binEdit->insertSnippet(call_edge, *p, BPatch_callBefore, BPatch_firstSnippet);
+            BPatch_funcCallExpr enter(*enter_func, args);
+            binEdit->insertSnippet(enter, *p, BPatch_callBefore, BPatch_firstSnippet);
+            vector<BPatch_snippet *> exitArgs;
+            exitArgs.push_back(callsite);
+            BPatch_funcCallExpr exit(*exit_func, exitArgs);
+            binEdit->insertSnippet(exit, *p, BPatch_callAfter, BPatch_lastSnippet);
+            ++sites;
         }
     }
+    printf("Track the calling context at %d call sites\n", sites);
+}
+
+// Time the functions listed in the file, one name or 0x address per line.
+// Their entries call latency_enter and their exits call latency_exit
+// with the ID of the function, and latency_enter also gets the table of
+// function addresses, so libcg can size its histograms at the first call.
+// The probes are full calls that save and restore registers around the
+// runtime, which reads the TSC inside, so every latency includes a fixed
+// probe overhead. Subtract the latency of an empty function timed the
+// same way before comparing short functions.
+void TimeFunctions(std::vector<BPatch_function*>& funcs) {
+    FILE* f = fopen(latency_filename.c_str(), "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read %s\n", latency_filename.c_str());
+        exit(1);
+    }
+    std::set<std::string> names;
+    std::set<uint64_t> addrs;
+    char line[4096];
+    while (fscanf(f, "%4095s", line) == 1) {
+        if (strncmp(line, "0x", 2) == 0) {
+            addrs.insert(strtoull(line, NULL, 16));
+        } else {
+            names.insert(std::string(line));
+        }
+    }
+    fclose(f);
+
+    std::vector<BPatch_function*> timed;
+    std::vector<uint64_t> table;
+    for (auto func : funcs) {
+        uint64_t addr = (uint64_t)(func->getBaseAddr());
+        if (addrs.find(addr) == addrs.end() && names.find(func->getName()) == names.end()) continue;
+        timed.push_back(func);
+        table.push_back(addr);
+    }
+    if (timed.empty()) {
+        fprintf(stderr, "None of the functions in %s is in the binary\n", latency_filename.c_str());
+        exit(1);
+    }
+
+    BPatch_variableExpr* tableVar = binEdit->malloc(table.size() * sizeof(uint64_t));
+    tableVar->writeValue(table.data(), table.size() * sizeof(uint64_t), false);
+    BPatch_constExpr tableAddr((uint64_t)(tableVar->getBaseAddr()));
+    BPatch_constExpr n((uint64_t)table.size());
+    BPatch_function* enter_func = FindFunction(image, "latency_enter");
+    BPatch_function* exit_func = FindFunction(image, "latency_exit");
+    for (size_t i = 0; i < timed.size(); ++i) {
+        BPatch_constExpr id((uint64_t)i);
+        std::vector<BPatch_point*> entries, exits;
+        timed[i]->getEntryPoints(entries);
+        timed[i]->getExitPoints(exits);
+
+        vector<BPatch_snippet *> enterArgs;
+        enterArgs.push_back(&id);
+        enterArgs.push_back(&tableAddr);
+        enterArgs.push_back(&n);
+        BPatch_funcCallExpr enter(*enter_func, enterArgs);
+        binEdit->insertSnippet(enter, entries, BPatch_callBefore, BPatch_lastSnippet);
+
+        vector<BPatch_snippet *> exitArgs;
+        exitArgs.push_back(&id);
+        BPatch_funcCallExpr exit(*exit_func, exitArgs);
+        binEdit->insertSnippet(exit, exits, BPatch_callBefore, BPatch_firstSnippet);
+    }
+    printf("Time %lu functions\n", timed.size());
+}
+
+BPatch_variableExpr* AllocateCounters(uint64_t n) {
+    std::vector<uint64_t> zeros(n, 0);
+    BPatch_variableExpr* counters = binEdit->malloc(n * sizeof(uint64_t));
+    counters->writeValue(zeros.data(), n * sizeof(uint64_t), false);
+    return counters;
+}
+
+// With --sample-period, counters are incremented without the lock prefix.
+// Threads that increment the same counter at the same time may then lose
+// some counts, which is within the error the sampled mode already accepts.
+void InsertCounter(BPatch_point* p, BPatch_variableExpr* counters, uint64_t id) {
+    Dyninst::Address slot = (Dyninst::Address)(counters->getBaseAddr()) + id * sizeof(uint64_t);
+    Dyninst::PatchAPI::Point* pt = Dyninst::PatchAPI::convert(p, BPatch_callBefore);
+    pt->pushBack(EdgeCounterSnippet::create(new EdgeCounterSnippet(slot, sample_period == 0)));
+}
+
+// Give every (caller, callee) pair of direct calls an edge ID and count it
+// inline at each of its call sites. The edge table holds the caller and
+// callee address of every edge ID. With --sample-period, every call site
+// gets its own edge ID instead, so sites of the same edge do not share a
+// counter, and libcg adds up the IDs of an edge when it merges them.
+void CountDirectEdges(std::vector< std::pair<BPatch_point*, BPatch_function*> >& directCalls, vector<BPatch_snippet*>& exitSnippets) {
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> edgeIds;
+    std::vector<std::pair<uint64_t, uint64_t> > edgeTable;
+    std::vector<uint64_t> siteIds;
+    for (auto &it : directCalls) {
+        std::pair<uint64_t, uint64_t> edge((uint64_t)(it.first->getFunction()->getBaseAddr()), (uint64_t)(it.second->getBaseAddr()));
+        auto idIt = edgeIds.find(edge);
+        if (idIt != edgeIds.end() && sample_period == 0) {
+            siteIds.push_back(idIt->second);
+            continue;
+        }
+        edgeIds[edge] = edgeTable.size();
+        siteIds.push_back(edgeTable.size());
+        edgeTable.push_back(edge);
+    }
+
+    uint64_t totalEdges = edgeTable.size();
+    if (totalEdges > 0) {
+        std::vector<uint64_t> table;
+        for (auto &e : edgeTable) {
+            table.push_back(e.first);
+            table.push_back(e.second);
+        }
+        BPatch_variableExpr* tableVar = binEdit->malloc(totalEdges * 2 * sizeof(uint64_t));
+        tableVar->writeValue(table.data(), totalEdges * 2 * sizeof(uint64_t), false);
+        BPatch_variableExpr* counterVar = AllocateCounters(totalEdges);
+        for (size_t i = 0; i < directCalls.size(); ++i) {
+            InsertCounter(directCalls[i].first, counterVar, siteIds[i]);
+        }
+        BPatch_function* counters_func = FindFunction(image, "call_edge_counters");
+        vector<BPatch_snippet*> args;
+        args.push_back(new BPatch_constExpr((uint64_t)(tableVar->getBaseAddr())));
+        args.push_back(new BPatch_constExpr((uint64_t)(counterVar->getBaseAddr())));
+        args.push_back(new BPatch_constExpr(totalEdges));
+        exitSnippets.push_back(new BPatch_funcCallExpr(*counters_func, args));
+    }
+    printf("Count %lu direct call sites inline with %lu edge counters\n", directCalls.size(), totalEdges);
+
+    if (edge_table_filename != "") {
+        FILE* f = fopen(edge_table_filename.c_str(), "w");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot write %s\n", edge_table_filename.c_str());
+            return;
+        }
+        fprintf(f, "%lu\n", totalEdges);
+        for (uint64_t i = 0; i < totalEdges; ++i) {
+            fprintf(f, "%lu %lx %lx\n", i, edgeTable[i].first, edgeTable[i].second);
+        }
+        fclose(f);
+    }
+}
+
+static void IntraSuccessors(PatchBlock* b, std::vector<PatchBlock*>& succs) {
+    for (auto e : b->targets()) {
+        if (e->sinkEdge() || e->interproc()) continue;
+        if (e->type() == Dyninst::ParseAPI::CATCH) continue;
+        succs.push_back(e->trg());
+    }
+}
+
+// A block runs exactly once per invocation that returns if it is on
+// every path from the entry to a return and is not on any cycle
+static bool RunsOncePerInvocation(PatchFunction* pf, PatchBlock* b) {
+    if (pf->exitBlocks().empty()) return false;
+    std::set<PatchBlock*> visited;
+    std::vector<PatchBlock*> stack;
+    IntraSuccessors(b, stack);
+    while (!stack.empty()) {
+        PatchBlock* cur = stack.back();
+        stack.pop_back();
+        if (cur == b) return false;
+        if (!visited.insert(cur).second) continue;
+        IntraSuccessors(cur, stack);
+    }
+
+    if (pf->entry() == b) return true;
+    visited.clear();
+    visited.insert(b);
+    stack.push_back(pf->entry());
+    while (!stack.empty()) {
+        PatchBlock* cur = stack.back();
+        stack.pop_back();
+        if (!visited.insert(cur).second) continue;
+        if (pf->exitBlocks().find(cur) != pf->exitBlocks().end()) return false;
+        IntraSuccessors(cur, stack);
+    }
+    return true;
+}
+
+// Count the fewest function entries and direct call sites that let the
+// other direct call sites be derived by CallEdgeSolver. The counters
+// are dumped raw at exit and CallGraphTool reconstruct turns them into
+// the call graph, with the plan written here.
+void CountMinimalEdges(std::vector<BPatch_function*>& funcs,
+                       std::vector< std::pair<BPatch_point*, BPatch_function*> >& directCalls,
+                       vector<BPatch_snippet*>& exitSnippets) {
+    CallEdgeSolver solver;
+    std::map<uint64_t, int> funcIndex;
+    for (auto f : funcs) {
+        funcIndex[(uint64_t)(f->getBaseAddr())] = solver.funcs.size();
+        solver.funcs.push_back(SolverFunction{false, 0, std::vector<int>(), std::vector<int>()});
+    }
+
+    // Functions entered through a tail call have entries
+    // that are not call sites, so they are never closed
+    std::set<int> tailCalled;
+    for (auto f : funcs) {
+        PatchFunction* pf = Dyninst::PatchAPI::convert(f);
+        for (auto b : pf->blocks()) {
+            for (auto e : b->targets()) {
+                if (e->sinkEdge() || !e->interproc() || e->type() == Dyninst::ParseAPI::CALL) continue;
+                auto it = funcIndex.find(e->trg()->start());
+                if (it != funcIndex.end()) tailCalled.insert(it->second);
+            }
+        }
+    }
+
+    std::map<BPatch_function*, std::map<uint64_t, PatchBlock*> > callBlocks;
+    for (auto &it : directCalls) {
+        BPatch_function* caller = it.first->getFunction();
+        PatchFunction* pf = Dyninst::PatchAPI::convert(caller);
+        auto& blocks = callBlocks[caller];
+        if (blocks.empty()) {
+            for (auto b : pf->callBlocks()) {
+                blocks[b->last()] = b;
+            }
+        }
+        SolverSite site;
+        site.caller = funcIndex[(uint64_t)(caller->getBaseAddr())];
+        auto calleeIt = funcIndex.find((uint64_t)(it.second->getBaseAddr()));
+        site.callee = calleeIt == funcIndex.end() ? -1 : calleeIt->second;
+        auto blockIt = blocks.find((uint64_t)(it.first->getAddress()));
+        site.once = blockIt != blocks.end() && RunsOncePerInvocation(pf, blockIt->second);
+        int s = solver.sites.size();
+        solver.sites.push_back(site);
+        if (site.once) solver.funcs[site.caller].onceSites.push_back(s);
+        if (site.callee >= 0) solver.funcs[site.callee].inSites.push_back(s);
+    }
+
+    // Under the closed world assumption, a function with direct callers is
+    // only entered by calls from the binary, which are all observed
+    for (size_t f = 0; f < solver.funcs.size(); ++f) {
+        SolverFunction& sf = solver.funcs[f];
+        sf.closed = closedWorld && !sf.inSites.empty() && tailCalled.find(f) == tailCalled.end();
+    }
+
+    // Count the entry of a function if that replaces more than one counter:
+    // each once per invocation call site, and one incoming call site
+    // of a closed function
+    solver.init();
+    std::vector<bool> entryMeasured(solver.funcs.size(), false);
+    std::vector<bool> siteMeasured(solver.sites.size(), false);
+    for (size_t f = 0; f < solver.funcs.size(); ++f) {
+        SolverFunction& sf = solver.funcs[f];
+        size_t saved = sf.onceSites.size() + (sf.closed ? 1 : 0);
+        if (saved < 2) continue;
+        entryMeasured[f] = true;
+        solver.setEntry(f, 0);
+    }
+    solver.propagate();
+
+    // Then count incoming call sites until every one of them is known,
+    // leaving the last one of a closed function to its equation
+    for (size_t g = 0; g < solver.funcs.size(); ++g) {
+        std::vector<int> unknown;
+        for (auto s : solver.funcs[g].inSites) {
+            if (!solver.siteKnown[s]) unknown.push_back(s);
+        }
+        if (unknown.empty()) continue;
+        if (solver.funcs[g].closed && solver.entryKnown[g]) unknown.pop_back();
+        for (auto s : unknown) {
+            siteMeasured[s] = true;
+            solver.setSite(s, 0);
+        }
+        solver.propagate();
+    }
+    for (size_t s = 0; s < solver.sites.size(); ++s) {
+        if (solver.siteKnown[s]) continue;
+        siteMeasured[s] = true;
+        solver.setSite(s, 0);
+        solver.propagate();
+    }
+
+    std::vector<int> entryCounter(solver.funcs.size(), -1);
+    std::vector<int> siteCounter(solver.sites.size(), -1);
+    int totalCounters = 0;
+    for (size_t f = 0; f < solver.funcs.size(); ++f) {
+        if (entryMeasured[f]) entryCounter[f] = totalCounters++;
+    }
+    for (size_t s = 0; s < solver.sites.size(); ++s) {
+        if (siteMeasured[s]) siteCounter[s] = totalCounters++;
+    }
+
+    if (totalCounters > 0) {
+        BPatch_variableExpr* counterVar = AllocateCounters(totalCounters);
+        for (size_t f = 0; f < solver.funcs.size(); ++f) {
+            if (entryCounter[f] < 0) continue;
+            std::vector<BPatch_point*> points;
+            funcs[f]->getEntryPoints(points);
+            for (auto p : points) {
+                InsertCounter(p, counterVar, entryCounter[f]);
+            }
+        }
+        for (size_t s = 0; s < solver.sites.size(); ++s) {
+            if (siteCounter[s] < 0) continue;
+            InsertCounter(directCalls[s].first, counterVar, siteCounter[s]);
+        }
+        BPatch_function* raw_func = FindFunction(image, "call_edge_raw_counters");
+        vector<BPatch_snippet*> args;
+        args.push_back(new BPatch_constExpr((uint64_t)(counterVar->getBaseAddr())));
+        args.push_back(new BPatch_constExpr((uint64_t)totalCounters));
+        exitSnippets.push_back(new BPatch_funcCallExpr(*raw_func, args));
+    }
+    printf("Count %d of %lu direct call sites and %d function entries\n",
+        totalCounters - (int)std::count(entryMeasured.begin(), entryMeasured.end(), true),
+        solver.sites.size(), (int)std::count(entryMeasured.begin(), entryMeasured.end(), true));
+
+    FILE* f = fopen(plan_filename.c_str(), "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s\n", plan_filename.c_str());
+        exit(1);
+    }
+    fprintf(f, "%lu %lu %d\n", solver.funcs.size(), solver.sites.size(), totalCounters);
+    for (size_t i = 0; i < solver.funcs.size(); ++i) {
+        fprintf(f, "F %lx %d %d\n", (uint64_t)(funcs[i]->getBaseAddr()), solver.funcs[i].closed ? 1 : 0, entryCounter[i]);
+    }
+    for (size_t i = 0; i < solver.sites.size(); ++i) {
+        SolverSite& s = solver.sites[i];
+        fprintf(f, "S %d %d %lx %d %d\n", s.caller, s.callee, (uint64_t)(directCalls[i].second->getBaseAddr()),
+            s.once ? 1 : 0, siteCounter[i]);
+    }
+    fclose(f);
+}
+
+int main(int argc, char** argv) {
+    parse_command_line(argc, argv);
+    binEdit = bpatch.openBinary(input_filename.c_str());
+    image = binEdit->getImage();
+    std::vector<BPatch_function*>* funcs = image->getProcedures();
+    BPatch_function* main_func = FindFunction(image, "__do_global_dtors_aux");
+
+    binEdit->loadLibrary("libcg.so");
+
+    BPatch_function* call_graph_func = FindFunction(image, "call_edge_indirect");
+    BPatch_function* print_func = FindFunction(image, "print_call_graph");
+
+    // At exit, hand the inline counters to the runtime and print the call graph
+    vector<BPatch_snippet*> exitSnippets;
+    if (cct) {
+        BuildCallingContextTree(*funcs);
+    } else if (latency_filename != "") {
+        TimeFunctions(*funcs);
+    } else {
+        // Calls with a dynamic target go through call_edge_indirect in the
+        // runtime, which also profiles their targets per call site.
+        // With --sample-period they go through call_edge_sampled instead,
+        // where each thread counts down a random number of calls before it
+        // records one. The countdown is thread local in libcg, so it is not
+        // inlined. Direct calls are always counted inline, which is cheaper
+        // than any call into the runtime, and without a locked instruction
+        // in sampled mode, see InsertCounter.
+        BPatch_function* sampled_func = FindFunction(image, "call_edge_sampled");
+        BPatch_constExpr period(sample_period);
+        std::vector< std::pair<BPatch_point*, BPatch_function*> > directCalls;
+        for (auto f : *funcs) {
+            std::vector<BPatch_point*> points;
+            f->getCallPoints(points);
+            BPatch_constExpr from_addr( (uint64_t)(f->getBaseAddr()) );
+            for (auto p : points) {
+                BPatch_function * callee = p->getCalledFunction();
+                if (callee != NULL) {
+                    directCalls.push_back(std::make_pair(p, callee));
+                    continue;
+                }
+                vector<BPatch_snippet *> args;
+                args.push_back(&from_addr);
+                if (sample_period > 0) {
+                    args.push_back(new BPatch_dynamicTargetExpr());
+                    args.push_back(&period);
+                    BPatch_funcCallExpr call_edge(*sampled_func, args);
+                    binEdit->insertSnippet(call_edge, *p, BPatch_callBefore, BPatch_firstSnippet);
+                    continue;
+                }
+                PatchBlock* b = Dyninst::PatchAPI::convert(p, BPatch_callBefore)->block();
+                args.push_back(new BPatch_constExpr((uint64_t)(b->end())));
+                args.push_back(new BPatch_dynamicTargetExpr());
+                BPatch_funcCallExpr call_edge(*call_graph_func, args);
+                binEdit->insertSnippet(call_edge, *p, BPatch_callBefore, BPatch_firstSnippet);
+            }
+        }
+        if (sample_period > 0) {
+            printf("Sample one dynamic call out of %lu on average\n", sample_period);
+        }
+        if (plan_filename != "") {
+            CountMinimalEdges(*funcs, directCalls, exitSnippets);
+        } else {
+            CountDirectEdges(directCalls, exitSnippets);
+        }
+    }
+    // Also hand the inline counters to the runtime when main starts,
+    // so libcg can stream them before the process exits
+    BPatch_function* start_func = FindFunction(image, "main");
+    if (start_func != NULL && !exitSnippets.empty()) {
+        BPatch_sequence registration(exitSnippets);
+        std::vector<BPatch_point*> entries;
+        start_func->getEntryPoints(entries);
+        binEdit->insertSnippet(registration, entries, BPatch_callBefore, BPatch_firstSnippet);
+    }
+
+    vector<BPatch_snippet*> args;
+    exitSnippets.push_back(new BPatch_funcCallExpr(*print_func, args));
+    BPatch_sequence print(exitSnippets);
 
     std::vector<BPatch_point*> points;
     main_func->getExitPoints(points);
-    vector<BPatch_snippet*> args;
-    BPatch_funcCallExpr print(*print_func, args);
     binEdit->insertSnippet(print, points, BPatch_callAfter, BPatch_firstSnippet);
-    binEdit->writeFile(argv[2]);
+    binEdit->writeFile(output_filename.c_str());
 }
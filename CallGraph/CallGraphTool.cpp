@@ -0,0 +1,413 @@
+// Offline processing of the profiles written by libcg.
+//
+// CallGraphTool reconstruct --plan file --counters file [--dynamic file] --output file
+//     Rebuild the weighted call graph of a binary rewritten with
+//     CallGraph --minimal-counters from the plan, the raw counters and
+//     the call graph printed by libcg, which holds the calls with
+//     a dynamic target. The output has the format FuncSort reads.
+//
+// CallGraphTool cct-callsites --cct file --output file
+//     Sum the calling context tree written by CallGraph --cct over all
+//     contexts into one count per call site and callee, in the format
+//     of the CodeCoverage --pgo-inline file.
+//
+// CallGraphTool merge --output file [--counters file] stream...
+//     Add up the streams libcg writes with CALL_GRAPH_STREAM, one per
+//     process, into a call graph and, for CallGraph --minimal-counters,
+//     the raw counters that CallGraphTool reconstruct reads.
+
+#include "CallEdgeSolver.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+struct CallGraphEdge {
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+    CallGraphEdge(uint64_t f, uint64_t t, uint64_t c):
+        from(f), to(t), count(c)
+    {}
+    bool operator< (const CallGraphEdge& rhs) const {
+        if (count != rhs.count)
+            return count > rhs.count;
+        if (from != rhs.from)
+            return from < rhs.from;
+        return to < rhs.to;
+    }
+};
+
+typedef std::map<uint64_t, std::map<uint64_t, uint64_t> > CallGraphMap;
+
+static bool readCallGraph(const char* filename, CallGraphMap& call_graph) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return false;
+    int totalEdges;
+    if (fscanf(f, "%d", &totalEdges) != 1) {
+        fclose(f);
+        return false;
+    }
+    uint64_t from, to, count;
+    for (int i = 0; i < totalEdges && fscanf(f, "%lx %lx %lu", &from, &to, &count) == 3; ++i) {
+        call_graph[from][to] += count;
+    }
+    fclose(f);
+    return true;
+}
+
+static bool writeCallGraph(const char* filename, CallGraphMap& call_graph) {
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) return false;
+    std::vector<CallGraphEdge> edges;
+    for (auto &it : call_graph) {
+        for (auto &it2 : it.second) {
+            if (it2.second == 0) continue;
+            edges.push_back(CallGraphEdge(it.first, it2.first, it2.second));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    fprintf(f, "%lu\n", edges.size());
+    for (auto &e : edges) {
+        fprintf(f, "%lx %lx %lu\n", e.from, e.to, e.count);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool readCounters(const char* filename, std::vector<uint64_t>& counters) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return false;
+    uint64_t n, c;
+    if (fscanf(f, "%lu", &n) != 1) {
+        fclose(f);
+        return false;
+    }
+    while (counters.size() < n && fscanf(f, "%lu", &c) == 1) {
+        counters.push_back(c);
+    }
+    fclose(f);
+    return counters.size() == n;
+}
+
+static int reconstruct(int argc, char** argv) {
+    const char* plan_filename = NULL;
+    const char* counters_filename = NULL;
+    const char* dynamic_filename = NULL;
+    const char* output_filename = NULL;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--plan") == 0) {
+            plan_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--counters") == 0) {
+            counters_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dynamic") == 0) {
+            dynamic_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--output") == 0) {
+            output_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(1);
+    }
+    if (plan_filename == NULL || counters_filename == NULL || output_filename == NULL) {
+        fprintf(stderr, "Usage: CallGraphTool reconstruct --plan file --counters file [--dynamic file] --output file\n");
+        exit(1);
+    }
+
+    std::vector<uint64_t> counters;
+    if (!readCounters(counters_filename, counters)) {
+        fprintf(stderr, "Cannot read %s\n", counters_filename);
+        exit(1);
+    }
+    CallGraphMap call_graph;
+    if (dynamic_filename != NULL && !readCallGraph(dynamic_filename, call_graph)) {
+        fprintf(stderr, "Cannot read %s\n", dynamic_filename);
+        exit(1);
+    }
+
+    FILE* f = fopen(plan_filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read %s\n", plan_filename);
+        exit(1);
+    }
+    size_t totalFuncs, totalSites;
+    int totalCounters;
+    if (fscanf(f, "%lu %lu %d", &totalFuncs, &totalSites, &totalCounters) != 3 || totalCounters != (int)counters.size()) {
+        fprintf(stderr, "Plan %s does not match the %lu counters\n", plan_filename, counters.size());
+        exit(1);
+    }
+    CallEdgeSolver solver;
+    std::vector<uint64_t> funcAddrs, calleeAddrs;
+    std::vector<int> entryCounter, siteCounter;
+    std::map<uint64_t, int> funcIndex;
+    for (size_t i = 0; i < totalFuncs; ++i) {
+        uint64_t addr;
+        int closed, counter;
+        if (fscanf(f, " F %lx %d %d", &addr, &closed, &counter) != 3) break;
+        funcIndex[addr] = i;
+        funcAddrs.push_back(addr);
+        entryCounter.push_back(counter);
+        solver.funcs.push_back(SolverFunction{closed != 0, 0, std::vector<int>(), std::vector<int>()});
+    }
+    for (size_t i = 0; i < totalSites; ++i) {
+        SolverSite site;
+        uint64_t callee;
+        int once, counter;
+        if (fscanf(f, " S %d %d %lx %d %d", &site.caller, &site.callee, &callee, &once, &counter) != 5) break;
+        site.once = once != 0;
+        if (site.once) solver.funcs[site.caller].onceSites.push_back(i);
+        if (site.callee >= 0) solver.funcs[site.callee].inSites.push_back(i);
+        solver.sites.push_back(site);
+        calleeAddrs.push_back(callee);
+        siteCounter.push_back(counter);
+    }
+    fclose(f);
+    if (solver.funcs.size() != totalFuncs || solver.sites.size() != totalSites) {
+        fprintf(stderr, "Cannot read %s\n", plan_filename);
+        exit(1);
+    }
+
+    // Calls with a dynamic target enter closed functions too
+    for (auto &it : call_graph) {
+        for (auto &it2 : it.second) {
+            auto fIt = funcIndex.find(it2.first);
+            if (fIt != funcIndex.end()) solver.funcs[fIt->second].dynamicCalls += it2.second;
+        }
+    }
+
+    solver.init();
+    for (size_t i = 0; i < totalFuncs; ++i) {
+        if (entryCounter[i] >= 0) solver.setEntry(i, counters[entryCounter[i]]);
+    }
+    for (size_t i = 0; i < totalSites; ++i) {
+        if (siteCounter[i] >= 0) solver.setSite(i, counters[siteCounter[i]]);
+    }
+    solver.propagate();
+
+    int unknown = 0;
+    for (size_t i = 0; i < totalSites; ++i) {
+        if (!solver.siteKnown[i]) {
+            ++unknown;
+            continue;
+        }
+        call_graph[funcAddrs[solver.sites[i].caller]][calleeAddrs[i]] += (uint64_t)(solver.siteCount[i] + 0.5);
+    }
+    if (unknown > 0) {
+        fprintf(stderr, "%d call sites cannot be derived from the counters\n", unknown);
+    }
+    if (solver.negative > 0) {
+        fprintf(stderr, "%d derived call sites are negative, the closed world assumption does not hold\n", solver.negative);
+    }
+    if (!writeCallGraph(output_filename, call_graph)) {
+        fprintf(stderr, "Cannot write %s\n", output_filename);
+        exit(1);
+    }
+    return 0;
+}
+
+static int cctCallsites(int argc, char** argv) {
+    const char* cct_filename = NULL;
+    const char* output_filename = NULL;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--cct") == 0) {
+            cct_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--output") == 0) {
+            output_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(1);
+    }
+    if (cct_filename == NULL || output_filename == NULL) {
+        fprintf(stderr, "Usage: CallGraphTool cct-callsites --cct file --output file\n");
+        exit(1);
+    }
+
+    FILE* f = fopen(cct_filename, "r");
+    uint64_t totalNodes;
+    if (f == NULL || fscanf(f, "%lu", &totalNodes) != 1) {
+        fprintf(stderr, "Cannot read %s\n", cct_filename);
+        exit(1);
+    }
+    CallGraphMap callsites;
+    int depth;
+    uint64_t from, callsite, to, count;
+    for (uint64_t i = 0; i < totalNodes && fscanf(f, "%d %lx %lx %lx %lu", &depth, &from, &callsite, &to, &count) == 5; ++i) {
+        callsites[callsite][to] += count;
+    }
+    fclose(f);
+
+    std::vector<CallGraphEdge> edges;
+    for (auto &it : callsites) {
+        for (auto &it2 : it.second) {
+            edges.push_back(CallGraphEdge(it.first, it2.first, it2.second));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    f = fopen(output_filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s\n", output_filename);
+        exit(1);
+    }
+    for (auto &e : edges) {
+        fprintf(f, "%lx %lx %lu\n", e.from, e.to, e.count);
+    }
+    fclose(f);
+    return 0;
+}
+
+static const char StreamMagic[8] = {'L', 'I', 'B', 'C', 'G', 'S', 'T', '1'};
+static const uint64_t StreamEdges = 1;
+static const uint64_t StreamCounters = 2;
+
+static bool getVarint(const std::vector<unsigned char>& buf, size_t& pos, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; pos < buf.size() && shift < 64; shift += 7) {
+        unsigned char c = buf[pos++];
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Returns the number of complete batches, or -1 if the file is not a stream
+static int readStream(const char* filename, CallGraphMap& call_graph, std::vector<uint64_t>& counters) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) return -1;
+    std::vector<unsigned char> buf;
+    unsigned char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+    fclose(f);
+    if (buf.size() < sizeof(StreamMagic) || memcmp(buf.data(), StreamMagic, sizeof(StreamMagic)) != 0) return -1;
+    size_t pos = sizeof(StreamMagic);
+    uint64_t pid, ppid;
+    if (!getVarint(buf, pos, pid) || !getVarint(buf, pos, ppid)) return 0;
+
+    int batches = 0;
+    while (pos < buf.size()) {
+        // Apply a batch only when it is complete, the process may have
+        // died while writing the last one
+        uint64_t type, time, total = 0, records;
+        if (!getVarint(buf, pos, type) || !getVarint(buf, pos, time)) break;
+        if (type == StreamCounters && !getVarint(buf, pos, total)) break;
+        if (!getVarint(buf, pos, records)) break;
+        bool complete = true;
+        std::vector<uint64_t> values;
+        int width = type == StreamEdges ? 3 : 2;
+        for (uint64_t i = 0; i < records * width && complete; ++i) {
+            uint64_t v;
+            complete = getVarint(buf, pos, v);
+            values.push_back(v);
+        }
+        if (!complete) break;
+        if (type == StreamEdges) {
+            uint64_t from = 0;
+            for (size_t i = 0; i < values.size(); i += 3) {
+                from += values[i];
+                call_graph[from][values[i + 1]] += values[i + 2];
+            }
+        } else if (type == StreamCounters) {
+            // Counters that never moved are not in any record
+            if (total > counters.size()) counters.resize(total, 0);
+            for (size_t i = 0; i < values.size(); i += 2) {
+                if (values[i] >= counters.size()) counters.resize(values[i] + 1, 0);
+                counters[values[i]] += values[i + 1];
+            }
+        } else {
+            break;
+        }
+        ++batches;
+    }
+    return batches;
+}
+
+static int merge(int argc, char** argv) {
+    const char* output_filename = NULL;
+    const char* counters_filename = NULL;
+    std::vector<const char*> streams;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--output") == 0) {
+            output_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--counters") == 0) {
+            counters_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+        streams.push_back(argv[i]);
+    }
+    if (output_filename == NULL || streams.empty()) {
+        fprintf(stderr, "Usage: CallGraphTool merge --output file [--counters file] stream...\n");
+        exit(1);
+    }
+
+    CallGraphMap call_graph;
+    std::vector<uint64_t> counters;
+    for (auto filename : streams) {
+        int batches = readStream(filename, call_graph, counters);
+        if (batches < 0) {
+            fprintf(stderr, "%s is not a libcg stream\n", filename);
+            exit(1);
+        }
+        printf("Read %d batches from %s\n", batches, filename);
+    }
+    if (!writeCallGraph(output_filename, call_graph)) {
+        fprintf(stderr, "Cannot write %s\n", output_filename);
+        exit(1);
+    }
+    if (counters_filename != NULL) {
+        FILE* f = fopen(counters_filename, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot write %s\n", counters_filename);
+            exit(1);
+        }
+        fprintf(f, "%lu\n", counters.size());
+        for (auto c : counters) {
+            fprintf(f, "%lu\n", c);
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "reconstruct") == 0) {
+        return reconstruct(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "cct-callsites") == 0) {
+        return cctCallsites(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "merge") == 0) {
+        return merge(argc - 2, argv + 2);
+    }
+    fprintf(stderr, "Usage: %s reconstruct|cct-callsites|merge [options]\n", argv[0]);
+    return 1;
+}
@@ -6,6 +6,11 @@
 #include "BPatch_object.h"
 #include "BPatch_point.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include "../CodeCoverage/CallChainClustering.hpp"
+
 using namespace Dyninst;
 
 BPatch bpatch;
@@ -13,71 +18,97 @@ BPatch_binaryEdit *binEdit;
 BPatch_image* image;
 InstSpec is;
 
+uint64_t page_size = 4096;
+uint64_t huge_page_size = 2 << 20;
+
 std::map<uint64_t, int> funcOrder;
 
-void LoadCallGraph(const char* filename) {
+// Order the profiled functions with call-chain clustering, see
+// CallChainClustering.hpp, which CodeCoverage also uses
+void LoadCallGraph(const char* filename, std::vector<BPatch_function*>& procs) {
     FILE* f = fopen(filename, "r");
-    int totalEdges;
-    fscanf(f, "%d", &totalEdges);
-    std::map<uint64_t, std::vector<uint64_t>* > addr_maps; 
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read %s\n", filename);
+        exit(1);
+    }
+    std::vector<uint64_t> addrs, sizes;
+    std::set<uint64_t> seen;
+    for (auto p : procs) {
+        uint64_t addr = (uint64_t)(p->getBaseAddr());
+        if (!seen.insert(addr).second) continue;
+        addrs.push_back(addr);
+        sizes.push_back(p->getFootprint());
+    }
+    CallChainClustering c3(addrs, sizes);
 
+    int totalEdges;
+    if (fscanf(f, "%d", &totalEdges) != 1) totalEdges = 0;
     for (int i = 0; i < totalEdges; ++i) {
         uint64_t from, to, count;
-        fscanf(f, "%lx %lx %lu", &from, &to, &count);
-        if (from == to) continue;
-        auto from_it = addr_maps.find(from);
-        if (from_it == addr_maps.end()) {
-            std::vector<uint64_t>* from_vec = new std::vector<uint64_t>;
-            from_vec->push_back(from);
-            from_it = addr_maps.insert(make_pair(from, from_vec)).first;
-        }
-        auto to_it = addr_maps.find(to);
-        if (to_it == addr_maps.end()) {
-            from_it->second->push_back(to);
-        } else if (to_it->second != from_it->second) {
-            std::vector<uint64_t>* to_vec = to_it->second;
-            from_it->second->insert(from_it->second->end(), to_vec->begin(), to_vec->end());
-            for (auto addr: *to_vec) {
-                addr_maps[addr] = from_it->second;
-            }
-            delete to_vec;
-        }
+        if (fscanf(f, "%lx %lx %lu", &from, &to, &count) != 3) break;
+        c3.addCalls(from, to, count);
+    }
+    fclose(f);
+
+    c3.cluster(page_size);
+    const std::vector<int>& order = c3.getOrder();
+    for (size_t i = 0; i < order.size(); ++i) {
+        printf("%lx\n", addrs[order[i]]);
+        funcOrder[addrs[order[i]]] = i;
     }
-    std::vector<uint64_t> order;
-    set< std::vector<uint64_t>* > processed;
-    for (auto it : addr_maps) {
-        if (processed.find(it.second) != processed.end()) continue;
-        processed.insert(it.second);
-        order.insert(order.end(), it.second->begin(), it.second->end());
+    printf("Cluster %lu hot functions into %lu clusters\n", order.size(), c3.getClusterCount());
+    printf("Hot text: %lu bytes, %lu pages of %lu bytes before, %lu after, %lu pages of %lu bytes before, %lu after\n",
+        c3.hotBytes(),
+        c3.hotPages(page_size, false), page_size, c3.hotPages(page_size, true),
+        c3.hotPages(huge_page_size, false), huge_page_size, c3.hotPages(huge_page_size, true));
+}
+
+void parse_command_line(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s input output call_graph [--page-size n]\n", argv[0]);
+        exit(1);
     }
-    int i = 0;
-    for (auto addr : order) {
-        printf("%lx\n", addr);
-        funcOrder[addr] = i++;
+    for (int i = 4; i < argc; ++i) {
+        if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            i += 1;
+            page_size = strtoull(argv[i], NULL, 0);
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(1);
     }
 }
 
 int main(int argc, char** argv) {
+    parse_command_line(argc, argv);
     bpatch.setRelocateJumpTable(true);
     bpatch.setRelocateFunctionPointer(true);
     is.trampGuard = false;
     is.redZone = false;
-    LoadCallGraph(argv[3]);
     binEdit = bpatch.openBinary(argv[1]);
     image = binEdit->getImage();
     std::vector<BPatch_function*>* funcs = image->getProcedures();
+    LoadCallGraph(argv[3], *funcs);
+
+    // Only the profiled functions get a snippet, which makes Dyninst
+    // relocate them into the new code section in the cluster order.
+    // The others stay where they are in the original .text, and calls
+    // from them reach the hot functions through the branch Dyninst
+    // leaves at the original entries.
     BPatch_nullExpr nopSnippet;
+    int relocated = 0;
     for (auto f : *funcs) {
         if (f->getName() == "_fini") continue;
         if (f->getName() == "_init") continue;
         uint64_t addr = (uint64_t) (f->getBaseAddr());
-        int order = 10000000;
-        if (funcOrder.find(addr) != funcOrder.end()) order = funcOrder[addr];
-        f->setLayoutOrder(order);
+        auto it = funcOrder.find(addr);
+        if (it == funcOrder.end()) continue;
+        f->setLayoutOrder(it->second);
         vector<BPatch_point*> points;
         f->getEntryPoints(points);
         binEdit->insertSnippet(nopSnippet, points, BPatch_callBefore, BPatch_lastSnippet, &is);
-
+        ++relocated;
     }
+    printf("Relocate %d of %lu functions\n", relocated, funcs->size());
     binEdit->writeFile(argv[2]);
 }
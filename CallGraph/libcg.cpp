@@ -1,10 +1,80 @@
 #include <map>
+#include <tuple>
+#include <mutex>
 #include <vector>
 #include <cstdio>
+#include <cstdint>
+#include <string>
 #include <algorithm>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
 
-std::map<uint64_t, std::map<uint64_t, uint64_t> > call_graph;
+// Call edges are counted in a fixed capacity open addressing table per
+// thread, so the common path takes no lock and allocates nothing.
+// An edge that does not fit in its thread's table goes to the overflow
+// table, shared by all threads and also allocated with mmap, whose
+// slots are claimed with a compare and swap. Calls that find no slot
+// there either are dropped and counted. print_call_graph merges all of
+// them and reports the dropped calls.
+//
+// Sampled edges go to separate tables, whose counts are scaled
+// by the sample period when they are merged.
+static const uint64_t TableCapacity = 1 << 14;
+static const uint64_t MaxProbe = 16;
+static const uint64_t OverflowCapacity = 1 << 16;
+static const uint64_t OverflowMaxProbe = 64;
+
+struct EdgeSlot {
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+};
+
+struct EdgeTable {
+    EdgeSlot slots[TableCapacity];
+    EdgeTable* next;
+    uint64_t weight;
+};
+
+// Tables are never freed, so the edges of exited threads are kept
+static EdgeTable* all_tables = NULL;
+static __thread EdgeTable* thread_table __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread bool table_failed __attribute__((tls_model("initial-exec"))) = false;
+static __thread EdgeTable* sampled_table __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread bool sampled_failed __attribute__((tls_model("initial-exec"))) = false;
+
+// Every thread records one call out of a random number of calls,
+// uniform in [1, 2 * period - 1] so the sampling does not alias
+// with periodic call patterns
+static __thread int64_t sample_countdown __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec"))) = 0;
+
+// State that the dumper threads use is either constant initialized with
+// a trivial destructor, like std::mutex, or allocated and never freed,
+// so it stays valid while static destructors run at exit
+static EdgeSlot* overflow_table = NULL;
+static uint64_t overflow_dropped = 0;
+
+// Direct call edges are counted inline in the rewritten binary.
+// The edge table holds the caller and callee of every edge ID.
+static const uint64_t* inline_edge_table = NULL;
+static const uint64_t* inline_edge_counters = NULL;
+static uint64_t inline_edge_count = 0;
+
+// With CallGraph --minimal-counters, the inline counters are function
+// entries and call sites chosen by the plan, and are dumped raw
+// for CallGraphTool reconstruct
+static const uint64_t* raw_counters = NULL;
+static uint64_t raw_counter_count = 0;
 
 struct CallGraphEdge {
     uint64_t from;
@@ -23,10 +93,991 @@ struct CallGraphEdge {
 
 };
 
+static EdgeTable* new_table(uint64_t weight) {
+    // Use mmap instead of malloc, as the instrumented program
+    // may be inside malloc when it makes a call
+    void* mem = mmap(NULL, sizeof(EdgeTable), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    EdgeTable* table = (EdgeTable*)mem;
+    table->weight = weight;
+    EdgeTable* head = __atomic_load_n(&all_tables, __ATOMIC_ACQUIRE);
+    do {
+        table->next = head;
+    } while (!__atomic_compare_exchange_n(&all_tables, &head, table, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return table;
+}
+
+static inline uint64_t edge_hash(uint64_t from, uint64_t to) {
+    uint64_t h = from * 0x9E3779B97F4A7C15ULL ^ to * 0xC2B2AE3D27D4EB4FULL;
+    // Callers mask it to the capacity of their table
+    return h ^ (h >> 29);
+}
+
+// A slot is claimed by setting its callee, and published by setting its
+// caller last, so readers and other writers only match published slots.
+// Two threads may claim slots for the same edge, which merge_tables adds up.
+static void overflow_edge(uint64_t from, uint64_t to, uint64_t count) {
+    EdgeSlot* table = __atomic_load_n(&overflow_table, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(table == NULL, 0)) {
+        void* mem = mmap(NULL, OverflowCapacity * sizeof(EdgeSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            __atomic_fetch_add(&overflow_dropped, count, __ATOMIC_RELAXED);
+            return;
+        }
+        table = (EdgeSlot*)mem;
+        EdgeSlot* expected = NULL;
+        if (!__atomic_compare_exchange_n(&overflow_table, &expected, table, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            munmap(mem, OverflowCapacity * sizeof(EdgeSlot));
+            table = expected;
+        }
+    }
+    uint64_t h = edge_hash(from, to);
+    for (uint64_t i = 0; i < OverflowMaxProbe; ++i) {
+        EdgeSlot& s = table[(h + i) & (OverflowCapacity - 1)];
+        if (__atomic_load_n(&s.from, __ATOMIC_ACQUIRE) == from && s.to == to) {
+            __atomic_fetch_add(&s.count, count, __ATOMIC_RELAXED);
+            return;
+        }
+        uint64_t empty = 0;
+        if (__atomic_load_n(&s.to, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&s.to, &empty, to, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&s.count, count, __ATOMIC_RELAXED);
+            __atomic_store_n(&s.from, from, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    __atomic_fetch_add(&overflow_dropped, count, __ATOMIC_RELAXED);
+}
+
+// Count one call in the table of the thread, which is created with the
+// weight its counts are scaled by. The overflow table is scaled right away.
+static inline void record_edge(EdgeTable*& owned, bool& failed, uint64_t weight, uint64_t from, uint64_t to) {
+    EdgeTable* table = owned;
+    if (__builtin_expect(table == NULL, 0)) {
+        if (!failed) {
+            table = owned = new_table(weight);
+            failed = table == NULL;
+        }
+        if (table == NULL) {
+            overflow_edge(from, to, weight);
+            return;
+        }
+    }
+    uint64_t h = edge_hash(from, to);
+    for (uint64_t i = 0; i < MaxProbe; ++i) {
+        EdgeSlot& s = table->slots[(h + i) & (TableCapacity - 1)];
+        if (s.from == from && s.to == to) {
+            __atomic_store_n(&s.count, s.count + 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (s.from == 0) {
+            s.to = to;
+            s.count = 1;
+            __atomic_store_n(&s.from, from, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    overflow_edge(from, to, weight);
+}
+
+static inline int64_t next_sample_period(uint64_t period) {
+    if (period <= 1) return 1;
+    sample_rng ^= sample_rng << 13;
+    sample_rng ^= sample_rng >> 7;
+    sample_rng ^= sample_rng << 17;
+    return 1 + sample_rng % (2 * period - 1);
+}
+
+// Calling context tree mode. CallGraph --cct calls cct_enter before
+// every call and cct_exit after it returns. Each thread grows its own
+// tree, whose nodes are (caller, call site, callee) triples that come
+// from an mmap'ed arena. The first children of a node are kept inline
+// and the rest in an open addressing table that is also in the arena.
+//
+// Exceptions and longjmp skip the cct_exit of the calls they unwind.
+// cct_exit pops down to the frame of its own call site, and cct_enter
+// drops the frame of its call site, and the frames above it, if the
+// frame was entered from the same stack frame or a deeper one.
+// Recursive calls through the same call site are entered from
+// shallower stack frames, so they are kept. Probes of different call
+// sites may save different registers, so cct_enter only drops the
+// frames of other call sites when they are deeper by more than
+// StaleFrameDistance.
+static const uint64_t ArenaChunkSize = 1 << 20;
+static const int InlineChildren = 4;
+static const int MaxContextDepth = 256;
+static const uint64_t StaleFrameDistance = 4096;
+
+struct CCTNode {
+    uint64_t from;
+    uint64_t callsite;
+    uint64_t to;
+    uint64_t count;
+    CCTNode* parent;
+    CCTNode* children[InlineChildren];
+    CCTNode** table;
+    uint32_t tableCapacity;
+    uint32_t tableSize;
+};
+
+struct CCTThread {
+    CCTNode root;
+    CCTNode* current;
+    int depth;
+    // Calls past the maximum depth, or whose node could not be allocated,
+    // stay in the current node. Every later call does too until they
+    // return, so the pops stay matched.
+    int overflowDepth;
+    // The frame address of cct_enter for each node on the current path.
+    // It is only compared between calls of the same call site, whose
+    // probes use the same stack layout.
+    uint64_t sp[MaxContextDepth];
+    char* arena;
+    uint64_t arenaLeft;
+    CCTThread* next;
+};
+
+static CCTThread* all_cct = NULL;
+static __thread CCTThread* thread_cct __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread bool cct_failed __attribute__((tls_model("initial-exec"))) = false;
+
+static CCTThread* new_cct_thread() {
+    void* mem = mmap(NULL, sizeof(CCTThread), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    CCTThread* t = (CCTThread*)mem;
+    t->current = &t->root;
+    CCTThread* head = __atomic_load_n(&all_cct, __ATOMIC_ACQUIRE);
+    do {
+        t->next = head;
+    } while (!__atomic_compare_exchange_n(&all_cct, &head, t, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return t;
+}
+
+// Arena memory comes zeroed from mmap
+static void* cct_alloc(CCTThread* t, uint64_t size) {
+    size = (size + 7) & ~7ULL;
+    if (size > t->arenaLeft) {
+        uint64_t chunk = std::max(ArenaChunkSize, size);
+        void* mem = mmap(NULL, chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+        t->arena = (char*)mem;
+        t->arenaLeft = chunk;
+    }
+    void* ret = t->arena;
+    t->arena += size;
+    t->arenaLeft -= size;
+    return ret;
+}
+
+static inline bool cct_match(CCTNode* n, uint64_t from, uint64_t callsite, uint64_t to) {
+    return n->callsite == callsite && n->to == to && n->from == from;
+}
+
+static bool cct_table_insert(CCTThread* t, CCTNode* n, CCTNode* child) {
+    if ((n->tableSize + 1) * 2 > n->tableCapacity) {
+        uint32_t capacity = n->tableCapacity == 0 ? 8 : n->tableCapacity * 2;
+        CCTNode** table = (CCTNode**)cct_alloc(t, capacity * sizeof(CCTNode*));
+        if (table == NULL) return false;
+        for (uint32_t i = 0; i < n->tableCapacity; ++i) {
+            CCTNode* c = n->table[i];
+            if (c == NULL) continue;
+            uint64_t h = edge_hash(c->callsite, c->to) & (capacity - 1);
+            while (table[h] != NULL) h = (h + 1) & (capacity - 1);
+            table[h] = c;
+        }
+        __atomic_store_n(&n->tableCapacity, capacity, __ATOMIC_RELAXED);
+        __atomic_store_n(&n->table, table, __ATOMIC_RELEASE);
+    }
+    uint64_t h = edge_hash(child->callsite, child->to) & (n->tableCapacity - 1);
+    while (n->table[h] != NULL) h = (h + 1) & (n->tableCapacity - 1);
+    __atomic_store_n(&n->table[h], child, __ATOMIC_RELEASE);
+    n->tableSize += 1;
+    return true;
+}
+
+static CCTNode* cct_child(CCTThread* t, CCTNode* n, uint64_t from, uint64_t callsite, uint64_t to) {
+    int slot = -1;
+    for (int i = 0; i < InlineChildren; ++i) {
+        CCTNode* c = n->children[i];
+        if (c == NULL) {
+            slot = i;
+            break;
+        }
+        if (cct_match(c, from, callsite, to)) return c;
+    }
+    if (slot < 0 && n->table != NULL) {
+        uint64_t h = edge_hash(callsite, to) & (n->tableCapacity - 1);
+        for (CCTNode* c = n->table[h]; c != NULL; c = n->table[h]) {
+            if (cct_match(c, from, callsite, to)) return c;
+            h = (h + 1) & (n->tableCapacity - 1);
+        }
+    }
+    CCTNode* child = (CCTNode*)cct_alloc(t, sizeof(CCTNode));
+    if (child == NULL) return NULL;
+    child->from = from;
+    child->callsite = callsite;
+    child->to = to;
+    child->parent = n;
+    if (slot >= 0) {
+        __atomic_store_n(&n->children[slot], child, __ATOMIC_RELEASE);
+    } else if (!cct_table_insert(t, n, child)) {
+        return NULL;
+    }
+    return child;
+}
+
+struct MergedCCTNode {
+    uint64_t count;
+    std::map<std::tuple<uint64_t, uint64_t, uint64_t>, MergedCCTNode> children;
+    MergedCCTNode(): count(0) {}
+};
+
+static void merge_cct(MergedCCTNode& merged, CCTNode* n) {
+    auto mergeChild = [&merged] (CCTNode* c) {
+        MergedCCTNode& m = merged.children[std::make_tuple(c->from, c->callsite, c->to)];
+        m.count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+        merge_cct(m, c);
+    };
+    for (int i = 0; i < InlineChildren; ++i) {
+        CCTNode* c = __atomic_load_n(&n->children[i], __ATOMIC_ACQUIRE);
+        if (c == NULL) break;
+        mergeChild(c);
+    }
+    CCTNode** table = __atomic_load_n(&n->table, __ATOMIC_ACQUIRE);
+    if (table == NULL) return;
+    uint32_t capacity = __atomic_load_n(&n->tableCapacity, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < capacity; ++i) {
+        CCTNode* c = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+        if (c != NULL) mergeChild(c);
+    }
+}
+
+static uint64_t count_cct(MergedCCTNode& n) {
+    uint64_t total = n.children.size();
+    for (auto &it : n.children) {
+        total += count_cct(it.second);
+    }
+    return total;
+}
+
+// One line per node in preorder: depth, caller, call site, callee, count
+static void write_cct(FILE* f, MergedCCTNode& n, int depth) {
+    for (auto &it : n.children) {
+        fprintf(f, "%d %lx %lx %lx %lu\n", depth, std::get<0>(it.first), std::get<1>(it.first), std::get<2>(it.first), it.second.count);
+        write_cct(f, it.second, depth + 1);
+    }
+}
+
+static void flatten_cct(MergedCCTNode& n, std::map<uint64_t, std::map<uint64_t, uint64_t> >& call_graph) {
+    for (auto &it : n.children) {
+        call_graph[std::get<0>(it.first)][std::get<2>(it.first)] += it.second.count;
+        flatten_cct(it.second, call_graph);
+    }
+}
+
+static void print_cct(MergedCCTNode& merged) {
+    char* filename = getenv("CALL_GRAPH_CCT");
+    FILE* outFile = fopen(filename != NULL ? filename : "call_graph.cct", "w");
+    if (outFile == NULL) return;
+    fprintf(outFile, "%lu\n", count_cct(merged));
+    write_cct(outFile, merged, 0);
+    fclose(outFile);
+}
+
+// Indirect call sites also keep a histogram of their targets per thread,
+// for promoting their hottest target to a direct call. Each site tracks
+// a few targets with the Space-Saving rule: a new target replaces the
+// least counted one and starts from its count, so every target taking
+// more than 1/TrackedTargets of the calls of a site is kept, and counts
+// are over-estimated by at most the smallest tracked count.
+// Sites that do not fit in the table are only in the flat call graph.
+static const uint64_t IndirectCapacity = 1 << 12;
+static const int TrackedTargets = 8;
+static const int ReportedTargets = 4;
+
+struct IndirectSite {
+    uint64_t callsite;
+    uint64_t from;
+    uint64_t total;
+    uint64_t targets[TrackedTargets];
+    uint64_t counts[TrackedTargets];
+};
+
+struct IndirectTable {
+    IndirectSite sites[IndirectCapacity];
+    IndirectTable* next;
+};
+
+static IndirectTable* all_indirect = NULL;
+static __thread IndirectTable* thread_indirect __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread bool indirect_failed __attribute__((tls_model("initial-exec"))) = false;
+
+static IndirectTable* new_indirect_table() {
+    void* mem = mmap(NULL, sizeof(IndirectTable), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    IndirectTable* table = (IndirectTable*)mem;
+    IndirectTable* head = __atomic_load_n(&all_indirect, __ATOMIC_ACQUIRE);
+    do {
+        table->next = head;
+    } while (!__atomic_compare_exchange_n(&all_indirect, &head, table, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return table;
+}
+
+static inline void count_target(IndirectSite& s, uint64_t target) {
+    __atomic_store_n(&s.total, s.total + 1, __ATOMIC_RELAXED);
+    int least = 0;
+    for (int i = 0; i < TrackedTargets; ++i) {
+        if (s.targets[i] == target) {
+            __atomic_store_n(&s.counts[i], s.counts[i] + 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (s.targets[i] == 0) {
+            __atomic_store_n(&s.counts[i], 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&s.targets[i], target, __ATOMIC_RELEASE);
+            return;
+        }
+        if (s.counts[i] < s.counts[least]) least = i;
+    }
+    __atomic_store_n(&s.targets[least], target, __ATOMIC_RELAXED);
+    __atomic_store_n(&s.counts[least], s.counts[least] + 1, __ATOMIC_RELAXED);
+}
+
+static inline void record_indirect(uint64_t from, uint64_t callsite, uint64_t target) {
+    IndirectTable* table = thread_indirect;
+    if (__builtin_expect(table == NULL, 0)) {
+        if (indirect_failed) return;
+        table = thread_indirect = new_indirect_table();
+        indirect_failed = table == NULL;
+        if (table == NULL) return;
+    }
+    uint64_t h = edge_hash(callsite, from);
+    for (uint64_t i = 0; i < MaxProbe; ++i) {
+        IndirectSite& s = table->sites[(h + i) & (IndirectCapacity - 1)];
+        if (s.callsite == callsite) {
+            count_target(s, target);
+            return;
+        }
+        if (s.callsite == 0) {
+            s.from = from;
+            __atomic_store_n(&s.callsite, callsite, __ATOMIC_RELEASE);
+            count_target(s, target);
+            return;
+        }
+    }
+}
+
+struct MergedIndirectSite {
+    uint64_t from;
+    uint64_t total;
+    std::map<uint64_t, uint64_t> targets;
+    MergedIndirectSite(): from(0), total(0) {}
+};
+
+// One line per call site, by decreasing call count: call site, caller,
+// total calls, number of targets, then the hottest targets and their counts
+static void print_indirect() {
+    std::map<uint64_t, MergedIndirectSite> merged;
+    for (IndirectTable* t = __atomic_load_n(&all_indirect, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (uint64_t i = 0; i < IndirectCapacity; ++i) {
+            IndirectSite& s = t->sites[i];
+            uint64_t callsite = __atomic_load_n(&s.callsite, __ATOMIC_ACQUIRE);
+            if (callsite == 0) continue;
+            MergedIndirectSite& m = merged[callsite];
+            m.from = s.from;
+            m.total += __atomic_load_n(&s.total, __ATOMIC_RELAXED);
+            for (int j = 0; j < TrackedTargets; ++j) {
+                uint64_t target = __atomic_load_n(&s.targets[j], __ATOMIC_ACQUIRE);
+                if (target == 0) break;
+                m.targets[target] += __atomic_load_n(&s.counts[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> > sites;
+    for (auto &it : merged) {
+        sites.push_back(std::make_pair(it.second.total, it.first));
+    }
+    std::sort(sites.begin(), sites.end(), [] (const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+        if (a.first != b.first) return a.first > b.first;
+        return a.second < b.second;
+    });
+
+    char* filename = getenv("CALL_GRAPH_INDIRECT");
+    FILE* outFile = fopen(filename != NULL ? filename : "call_graph.indirect", "w");
+    if (outFile == NULL) return;
+    fprintf(outFile, "%lu\n", sites.size());
+    for (auto &it : sites) {
+        MergedIndirectSite& m = merged[it.second];
+        std::vector<CallGraphEdge> targets;
+        for (auto &t : m.targets) {
+            // Over-estimated counts may add up to more than the calls
+            targets.push_back(CallGraphEdge(it.second, t.first, std::min(t.second, m.total)));
+        }
+        std::sort(targets.begin(), targets.end());
+        if (targets.size() > (size_t)ReportedTargets) targets.erase(targets.begin() + ReportedTargets, targets.end());
+        fprintf(outFile, "%lx %lx %lu %lu", it.second, m.from, m.total, targets.size());
+        for (auto &e : targets) {
+            fprintf(outFile, " %lx %lu", e.to, e.count);
+        }
+        fprintf(outFile, "\n");
+    }
+    fclose(outFile);
+}
+
+// Latency mode. CallGraph --latency calls latency_enter at the entry of
+// the selected functions and latency_exit at their exits. The time
+// between them, in TSC cycles, goes into a log-linear histogram per
+// function per thread: values below LatencySubBuckets have their own
+// bucket, and every power of two above is split into LatencySubBuckets
+// linear buckets, which bounds the relative error to 1/LatencySubBuckets.
+// The TSC is read in latency_enter and latency_exit, after the register
+// saves of the probes that call them, so every latency includes the
+// runtime's own work between the two reads, about 50 cycles, and the
+// probe overhead of one side. A latency_enter and latency_exit pair
+// costs about 120 cycles when called directly, before the probes' saves.
+// The histograms of a thread are allocated at its first probe, and
+// are only written by their thread, so probes take no lock.
+static const int LatencySubBucketBits = 4;
+static const uint64_t LatencySubBuckets = 1 << LatencySubBucketBits;
+// Latencies of 2^48 cycles and more share the last bucket
+static const int LatencyMaxExponent = 47;
+static const uint64_t LatencyBuckets = LatencySubBuckets * (LatencyMaxExponent - LatencySubBucketBits + 2);
+static const int MaxLatencyDepth = 256;
+
+struct LatencyFrame {
+    uint64_t id;
+    uint64_t start;
+};
+
+struct LatencyThread {
+    // LatencyBuckets counts for every function
+    uint64_t* buckets;
+    LatencyFrame stack[MaxLatencyDepth];
+    int depth;
+    // Entries past the maximum depth are not timed
+    int overflowDepth;
+    LatencyThread* next;
+};
+
+static LatencyThread* all_latency = NULL;
+static __thread LatencyThread* thread_latency __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread bool latency_failed __attribute__((tls_model("initial-exec"))) = false;
+// Addresses of the timed functions, indexed by ID, in the rewritten binary
+static const uint64_t* latency_funcs = NULL;
+static uint64_t latency_func_count = 0;
+static int latency_dumper_started = 0;
+
+static LatencyThread* new_latency_thread(uint64_t n) {
+    uint64_t size = sizeof(LatencyThread) + n * LatencyBuckets * sizeof(uint64_t);
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    LatencyThread* t = (LatencyThread*)mem;
+    t->buckets = (uint64_t*)(t + 1);
+    LatencyThread* head = __atomic_load_n(&all_latency, __ATOMIC_ACQUIRE);
+    do {
+        t->next = head;
+    } while (!__atomic_compare_exchange_n(&all_latency, &head, t, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return t;
+}
+
+static inline uint64_t latency_bucket(uint64_t cycles) {
+    if (cycles < LatencySubBuckets) return cycles;
+    int e = 63 - __builtin_clzll(cycles);
+    if (e > LatencyMaxExponent) return LatencyBuckets - 1;
+    int shift = e - LatencySubBucketBits;
+    return LatencySubBuckets * (shift + 1) + (cycles >> shift) - LatencySubBuckets;
+}
+
+// Smallest latency of a bucket
+static inline uint64_t latency_bucket_value(uint64_t bucket) {
+    if (bucket < LatencySubBuckets) return bucket;
+    uint64_t shift = bucket / LatencySubBuckets - 1;
+    return (LatencySubBuckets + bucket % LatencySubBuckets) << shift;
+}
+
+// One line per timed function that was called: address, calls, the
+// 50th, 90th, 99th and 99.9th percentiles and the maximum in cycles,
+// the number of non-empty buckets, then the smallest latency and the
+// count of each of them. The percentiles and the maximum are the
+// smallest latency of the bucket they fall in, so they are lower bounds
+// within 1/LatencySubBuckets of the true values.
+static void print_latency(const char* filename) {
+    FILE* outFile = fopen(filename, "w");
+    if (outFile == NULL) return;
+    std::vector<uint64_t> merged(latency_func_count * LatencyBuckets, 0);
+    for (LatencyThread* t = __atomic_load_n(&all_latency, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (uint64_t i = 0; i < merged.size(); ++i) {
+            merged[i] += __atomic_load_n(&t->buckets[i], __ATOMIC_RELAXED);
+        }
+    }
+    uint64_t called = 0;
+    for (uint64_t f = 0; f < latency_func_count; ++f) {
+        for (uint64_t b = 0; b < LatencyBuckets; ++b) {
+            if (merged[f * LatencyBuckets + b] == 0) continue;
+            ++called;
+            break;
+        }
+    }
+    fprintf(outFile, "%lu\n", called);
+    const double percentiles[4] = {0.5, 0.9, 0.99, 0.999};
+    for (uint64_t f = 0; f < latency_func_count; ++f) {
+        uint64_t* h = &merged[f * LatencyBuckets];
+        uint64_t calls = 0, used = 0, max = 0;
+        for (uint64_t b = 0; b < LatencyBuckets; ++b) {
+            if (h[b] == 0) continue;
+            calls += h[b];
+            ++used;
+            max = b;
+        }
+        if (calls == 0) continue;
+        fprintf(outFile, "%lx %lu", latency_funcs[f], calls);
+        int p = 0;
+        uint64_t seen = 0;
+        for (uint64_t b = 0; b < LatencyBuckets && p < 4; ++b) {
+            seen += h[b];
+            while (p < 4 && seen >= calls * percentiles[p]) {
+                fprintf(outFile, " %lu", latency_bucket_value(b));
+                ++p;
+            }
+        }
+        fprintf(outFile, " %lu %lu", latency_bucket_value(max), used);
+        for (uint64_t b = 0; b < LatencyBuckets; ++b) {
+            if (h[b] > 0) fprintf(outFile, " %lu %lu", latency_bucket_value(b), h[b]);
+        }
+        fprintf(outFile, "\n");
+    }
+    fclose(outFile);
+}
+
+static const char* latency_filename() {
+    char* filename = getenv("CALL_GRAPH_LATENCY");
+    return filename != NULL ? filename : "call_graph.latency";
+}
+
+// Held while the latency file is written. Once the final file is
+// written at exit, the dumper stops writing.
+static std::mutex latency_lock;
+static bool latency_stopped = false;
+
+// Rewrite the latency file every CALL_GRAPH_LATENCY_INTERVAL seconds,
+// through a temporary file so readers never see a partial one
+static void* latency_dumper(void* arg) {
+    uint64_t interval = (uint64_t)arg;
+    const char* filename = latency_filename();
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    while (true) {
+        sleep(interval);
+        std::lock_guard<std::mutex> guard(latency_lock);
+        if (latency_stopped) break;
+        print_latency(tmp);
+        rename(tmp, filename);
+    }
+    return NULL;
+}
+
+static void start_latency_dumper() {
+    char* env = getenv("CALL_GRAPH_LATENCY_INTERVAL");
+    uint64_t interval = env != NULL ? strtoull(env, NULL, 10) : 10;
+    if (interval == 0) return;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, latency_dumper, (void*)interval) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+static void merge_tables(std::map<uint64_t, std::map<uint64_t, uint64_t> >& call_graph) {
+    EdgeSlot* overflow = __atomic_load_n(&overflow_table, __ATOMIC_ACQUIRE);
+    for (uint64_t i = 0; overflow != NULL && i < OverflowCapacity; ++i) {
+        EdgeSlot& s = overflow[i];
+        uint64_t from = __atomic_load_n(&s.from, __ATOMIC_ACQUIRE);
+        if (from == 0) continue;
+        call_graph[from][s.to] += __atomic_load_n(&s.count, __ATOMIC_RELAXED);
+    }
+    for (EdgeTable* t = __atomic_load_n(&all_tables, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (uint64_t i = 0; i < TableCapacity; ++i) {
+            EdgeSlot& s = t->slots[i];
+            // The owner thread publishes a slot by writing from last
+            uint64_t from = __atomic_load_n(&s.from, __ATOMIC_ACQUIRE);
+            if (from == 0) continue;
+            call_graph[from][s.to] += __atomic_load_n(&s.count, __ATOMIC_RELAXED) * t->weight;
+        }
+    }
+    for (uint64_t i = 0; i < inline_edge_count; ++i) {
+        uint64_t count = __atomic_load_n(&inline_edge_counters[i], __ATOMIC_RELAXED);
+        if (count == 0) continue;
+        call_graph[inline_edge_table[2 * i]][inline_edge_table[2 * i + 1]] += count;
+    }
+}
+
+static void merge_cct_threads(MergedCCTNode& merged) {
+    for (CCTThread* t = __atomic_load_n(&all_cct, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        merge_cct(merged, &t->root);
+    }
+}
+
+// The flat call graph of all modes
+static void collect_call_graph(std::map<uint64_t, std::map<uint64_t, uint64_t> >& call_graph) {
+    merge_tables(call_graph);
+    MergedCCTNode merged_cct;
+    merge_cct_threads(merged_cct);
+    flatten_cct(merged_cct, call_graph);
+}
+
+// Streaming mode, for processes that run for long or do not exit
+// through the destructors. When CALL_GRAPH_STREAM is set, a background
+// thread appends what changed since its last dump to
+// $CALL_GRAPH_STREAM.<pid> every CALL_GRAPH_STREAM_INTERVAL seconds
+// (default 10), when the process gets CALL_GRAPH_STREAM_SIGNAL (default
+// SIGUSR2), and at exit. A forked child gets its own file, and streams
+// only what it counts after the fork. CallGraphTool merge adds up
+// the streams of all processes.
+//
+// A stream starts with the magic "LIBCGST1" followed by the pid and the
+// parent pid, then a sequence of batches. Every number is an unsigned
+// LEB128 varint. A batch is its type, time in seconds, and number of
+// records, followed by the records:
+//   StreamEdges: caller as a delta from the previous caller (records are
+//   sorted), callee, count delta
+//   StreamCounters: the number of raw counters, then for every record
+//   a raw counter index and count delta
+// Each batch is written with a single write, so a reader only has to
+// drop a truncated batch at the end.
+static const char StreamMagic[8] = {'L', 'I', 'B', 'C', 'G', 'S', 'T', '1'};
+static const uint64_t StreamEdges = 1;
+static const uint64_t StreamCounters = 2;
+
+static bool stream_enabled = false;
+static int stream_fd = -1;
+static uint64_t stream_interval = 10;
+static sem_t stream_sem;
+// Held while a dump runs and across fork
+static std::mutex stream_lock;
+// What the stream holds so far, allocated when streaming starts
+static std::map<uint64_t, std::map<uint64_t, uint64_t> >* stream_edges = NULL;
+static std::vector<uint64_t>* stream_counters = NULL;
+
+static void put_varint(std::string& buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+static void write_all(int fd, const std::string& buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        done += n;
+    }
+}
+
+static void open_stream() {
+    const char* prefix = getenv("CALL_GRAPH_STREAM");
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s.%d", prefix, (int)getpid());
+    stream_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (stream_fd < 0) return;
+    std::string header(StreamMagic, sizeof(StreamMagic));
+    put_varint(header, getpid());
+    put_varint(header, getppid());
+    write_all(stream_fd, header);
+}
+
+// The current counts of the call graph and the raw counters
+static void stream_snapshot(std::map<uint64_t, std::map<uint64_t, uint64_t> >& call_graph, std::vector<uint64_t>& counters) {
+    collect_call_graph(call_graph);
+    counters.resize(raw_counter_count);
+    for (uint64_t i = 0; i < raw_counter_count; ++i) {
+        counters[i] = __atomic_load_n(&raw_counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Called with stream_lock held
+static void stream_dump() {
+    if (stream_fd < 0) return;
+    std::map<uint64_t, std::map<uint64_t, uint64_t> > call_graph;
+    std::vector<uint64_t> counters;
+    stream_snapshot(call_graph, counters);
+
+    std::string records;
+    uint64_t edges = 0, prevFrom = 0;
+    for (auto &it : call_graph) {
+        auto &prev = (*stream_edges)[it.first];
+        for (auto &it2 : it.second) {
+            uint64_t& old = prev[it2.first];
+            if (it2.second <= old) continue;
+            put_varint(records, it.first - prevFrom);
+            put_varint(records, it2.first);
+            put_varint(records, it2.second - old);
+            prevFrom = it.first;
+            old = it2.second;
+            ++edges;
+        }
+    }
+    std::string buf;
+    uint64_t now = time(NULL);
+    if (edges > 0) {
+        put_varint(buf, StreamEdges);
+        put_varint(buf, now);
+        put_varint(buf, edges);
+        buf += records;
+    }
+
+    records.clear();
+    uint64_t changed = 0;
+    std::vector<uint64_t>& prevCounters = *stream_counters;
+    // The first batch of counters carries their number even if none
+    // has moved, so the merged counters match the plan
+    bool grown = counters.size() > prevCounters.size();
+    prevCounters.resize(counters.size(), 0);
+    for (uint64_t i = 0; i < counters.size(); ++i) {
+        if (counters[i] <= prevCounters[i]) continue;
+        put_varint(records, i);
+        put_varint(records, counters[i] - prevCounters[i]);
+        prevCounters[i] = counters[i];
+        ++changed;
+    }
+    if (changed > 0 || grown) {
+        put_varint(buf, StreamCounters);
+        put_varint(buf, now);
+        put_varint(buf, counters.size());
+        put_varint(buf, changed);
+        buf += records;
+    }
+    if (!buf.empty()) write_all(stream_fd, buf);
+}
+
+static void* stream_dumper(void*) {
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += stream_interval;
+        while (sem_timedwait(&stream_sem, &deadline) != 0 && errno == EINTR) {}
+        std::lock_guard<std::mutex> guard(stream_lock);
+        stream_dump();
+    }
+    return NULL;
+}
+
+static void start_stream_dumper() {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, stream_dumper, NULL) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+// Only async-signal-safe calls here, the dumper thread does the work
+static void stream_signal(int) {
+    int saved = errno;
+    sem_post(&stream_sem);
+    errno = saved;
+}
+
+// The counts at the fork, taken in the parent. The child starts its
+// stream from them, so it does not repeat what the parent has counted.
+static std::map<uint64_t, std::map<uint64_t, uint64_t> >* fork_edges = NULL;
+static std::vector<uint64_t>* fork_counters = NULL;
+
+static void stream_prepare_fork() {
+    stream_lock.lock();
+    fork_edges->clear();
+    fork_counters->clear();
+    stream_snapshot(*fork_edges, *fork_counters);
+}
+
+static void stream_parent_fork() {
+    stream_lock.unlock();
+}
+
+// The dumper thread does not survive the fork, start a new one
+static void stream_child_fork() {
+    stream_lock.unlock();
+    std::swap(stream_edges, fork_edges);
+    std::swap(stream_counters, fork_counters);
+    fork_edges->clear();
+    fork_counters->clear();
+    if (stream_fd >= 0) close(stream_fd);
+    sem_init(&stream_sem, 0, 0);
+    open_stream();
+    start_stream_dumper();
+}
+
+__attribute__((constructor)) static void init_stream() {
+    if (getenv("CALL_GRAPH_STREAM") == NULL) return;
+    char* interval = getenv("CALL_GRAPH_STREAM_INTERVAL");
+    if (interval != NULL && strtoull(interval, NULL, 10) > 0) {
+        stream_interval = strtoull(interval, NULL, 10);
+    }
+    char* sig = getenv("CALL_GRAPH_STREAM_SIGNAL");
+    int signum = sig != NULL ? atoi(sig) : SIGUSR2;
+    stream_enabled = true;
+    stream_edges = new std::map<uint64_t, std::map<uint64_t, uint64_t> >;
+    stream_counters = new std::vector<uint64_t>;
+    fork_edges = new std::map<uint64_t, std::map<uint64_t, uint64_t> >;
+    fork_counters = new std::vector<uint64_t>;
+    sem_init(&stream_sem, 0, 0);
+    open_stream();
+    if (signum > 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stream_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(signum, &sa, NULL);
+    }
+    pthread_atfork(stream_prepare_fork, stream_parent_fork, stream_child_fork);
+    start_stream_dumper();
+}
+
 extern "C" {
 
 void call_edge(uint64_t from, uint64_t to) {
-    call_graph[from][to] += 1;
+    record_edge(thread_table, table_failed, 1, from, to);
+}
+
+// A call with a dynamic target, from the call site that returns to callsite
+void call_edge_indirect(uint64_t from, uint64_t callsite, uint64_t to) {
+    record_edge(thread_table, table_failed, 1, from, to);
+    record_indirect(from, callsite, to);
+}
+
+void call_edge_sampled(uint64_t from, uint64_t to, uint64_t period) {
+    if (__builtin_expect(--sample_countdown > 0, 1)) return;
+    if (__builtin_expect(sample_rng == 0, 0)) {
+        // The first call of a thread only starts its countdown
+        sample_rng = (__builtin_ia32_rdtsc() ^ (uint64_t)&sample_rng) | 1;
+        sample_countdown = next_sample_period(period);
+        return;
+    }
+    sample_countdown = next_sample_period(period);
+    record_edge(sampled_table, sampled_failed, period, from, to);
+}
+
+void cct_enter(uint64_t from, uint64_t callsite, uint64_t to) {
+    uint64_t sp = (uint64_t)__builtin_frame_address(0);
+    CCTThread* t = thread_cct;
+    if (__builtin_expect(t == NULL, 0)) {
+        if (cct_failed) return;
+        t = thread_cct = new_cct_thread();
+        cct_failed = t == NULL;
+        if (t == NULL) return;
+    }
+    while (t->depth > 0 && t->sp[t->depth - 1] + StaleFrameDistance < sp) {
+        t->current = t->current->parent;
+        t->depth -= 1;
+        t->overflowDepth = 0;
+    }
+    // Only the closest frame of the call site needs a look, the ones
+    // below it were entered from shallower stack frames
+    CCTNode* n = t->current;
+    for (int d = t->depth; d > 0; --d, n = n->parent) {
+        if (n->callsite != callsite) continue;
+        if (t->sp[d - 1] <= sp) {
+            t->current = n->parent;
+            t->depth = d - 1;
+            t->overflowDepth = 0;
+        }
+        break;
+    }
+    if (t->overflowDepth > 0 || t->depth >= MaxContextDepth) {
+        t->overflowDepth += 1;
+        return;
+    }
+    CCTNode* c = cct_child(t, t->current, from, callsite, to);
+    if (c == NULL) {
+        t->overflowDepth += 1;
+        return;
+    }
+    __atomic_store_n(&c->count, c->count + 1, __ATOMIC_RELAXED);
+    t->sp[t->depth] = sp;
+    t->current = c;
+    t->depth += 1;
+}
+
+void cct_exit(uint64_t callsite) {
+    CCTThread* t = thread_cct;
+    if (t == NULL) return;
+    if (t->overflowDepth > 0) {
+        t->overflowDepth -= 1;
+        return;
+    }
+    // Frames skipped by exceptions or longjmp have no exit, drop them
+    CCTNode* n = t->current;
+    int d = t->depth;
+    while (d > 0 && n->callsite != callsite) {
+        n = n->parent;
+        --d;
+    }
+    if (d == 0) return;
+    t->current = n->parent;
+    t->depth = d - 1;
+}
+
+// id indexes funcs, the n addresses of the timed functions
+void latency_enter(uint64_t id, const uint64_t* funcs, uint64_t n) {
+    uint64_t now = __rdtsc();
+    LatencyThread* t = thread_latency;
+    if (__builtin_expect(t == NULL, 0)) {
+        if (latency_failed) return;
+        if (__atomic_exchange_n(&latency_dumper_started, 1, __ATOMIC_ACQ_REL) == 0) {
+            latency_funcs = funcs;
+            latency_func_count = n;
+            start_latency_dumper();
+        }
+        t = thread_latency = new_latency_thread(n);
+        latency_failed = t == NULL;
+        if (t == NULL) return;
+    }
+    if (t->overflowDepth > 0 || t->depth >= MaxLatencyDepth) {
+        t->overflowDepth += 1;
+        return;
+    }
+    t->stack[t->depth].id = id;
+    t->stack[t->depth].start = now;
+    t->depth += 1;
+}
+
+void latency_exit(uint64_t id) {
+    uint64_t now = __rdtsc();
+    LatencyThread* t = thread_latency;
+    if (t == NULL) return;
+    if (t->overflowDepth > 0) {
+        t->overflowDepth -= 1;
+        return;
+    }
+    // Frames skipped by exceptions or longjmp have no exit, drop them
+    int d = t->depth - 1;
+    while (d >= 0 && t->stack[d].id != id) --d;
+    if (d < 0) return;
+    t->depth = d;
+    uint64_t* count = &t->buckets[id * LatencyBuckets + latency_bucket(now - t->stack[d].start)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+void call_edge_counters(const uint64_t* table, const uint64_t* counters, uint64_t n) {
+    inline_edge_table = table;
+    inline_edge_counters = counters;
+    inline_edge_count = n;
+}
+
+void call_edge_raw_counters(const uint64_t* counters, uint64_t n) {
+    raw_counters = counters;
+    raw_counter_count = n;
+}
+
+static void print_raw_counters() {
+    char* filename = getenv("CALL_GRAPH_COUNTERS");
+    FILE* outFile = fopen(filename != NULL ? filename : "call_graph.counters", "w");
+    if (outFile == NULL) return;
+    fprintf(outFile, "%lu\n", raw_counter_count);
+    for (uint64_t i = 0; i < raw_counter_count; ++i) {
+        fprintf(outFile, "%lu\n", __atomic_load_n(&raw_counters[i], __ATOMIC_RELAXED));
+    }
+    fclose(outFile);
 }
 
 void print_call_graph() {
@@ -37,6 +1088,18 @@ void print_call_graph() {
         outFile = fopen(filename, "w");
     }
     if (outFile == NULL) outFile = stdout;
+    std::map<uint64_t, std::map<uint64_t, uint64_t> > call_graph;
+    merge_tables(call_graph);
+    MergedCCTNode merged_cct;
+    merge_cct_threads(merged_cct);
+    flatten_cct(merged_cct, call_graph);
+    // The final dump, after which the dumper threads write nothing
+    if (stream_enabled) {
+        std::lock_guard<std::mutex> guard(stream_lock);
+        stream_dump();
+        if (stream_fd >= 0) close(stream_fd);
+        stream_fd = -1;
+    }
     std::vector<CallGraphEdge> edges;
     for (auto it : call_graph) {
         uint64_t from = it.first;
@@ -46,10 +1109,22 @@ void print_call_graph() {
         }
     }
     std::sort(edges.begin(), edges.end());
-    fprintf(outFile, "%u\n", edges.size());
+    fprintf(outFile, "%lu\n", edges.size());
     for (auto e : edges) {
         fprintf(outFile, "%lx %lx %lu\n", e.from, e.to, e.count);
     }
+    uint64_t dropped = __atomic_load_n(&overflow_dropped, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        fprintf(stderr, "Drop %lu calls that overflow the edge tables\n", dropped);
+    }
+    if (raw_counters != NULL) print_raw_counters();
+    if (all_cct != NULL) print_cct(merged_cct);
+    if (all_indirect != NULL) print_indirect();
+    if (all_latency != NULL) {
+        std::lock_guard<std::mutex> guard(latency_lock);
+        latency_stopped = true;
+        print_latency(latency_filename());
+    }
 }
 
 }
@@ -0,0 +1,91 @@
+#include "BinaryProfile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BinaryProfile::~BinaryProfile() {
+    if (base != nullptr) munmap(base, length);
+}
+
+bool BinaryProfile::isBinaryProfile(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == nullptr) return false;
+    char magic[sizeof(ProfileMagic)];
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    return n == sizeof(magic) && memcmp(magic, ProfileMagic, sizeof(magic)) == 0;
+}
+
+static bool tableInFile(uint64_t offset, uint64_t count, size_t entrySize, size_t length) {
+    if (count == 0) return true;
+    if (offset % 8 != 0 || offset > length) return false;
+    return count <= (length - offset) / entrySize;
+}
+
+bool BinaryProfile::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ProfileHeader)) {
+        close(fd);
+        return false;
+    }
+    length = st.st_size;
+    base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        return false;
+    }
+    header = (const ProfileHeader*)base;
+    if (memcmp(header->magic, ProfileMagic, sizeof(ProfileMagic)) != 0) {
+        fprintf(stderr, "%s is not a binary profile\n", filename.c_str());
+        return false;
+    }
+    if (header->version != ProfileVersion) {
+        fprintf(stderr, "%s has profile version %u, expect %u\n", filename.c_str(), header->version, ProfileVersion);
+        return false;
+    }
+    if (header->headerSize < sizeof(ProfileHeader) ||
+        !tableInFile(header->addressOffset, header->addressCount, sizeof(ProfileAddressEntry), length) ||
+        !tableInFile(header->callPairOffset, header->callPairCount, sizeof(ProfileCallEntry), length) ||
+        !tableInFile(header->callsiteOffset, header->callsiteCount, sizeof(ProfileCallEntry), length)) {
+        fprintf(stderr, "%s is truncated\n", filename.c_str());
+        return false;
+    }
+    // The address table is searched for the life of the profile
+    madvise(base, length, MADV_WILLNEED);
+    return true;
+}
+
+const ProfileAddressEntry* BinaryProfile::addresses(size_t& n) {
+    n = header->addressCount;
+    return (const ProfileAddressEntry*)((const char*)base + header->addressOffset);
+}
+
+const ProfileCallEntry* BinaryProfile::callPairs(size_t& n) {
+    n = header->callPairCount;
+    return (const ProfileCallEntry*)((const char*)base + header->callPairOffset);
+}
+
+const ProfileCallEntry* BinaryProfile::callsites(size_t& n) {
+    n = header->callsiteCount;
+    return (const ProfileCallEntry*)((const char*)base + header->callsiteOffset);
+}
+
+const ProfileAddressEntry* BinaryProfile::findAddress(uint64_t addr) {
+    size_t n;
+    const ProfileAddressEntry* table = addresses(n);
+    const ProfileAddressEntry* it = std::lower_bound(table, table + n, addr,
+        [] (const ProfileAddressEntry& e, uint64_t a) {
+            return e.addr < a;
+        }
+    );
+    if (it == table + n || it->addr != addr) return nullptr;
+    return it;
+}
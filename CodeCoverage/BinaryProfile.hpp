@@ -0,0 +1,69 @@
+#ifndef BINARY_PROFILE_HPP
+#define BINARY_PROFILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary container for the PGO inputs of CodeCoverage.
+//
+// The file starts with a ProfileHeader, followed by three tables, each
+// aligned to 8 bytes and sorted by address so that they can be searched
+// in place after mmap:
+//   address table:  ProfileAddressEntry, as --pgo-address-file
+//   call pair table: ProfileCallEntry (caller, callee), as --pgo-call-file
+//   callsite table:  ProfileCallEntry (callsite, callee), as --pgo-inline-file
+// Addresses are stored exactly as in the text files. All fields are
+// little endian. A reader rejects files with a different major version.
+//
+// LoopCloneOptimizer keeps the profile mapped and looks up block metrics
+// in the address table with findAddress. The call tables are read once,
+// in order, into the call graph and the inlining candidates.
+
+static const char ProfileMagic[8] = {'D', 'Y', 'N', 'P', 'R', 'O', 'F', '\0'};
+static const uint32_t ProfileVersion = 1;
+
+struct ProfileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t addressCount;
+    uint64_t addressOffset;
+    uint64_t callPairCount;
+    uint64_t callPairOffset;
+    uint64_t callsiteCount;
+    uint64_t callsiteOffset;
+};
+
+struct ProfileAddressEntry {
+    uint64_t addr;
+    double metric;
+};
+
+struct ProfileCallEntry {
+    uint64_t from;
+    uint64_t to;
+    double metric;
+};
+
+class BinaryProfile {
+    void* base;
+    size_t length;
+    const ProfileHeader* header;
+
+public:
+    BinaryProfile(): base(nullptr), length(0), header(nullptr) {}
+    ~BinaryProfile();
+
+    // Return true if the file starts with the profile magic
+    static bool isBinaryProfile(const std::string&);
+    bool open(const std::string&);
+
+    const ProfileAddressEntry* addresses(size_t& n);
+    const ProfileCallEntry* callPairs(size_t& n);
+    const ProfileCallEntry* callsites(size_t& n);
+    // Binary search in the sorted address table
+    const ProfileAddressEntry* findAddress(uint64_t);
+};
+
+#endif
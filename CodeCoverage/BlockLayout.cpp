@@ -0,0 +1,347 @@
+#include "BlockLayout.hpp"
+#include "LoopCloneOptimizer.hpp"
+#include "HotColdSplit.hpp"
+#include "ProfileInference.hpp"
+
+#include "PatchCFG.h"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+
+// Parameters of the ext-TSP score, following
+// Newell and Pupyrev, "Improved Basic Block Reordering", 2020
+static const double FallthroughWeight = 1.0;
+static const double ForwardWeight = 0.1;
+static const double BackwardWeight = 0.1;
+static const int64_t ForwardDistance = 1024;
+static const int64_t BackwardDistance = 640;
+
+// Only try to split chains up to this many blocks
+static const size_t ChainSplitThreshold = 128;
+// Keep the original order for functions larger than this
+static const size_t MaxLayoutBlocks = 10000;
+
+enum MergeKind { XY, YX, X1YX2, Y1XY2 };
+
+BlockLayout::BlockLayout(PatchFunction* f, const std::set<uint64_t>& instAddrs, int probeSize): func(f) {
+    entry = -1;
+    buildGraph(instAddrs, probeSize);
+}
+
+void BlockLayout::buildGraph(const std::set<uint64_t>& instAddrs, int probeSize) {
+    std::vector<PatchBlock*> blocks(func->blocks().begin(), func->blocks().end());
+    std::sort(blocks.begin(), blocks.end(),
+        [] (PatchBlock* a, PatchBlock* b) {
+            if (a->start() != b->start()) return a->start() < b->start();
+            return a->getCloneVersion() < b->getCloneVersion();
+        }
+    );
+
+    // Loop clones share the address of the original block. Execution
+    // settles in the last loop version, where every probe has been
+    // removed, so that copy gets the samples.
+    std::set<PatchBlock*> steadyBlocks;
+    LoopCloneOptimizer::getSteadyStateBlocks(func, steadyBlocks);
+
+    std::unordered_map<PatchBlock*, int> index;
+    for (auto b : blocks) {
+        Node n;
+        n.block = b;
+        n.size = b->end() - b->start();
+        if (instAddrs.find(b->start()) != instAddrs.end()) n.size += probeSize;
+        // Samples are proportional to both execution count and block size
+        n.count = 0;
+        if (steadyBlocks.find(b) != steadyBlocks.end()) {
+            n.count = LoopCloneOptimizer::getPGOMetric(b->start()) / std::max<uint64_t>(1, b->end() - b->start());
+        }
+        index[b] = nodes.size();
+        if (b == func->entry()) entry = nodes.size();
+        nodes.emplace_back(n);
+    }
+
+    outEdges.resize(nodes.size());
+    inEdges.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        std::vector<int> targets;
+        for (auto e : nodes[i].block->targets()) {
+            if (e->sinkEdge() || e->interproc()) continue;
+            if (e->type() == Dyninst::ParseAPI::CATCH) continue;
+            auto it = index.find(e->trg());
+            if (it == index.end()) continue;
+            targets.emplace_back(it->second);
+        }
+        // Use inferred edge counts when there are any, otherwise split the
+        // count of a block over its successors in proportion to their counts
+        double total = 0;
+        for (auto t : targets) {
+            total += nodes[t].count;
+        }
+        for (auto t : targets) {
+            Edge e;
+            e.src = i;
+            e.trg = t;
+            double inferred;
+            if (nodes[i].count > 0 && ProfileInference::getEdgeCount(nodes[i].block->start(), nodes[t].block->start(), inferred)) {
+                e.weight = inferred;
+            } else if (total > 0) {
+                e.weight = nodes[i].count * nodes[t].count / total;
+            } else {
+                e.weight = nodes[i].count / targets.size();
+            }
+            outEdges[i].emplace_back(edges.size());
+            inEdges[t].emplace_back(edges.size());
+            edges.emplace_back(e);
+        }
+    }
+    pos.assign(nodes.size(), 0);
+}
+
+bool BlockLayout::hasProfile() {
+    for (auto &n : nodes) {
+        if (n.count > 0) return true;
+    }
+    return false;
+}
+
+double BlockLayout::score(const std::vector<int>& seq, const std::vector<int>& edgeIds) {
+    int64_t offset = 0;
+    for (auto n : seq) {
+        pos[n] = offset;
+        offset += nodes[n].size;
+    }
+    double ret = 0;
+    for (auto id : edgeIds) {
+        Edge& e = edges[id];
+        int64_t srcEnd = pos[e.src] + nodes[e.src].size;
+        int64_t dst = pos[e.trg];
+        if (dst == srcEnd) {
+            ret += FallthroughWeight * e.weight;
+        } else if (dst > srcEnd) {
+            int64_t d = dst - srcEnd;
+            if (d <= ForwardDistance) {
+                ret += ForwardWeight * e.weight * (1.0 - (double)d / ForwardDistance);
+            }
+        } else {
+            int64_t d = srcEnd - dst;
+            if (d <= BackwardDistance) {
+                ret += BackwardWeight * e.weight * (1.0 - (double)d / BackwardDistance);
+            }
+        }
+    }
+    return ret;
+}
+
+void BlockLayout::collectEdges(int cx, int cy, std::vector<int>& edgeIds) {
+    for (auto c : {cx, cy}) {
+        for (auto n : chains[c]) {
+            for (auto id : outEdges[n]) {
+                int t = chainOf[edges[id].trg];
+                if (t == cx || t == cy) edgeIds.emplace_back(id);
+            }
+        }
+    }
+}
+
+void BlockLayout::mergedSequence(int cx, int cy, const Merge& m, std::vector<int>& seq) {
+    std::vector<int>& x = chains[cx];
+    std::vector<int>& y = chains[cy];
+    seq.clear();
+    switch (m.kind) {
+        case XY:
+            seq.insert(seq.end(), x.begin(), x.end());
+            seq.insert(seq.end(), y.begin(), y.end());
+            break;
+        case YX:
+            seq.insert(seq.end(), y.begin(), y.end());
+            seq.insert(seq.end(), x.begin(), x.end());
+            break;
+        case X1YX2:
+            seq.insert(seq.end(), x.begin(), x.begin() + m.split);
+            seq.insert(seq.end(), y.begin(), y.end());
+            seq.insert(seq.end(), x.begin() + m.split, x.end());
+            break;
+        case Y1XY2:
+            seq.insert(seq.end(), y.begin(), y.begin() + m.split);
+            seq.insert(seq.end(), x.begin(), x.end());
+            seq.insert(seq.end(), y.begin() + m.split, y.end());
+            break;
+    }
+}
+
+BlockLayout::Merge BlockLayout::bestMerge(int cx, int cy) {
+    std::vector<int> edgeIds;
+    collectEdges(cx, cy, edgeIds);
+    double base = chainScore[cx] + chainScore[cy];
+
+    Merge best;
+    best.gain = 0;
+    best.kind = -1;
+    best.split = 0;
+
+    std::vector<Merge> tries;
+    tries.push_back(Merge{0, XY, 0});
+    tries.push_back(Merge{0, YX, 0});
+    if (chains[cx].size() <= ChainSplitThreshold) {
+        for (size_t i = 1; i < chains[cx].size(); ++i) {
+            tries.push_back(Merge{0, X1YX2, (int)i});
+        }
+    }
+    if (chains[cy].size() <= ChainSplitThreshold) {
+        for (size_t i = 1; i < chains[cy].size(); ++i) {
+            tries.push_back(Merge{0, Y1XY2, (int)i});
+        }
+    }
+
+    std::vector<int> seq;
+    for (auto &m : tries) {
+        mergedSequence(cx, cy, m, seq);
+        // The function entry has to stay the first block
+        if (chainOf[entry] == cx || chainOf[entry] == cy) {
+            if (seq[0] != entry) continue;
+        }
+        m.gain = score(seq, edgeIds) - base;
+        if (m.gain > best.gain + 1e-9) best = m;
+    }
+    return best;
+}
+
+void BlockLayout::computeOrder() {
+    order.clear();
+    size_t n = nodes.size();
+    if (n == 0) return;
+    if (n > MaxLayoutBlocks || entry < 0 || !hasProfile()) {
+        originalOrder();
+        return;
+    }
+
+    chains.assign(n, std::vector<int>());
+    chainOf.assign(n, 0);
+    chainScore.assign(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        chains[i].emplace_back(i);
+        chainOf[i] = i;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        std::vector<int> edgeIds;
+        collectEdges(i, i, edgeIds);
+        chainScore[i] = score(chains[i], edgeIds);
+    }
+
+    std::map< std::pair<int, int>, Merge> candidates;
+    auto addCandidates = [this, &candidates] (int c) {
+        for (auto node : chains[c]) {
+            for (auto list : {&outEdges[node], &inEdges[node]}) {
+                for (auto id : *list) {
+                    int other = chainOf[edges[id].src == node ? edges[id].trg : edges[id].src];
+                    if (other == c) continue;
+                    std::pair<int, int> key(std::min(c, other), std::max(c, other));
+                    if (candidates.find(key) != candidates.end()) continue;
+                    candidates[key] = bestMerge(key.first, key.second);
+                }
+            }
+        }
+    };
+    for (size_t i = 0; i < n; ++i) {
+        addCandidates(i);
+    }
+
+    while (true) {
+        auto best = candidates.end();
+        for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+            if (it->second.kind < 0) continue;
+            if (best == candidates.end() || it->second.gain > best->second.gain) best = it;
+        }
+        if (best == candidates.end()) break;
+
+        int cx = best->first.first;
+        int cy = best->first.second;
+        std::vector<int> seq;
+        mergedSequence(cx, cy, best->second, seq);
+        chainScore[cx] += chainScore[cy] + best->second.gain;
+        chains[cx] = seq;
+        chains[cy].clear();
+        for (auto node : seq) {
+            chainOf[node] = cx;
+        }
+        for (auto it = candidates.begin(); it != candidates.end(); ) {
+            if (it->first.first == cx || it->first.second == cx ||
+                it->first.first == cy || it->first.second == cy) {
+                it = candidates.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        addCandidates(cx);
+    }
+
+    // The entry chain goes first, then chains by decreasing execution density
+    std::vector<int> chainOrder;
+    std::vector<double> density(n, 0);
+    for (size_t c = 0; c < n; ++c) {
+        if (chains[c].empty()) continue;
+        double weight = 0;
+        uint64_t size = 0;
+        for (auto node : chains[c]) {
+            weight += nodes[node].count * nodes[node].size;
+            size += nodes[node].size;
+        }
+        density[c] = size > 0 ? weight / size : 0;
+        chainOrder.emplace_back(c);
+    }
+    int entryChain = chainOf[entry];
+    std::sort(chainOrder.begin(), chainOrder.end(),
+        [this, &density, entryChain] (int a, int b) {
+            if ((a == entryChain) != (b == entryChain)) return a == entryChain;
+            if (density[a] != density[b]) return density[a] > density[b];
+            return chains[a][0] < chains[b][0];
+        }
+    );
+    for (auto c : chainOrder) {
+        order.insert(order.end(), chains[c].begin(), chains[c].end());
+    }
+}
+
+void BlockLayout::originalOrder() {
+    order.clear();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        order.emplace_back(i);
+    }
+}
+
+double BlockLayout::originalScore() {
+    std::vector<int> seq, edgeIds;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        seq.emplace_back(i);
+    }
+    for (size_t i = 0; i < edges.size(); ++i) {
+        edgeIds.emplace_back(i);
+    }
+    return score(seq, edgeIds);
+}
+
+double BlockLayout::newScore() {
+    std::vector<int> edgeIds;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        edgeIds.emplace_back(i);
+    }
+    return score(order, edgeIds);
+}
+
+void BlockLayout::apply(HotColdSplit* split, uint64_t& nextColdOrder) {
+    uint64_t hotOrder = 0;
+    for (auto n : order) {
+        PatchBlock* b = nodes[n].block;
+        if (split != nullptr && split->isCold(b)) {
+            assert(nextColdOrder < ColdLayoutBase);
+            b->setLayoutOrder(ColdLayoutBase + nextColdOrder);
+            nextColdOrder += 1;
+        } else {
+            b->setLayoutOrder(hotOrder);
+            hotOrder += 1;
+        }
+    }
+}
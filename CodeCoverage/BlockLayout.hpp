@@ -0,0 +1,77 @@
+#ifndef BLOCK_LAYOUT_HPP
+#define BLOCK_LAYOUT_HPP
+
+#include <cstdint>
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+class HotColdSplit;
+
+// Order the blocks of a relocated function for fall-through using
+// the ext-TSP model: chains of blocks are merged greedily, picking the
+// merge that increases the ext-TSP score the most, and the resulting
+// chains are laid out by execution density with the entry chain first.
+class BlockLayout {
+    struct Node {
+        Dyninst::PatchAPI::PatchBlock* block;
+        uint64_t size;
+        double count;
+    };
+    struct Edge {
+        int src, trg;
+        double weight;
+    };
+    struct Merge {
+        double gain;
+        int kind;
+        int split;
+    };
+
+    Dyninst::PatchAPI::PatchFunction* func;
+    std::vector<Node> nodes;
+    std::vector<Edge> edges;
+    std::vector< std::vector<int> > outEdges, inEdges;
+    std::vector<int64_t> pos;
+    int entry;
+
+    std::vector< std::vector<int> > chains;
+    std::vector<int> chainOf;
+    std::vector<double> chainScore;
+    std::vector<int> order;
+
+    void buildGraph(const std::set<uint64_t>&, int);
+    double score(const std::vector<int>&, const std::vector<int>&);
+    void mergedSequence(int, int, const Merge&, std::vector<int>&);
+    Merge bestMerge(int, int);
+    void collectEdges(int, int, std::vector<int>&);
+
+public:
+    BlockLayout(Dyninst::PatchAPI::PatchFunction*, const std::set<uint64_t>& instAddrs, int probeSize);
+    bool hasProfile();
+    void computeOrder();
+    double originalScore();
+    double newScore();
+    void originalOrder();
+    // Set the layout orders the relocation sorts blocks by. Dyninst emits
+    // the relocated functions by increasing function layout order, which
+    // CodeCoverage sets to the rank of the function in the call-chain
+    // clustering order, below the number of functions, and the blocks of
+    // each function by increasing block layout order, so the hot blocks of
+    // every function are numbered from 0. Blocks whose order is at least
+    // ColdLayoutBase are emitted after every relocated function, at the
+    // end of .dyninstInst, by increasing order, so the cold blocks of the
+    // split are numbered from nextColdOrder, shared by all functions, in
+    // the order the functions are applied. tests/layout.sh and
+    // tests/split.sh check both orders on a rewritten binary.
+    void apply(HotColdSplit* split, uint64_t& nextColdOrder);
+};
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef CALL_CHAIN_CLUSTERING_HPP
+#define CALL_CHAIN_CLUSTERING_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+struct CallEdge {
+    uint64_t caller;
+    uint64_t callee;
+    double metric;
+    CallEdge(uint64_t s, uint64_t t, double m): caller(s), callee(t), metric(m) {}
+};
+
+// Order functions with call-chain clustering (C3), as described in
+// Ottoni and Maher, "Optimizing Function Placement for Large-Scale
+// Data-Center Applications", CGO 2017.
+// Functions are visited by decreasing hotness density. Each one is
+// appended to the cluster of its hottest caller, unless the merged
+// cluster would exceed the page size or become much colder. The
+// clusters are then laid out by decreasing density.
+//
+// A function is as hot as the calls into it. Functions never called
+// from the binary, like main, are as hot as the calls they make.
+//
+// Shared by CodeCoverage and CallGraph/FuncSort, which only differ in
+// how they read the call profile and apply the order.
+class CallChainClustering {
+    struct Cluster {
+        std::vector<int> funcs;
+        uint64_t size;
+        double samples;
+        double density() const { return size > 0 ? samples / size : 0; }
+    };
+
+    // Do not merge into a cluster when it would lose
+    // more than this factor of its density
+    static constexpr double MaxDensityDegradation = 8.0;
+
+    std::vector<uint64_t> addrs;
+    std::vector<uint64_t> sizes;
+    std::vector<double> samples;
+    std::vector<double> outCalls;
+    std::vector< std::map<int, double> > callers;
+    std::unordered_map<uint64_t, int> index;
+    std::vector<Cluster> clusters;
+    std::vector<int> clusterOf;
+    std::vector<int> order;
+    size_t clusterCount;
+
+public:
+    // Functions by start address and size, in any order
+    CallChainClustering(const std::vector<uint64_t>& a, const std::vector<uint64_t>& s):
+        addrs(a), sizes(s), samples(a.size(), 0), outCalls(a.size(), 0), callers(a.size()), clusterCount(0) {
+        for (size_t i = 0; i < addrs.size(); ++i) {
+            index[addrs[i]] = i;
+        }
+    }
+
+    // Calls by function start address. Callers outside of the
+    // functions only add to the hotness of the callee.
+    void addCalls(uint64_t caller, uint64_t callee, double weight) {
+        auto cit = index.find(callee);
+        auto sit = index.find(caller);
+        if (sit != index.end()) outCalls[sit->second] += weight;
+        if (cit == index.end()) return;
+        samples[cit->second] += weight;
+        if (sit == index.end() || sit->second == cit->second) return;
+        callers[cit->second][sit->second] += weight;
+    }
+
+    // Clusters never grow past pageSize bytes, unless it is 0
+    void cluster(uint64_t pageSize) {
+        size_t n = addrs.size();
+        clusters.clear();
+        clusterOf.assign(n, -1);
+        std::vector<double> hotness(samples);
+        std::vector<int> hotFuncs;
+        for (size_t i = 0; i < n; ++i) {
+            if (hotness[i] <= 0) hotness[i] = outCalls[i];
+            if (hotness[i] <= 0) continue;
+            Cluster c;
+            c.funcs.emplace_back(i);
+            c.size = sizes[i];
+            c.samples = hotness[i];
+            clusterOf[i] = clusters.size();
+            clusters.emplace_back(c);
+            hotFuncs.emplace_back(i);
+        }
+
+        std::sort(hotFuncs.begin(), hotFuncs.end(),
+            [this, &hotness] (int a, int b) {
+                double da = hotness[a] / std::max<uint64_t>(1, sizes[a]);
+                double db = hotness[b] / std::max<uint64_t>(1, sizes[b]);
+                if (da != db) return da > db;
+                return addrs[a] < addrs[b];
+            }
+        );
+
+        for (auto f : hotFuncs) {
+            int cf = clusterOf[f];
+            // Only the first function of a cluster can be appended to its caller
+            if (clusters[cf].funcs[0] != f) continue;
+
+            int pred = -1;
+            double predWeight = 0;
+            for (auto &it : callers[f]) {
+                if (clusterOf[it.first] < 0) continue;
+                if (it.second > predWeight || (it.second == predWeight && pred >= 0 && addrs[it.first] < addrs[pred])) {
+                    pred = it.first;
+                    predWeight = it.second;
+                }
+            }
+            if (pred < 0) continue;
+            int cp = clusterOf[pred];
+            if (cp == cf) continue;
+
+            Cluster& from = clusters[cf];
+            Cluster& into = clusters[cp];
+            if (pageSize > 0 && into.size + from.size > pageSize) continue;
+            double mergedDensity = (into.samples + from.samples) / std::max<uint64_t>(1, into.size + from.size);
+            if (mergedDensity * MaxDensityDegradation < into.density()) continue;
+
+            for (auto g : from.funcs) {
+                clusterOf[g] = cp;
+            }
+            into.funcs.insert(into.funcs.end(), from.funcs.begin(), from.funcs.end());
+            into.size += from.size;
+            into.samples += from.samples;
+            from.funcs.clear();
+            from.size = 0;
+            from.samples = 0;
+        }
+
+        std::vector<int> clusterOrder;
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            if (!clusters[c].funcs.empty()) clusterOrder.emplace_back(c);
+        }
+        std::sort(clusterOrder.begin(), clusterOrder.end(),
+            [this] (int a, int b) {
+                double da = clusters[a].density();
+                double db = clusters[b].density();
+                if (da != db) return da > db;
+                return addrs[clusters[a].funcs[0]] < addrs[clusters[b].funcs[0]];
+            }
+        );
+
+        order.clear();
+        for (auto c : clusterOrder) {
+            order.insert(order.end(), clusters[c].funcs.begin(), clusters[c].funcs.end());
+        }
+        clusterCount = clusterOrder.size();
+    }
+
+    // Indices of the clustered functions in the new order.
+    // Functions without calls are not in it.
+    const std::vector<int>& getOrder() { return order; }
+    size_t getClusterCount() { return clusterCount; }
+
+    uint64_t hotBytes() {
+        uint64_t bytes = 0;
+        for (auto f : order) {
+            bytes += sizes[f];
+        }
+        return bytes;
+    }
+
+    // Pages covered by the clustered functions, at their original
+    // addresses, or packed from address 0 in the new order
+    uint64_t hotPages(uint64_t pageSize, bool packed) {
+        std::set<uint64_t> pages;
+        uint64_t offset = 0;
+        for (auto f : order) {
+            uint64_t start = packed ? offset : addrs[f];
+            offset += sizes[f];
+            if (sizes[f] == 0) continue;
+            for (uint64_t p = start / pageSize; p <= (start + sizes[f] - 1) / pageSize; ++p) {
+                pages.insert(p);
+            }
+        }
+        return pages.size();
+    }
+};
+
+#endif
@@ -0,0 +1,464 @@
+// Check how well loop cloning absorbed the samples of a rewritten binary,
+// and search the loop cloning knobs of CodeCoverage for the lowest overhead.
+//
+// Report mode reads the address mapping written by CodeCoverage
+// --enable-profile and a sampled profile of the rewritten binary, and
+// attributes every sample to the original code, to a kind of
+// instrumentation, or to the rest of the binary, per clone version,
+// like script/ProfileGuidedBinaryRewriting/FlatVersionProfile.py.
+//
+// Usage: CloneTuner --mapping-file file --profile file [--min-percent p]
+//
+// The profile is either "addr metric" lines in hex and decimal, or a
+// binary profile written by ProfileConvert.
+//
+// Tune mode rewrites the binary with every combination of
+// --loop-clone-limit and --pgo-ratio, times the workload on each rewrite
+// and reports the configuration with the lowest overhead. The workload
+// command is run by the shell with every "{}" replaced by the binary.
+//
+// Usage: CloneTuner --tune --codecoverage path --input binary --workload cmd
+//                   [--coverage-args args] [--loop-clone-limits 1,2,4]
+//                   [--pgo-ratios 0.8,0.9] [--repeat n] [--work-dir dir]
+
+#include "BinaryProfile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+struct MapEntry {
+    uint64_t relocAddr;
+    int64_t origAddr;
+    uint64_t size;
+    std::string version;
+};
+
+struct Sample {
+    uint64_t addr;
+    double metric;
+};
+
+struct TuneResult {
+    int limit;
+    double ratio;
+    bool ok;
+    double seconds;
+};
+
+std::string mapping_filename;
+std::string profile_filename;
+double min_percent = 1.0;
+
+bool tune = false;
+std::string codecoverage_path;
+std::string input_filename;
+std::string workload_command;
+std::string coverage_args;
+std::string work_dir = ".";
+std::vector<int> loop_clone_limits = {1, 2, 4, 8};
+std::vector<double> pgo_ratios = {0.5, 0.8, 0.9, 0.95, 0.99};
+int repeat = 3;
+
+std::vector<MapEntry> entries;
+std::vector<std::string> strings;
+std::vector<Sample> samples;
+
+static bool readMappingFile(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "r");
+    if (f == NULL) return false;
+    int totalMapEntry;
+    if (fscanf(f, "%d", &totalMapEntry) != 1) {
+        fclose(f);
+        return false;
+    }
+    char orig[64], version[256];
+    for (int i = 0; i < totalMapEntry; ++i) {
+        MapEntry e;
+        if (fscanf(f, "%lx %63s %lx %255s", &e.relocAddr, orig, &e.size, version) != 4) {
+            fclose(f);
+            return false;
+        }
+        // A negative original address is the index of the string
+        // naming the instrumentation at this address
+        if (orig[0] == '-') {
+            e.origAddr = strtoll(orig, NULL, 10);
+        } else {
+            e.origAddr = strtoll(orig, NULL, 16);
+        }
+        e.version = version;
+        entries.push_back(e);
+    }
+    int totalStringEntry;
+    if (fscanf(f, "%d", &totalStringEntry) != 1) {
+        fclose(f);
+        return false;
+    }
+    char s[256];
+    for (int i = 0; i < totalStringEntry; ++i) {
+        if (fscanf(f, "%255s", s) != 1) {
+            fclose(f);
+            return false;
+        }
+        strings.push_back(s);
+    }
+    fclose(f);
+    std::stable_sort(entries.begin(), entries.end(),
+        [] (const MapEntry& a, const MapEntry& b) {
+            return a.relocAddr < b.relocAddr;
+        }
+    );
+    return true;
+}
+
+static bool readProfile(const std::string& filename) {
+    if (BinaryProfile::isBinaryProfile(filename)) {
+        BinaryProfile profile;
+        if (!profile.open(filename)) return false;
+        size_t n;
+        const ProfileAddressEntry* table = profile.addresses(n);
+        for (size_t i = 0; i < n; ++i) {
+            samples.push_back(Sample{table[i].addr, table[i].metric});
+        }
+        return true;
+    }
+    FILE* f = fopen(filename.c_str(), "r");
+    if (f == NULL) return false;
+    Sample s;
+    while (fscanf(f, "%lx %lf", &s.addr, &s.metric) == 2) {
+        samples.push_back(s);
+    }
+    fclose(f);
+    return true;
+}
+
+// Return the index of the mapping entry containing addr, or -1
+static int findEntry(uint64_t addr) {
+    auto it = std::upper_bound(entries.begin(), entries.end(), addr,
+        [] (uint64_t a, const MapEntry& e) {
+            return a < e.relocAddr;
+        }
+    );
+    if (it == entries.begin()) return -1;
+    --it;
+    if (addr >= it->relocAddr + it->size) return -1;
+    return it - entries.begin();
+}
+
+static std::string category(int index) {
+    if (index < 0) return "other";
+    int64_t o = entries[index].origAddr;
+    if (o > 0) return "original";
+    // A negative address -k names the k-th string, 0 names nothing
+    if (o < 0 && -o - 1 < (int64_t)strings.size()) return strings[-o - 1];
+    return "other";
+}
+
+// Versions are written as the clone version number of the block,
+// where the loop version is in the upper bits
+static int loopVersion(const std::string& version) {
+    char* end;
+    long v = strtol(version.c_str(), &end, 0);
+    if (end == version.c_str() || *end != 0) return -1;
+    return v >> 16;
+}
+
+static void printSorted(const std::map<std::string, double>& m, double total) {
+    std::vector< std::pair<double, std::string> > list;
+    for (auto &it : m) {
+        list.push_back(std::make_pair(it.second, it.first));
+    }
+    std::sort(list.rbegin(), list.rend());
+    for (auto &it : list) {
+        if (it.first == 0) break;
+        printf("  %-16s %.2lf %.2lf%%\n", it.second.c_str(), it.first, it.first * 100.0 / total);
+    }
+}
+
+static void report() {
+    double total = 0;
+    std::map<std::string, double> categoryMetric, versionMetric;
+    for (auto &s : strings) {
+        categoryMetric[s] = 0;
+    }
+    categoryMetric["original"] = 0;
+    categoryMetric["other"] = 0;
+
+    // Instrumentation samples go to the block that follows the probe
+    std::map<int64_t, double> instMetric;
+    std::map<int64_t, std::map<std::string, double> > instVersionMetric;
+    // Original code samples per block and loop version
+    std::map<int64_t, std::map<int, double> > origVersionMetric;
+    std::map<int64_t, int> maxLoopVersion;
+    for (auto &e : entries) {
+        if (e.origAddr <= 0) continue;
+        int v = loopVersion(e.version);
+        auto it = maxLoopVersion.find(e.origAddr);
+        if (it == maxLoopVersion.end() || it->second < v) maxLoopVersion[e.origAddr] = v;
+    }
+
+    for (auto &s : samples) {
+        total += s.metric;
+        int index = findEntry(s.addr);
+        std::string c = category(index);
+        categoryMetric[c] += s.metric;
+        versionMetric[index < 0 ? "other" : entries[index].version] += s.metric;
+        if (c == "original") {
+            origVersionMetric[entries[index].origAddr][loopVersion(entries[index].version)] += s.metric;
+        } else if (c != "other" && index + 1 < (int)entries.size()) {
+            const MapEntry& next = entries[index + 1];
+            instMetric[next.origAddr] += s.metric;
+            instVersionMetric[next.origAddr][next.version] += s.metric;
+        }
+    }
+    if (total == 0) {
+        printf("No samples\n");
+        return;
+    }
+    printf("Total metric %.2lf\n", total);
+
+    printf("Instrumentation profile:\n");
+    printSorted(categoryMetric, total);
+
+    double instTotal = total - categoryMetric["original"] - categoryMetric["other"];
+    std::vector< std::pair<double, int64_t> > instList;
+    for (auto &it : instMetric) {
+        instList.push_back(std::make_pair(it.second, it.first));
+    }
+    std::sort(instList.rbegin(), instList.rend());
+    for (auto &it : instList) {
+        double percent = it.first * 100.0 / instTotal;
+        if (percent < min_percent) break;
+        printf("  %lx %.2lf %.2lf%%\n", it.second, it.first, percent);
+        for (auto &v : instVersionMetric[it.second]) {
+            printf("    %s %.2lf %.2lf%%\n", v.first.c_str(), v.second, v.second * 100.0 / it.first);
+        }
+    }
+
+    printf("Version profile:\n");
+    printSorted(versionMetric, total);
+
+    // A cloned loop has done its job when execution settles in its last
+    // loop version, where every probe has been removed
+    double clonedMetric = 0, steadyMetric = 0;
+    int clonedBlocks = 0;
+    for (auto &it : origVersionMetric) {
+        int maxV = maxLoopVersion[it.first];
+        if (maxV <= 0) continue;
+        ++clonedBlocks;
+        for (auto &v : it.second) {
+            clonedMetric += v.second;
+            if (v.first == maxV) steadyMetric += v.second;
+        }
+    }
+    printf("Clone effectiveness:\n");
+    printf("  %d sampled blocks are cloned, with %.2lf%% of the metric\n", clonedBlocks, clonedMetric * 100.0 / total);
+    if (clonedMetric > 0) {
+        printf("  %.2lf%% of the cloned block metric is in the steady-state version\n", steadyMetric * 100.0 / clonedMetric);
+    }
+    printf("  %.2lf%% of the metric is in instrumentation\n", instTotal * 100.0 / total);
+}
+
+static std::string substitute(const std::string& cmd, const std::string& binary) {
+    std::string ret;
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        if (cmd[i] == '{' && i + 1 < cmd.size() && cmd[i + 1] == '}') {
+            ret += binary;
+            ++i;
+        } else {
+            ret += cmd[i];
+        }
+    }
+    return ret;
+}
+
+// Return the fastest of the runs in seconds, or a negative value
+// if any run of the workload fails
+static double timeWorkload(const std::string& binary) {
+    std::string cmd = substitute(workload_command, binary);
+    double best = -1;
+    for (int i = 0; i < repeat; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        int ret = system(cmd.c_str());
+        auto end = std::chrono::steady_clock::now();
+        if (ret != 0) {
+            fprintf(stderr, "Workload fails on %s with status %d\n", binary.c_str(), ret);
+            return -1;
+        }
+        double t = std::chrono::duration<double>(end - start).count();
+        if (best < 0 || t < best) best = t;
+    }
+    return best;
+}
+
+static bool rewrite(int limit, double ratio, const std::string& output) {
+    char knobs[128];
+    snprintf(knobs, sizeof(knobs), " --loop-clone-limit %d --pgo-ratio %g --output ", limit, ratio);
+    std::string cmd = codecoverage_path + " " + coverage_args + knobs + output + " " + input_filename + " > " + output + ".log 2>&1";
+    int ret = system(cmd.c_str());
+    if (ret != 0) {
+        fprintf(stderr, "Rewriting fails with status %d, see %s.log\n", ret, output.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void autotune() {
+    double baseline = timeWorkload(input_filename);
+    if (baseline <= 0) {
+        fprintf(stderr, "Cannot time the workload on %s\n", input_filename.c_str());
+        exit(1);
+    }
+    printf("Baseline %.3lf seconds\n", baseline);
+
+    std::vector<TuneResult> results;
+    for (auto limit : loop_clone_limits) {
+        for (auto ratio : pgo_ratios) {
+            char name[128];
+            snprintf(name, sizeof(name), "/tuned.%d.%g", limit, ratio);
+            std::string output = work_dir + name;
+            TuneResult r{limit, ratio, false, 0};
+            if (rewrite(limit, ratio, output)) {
+                r.seconds = timeWorkload(output);
+                r.ok = r.seconds > 0;
+            }
+            if (r.ok) {
+                printf("limit %d ratio %g: %.3lf seconds, overhead %.2lf%%\n", limit, ratio, r.seconds, (r.seconds / baseline - 1) * 100.0);
+            } else {
+                printf("limit %d ratio %g: failed\n", limit, ratio);
+            }
+            fflush(stdout);
+            results.push_back(r);
+        }
+    }
+
+    const TuneResult* best = NULL;
+    for (auto &r : results) {
+        if (!r.ok) continue;
+        if (best == NULL || r.seconds < best->seconds) best = &r;
+    }
+    if (best == NULL) {
+        fprintf(stderr, "No configuration runs the workload\n");
+        exit(1);
+    }
+    printf("Best: --loop-clone-limit %d --pgo-ratio %g, overhead %.2lf%%\n",
+        best->limit, best->ratio, (best->seconds / baseline - 1) * 100.0);
+}
+
+template <typename T>
+static std::vector<T> parseList(const char* s, T (*convert)(const char*)) {
+    std::vector<T> ret;
+    std::string str(s);
+    size_t start = 0;
+    while (start <= str.size()) {
+        size_t end = str.find(',', start);
+        if (end == std::string::npos) end = str.size();
+        if (end > start) ret.push_back(convert(str.substr(start, end - start).c_str()));
+        start = end + 1;
+    }
+    return ret;
+}
+
+static int toInt(const char* s) {
+    return atoi(s);
+}
+
+static double toDouble(const char* s) {
+    return strtod(s, NULL);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mapping-file") == 0) {
+            mapping_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--min-percent") == 0) {
+            min_percent = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--tune") == 0) {
+            tune = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--codecoverage") == 0) {
+            codecoverage_path = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            input_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--workload") == 0) {
+            workload_command = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--coverage-args") == 0) {
+            coverage_args = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--loop-clone-limits") == 0) {
+            loop_clone_limits = parseList<int>(argv[i+1], toInt);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--pgo-ratios") == 0) {
+            pgo_ratios = parseList<double>(argv[i+1], toDouble);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = std::max(1, atoi(argv[i+1]));
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--work-dir") == 0) {
+            work_dir = argv[i+1];
+            i += 1;
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(1);
+    }
+
+    if (tune) {
+        if (codecoverage_path == "" || input_filename == "" || workload_command == "") {
+            fprintf(stderr, "Usage: %s --tune --codecoverage path --input binary --workload cmd [--coverage-args args] "
+                "[--loop-clone-limits list] [--pgo-ratios list] [--repeat n] [--work-dir dir]\n", argv[0]);
+            exit(1);
+        }
+        autotune();
+        return 0;
+    }
+
+    if (mapping_filename == "" || profile_filename == "") {
+        fprintf(stderr, "Usage: %s --mapping-file file --profile file [--min-percent p]\n", argv[0]);
+        exit(1);
+    }
+    if (!readMappingFile(mapping_filename)) {
+        fprintf(stderr, "Cannot read %s\n", mapping_filename.c_str());
+        exit(1);
+    }
+    if (!readProfile(profile_filename)) {
+        fprintf(stderr, "Cannot read %s\n", profile_filename.c_str());
+        exit(1);
+    }
+    report();
+    return 0;
+}
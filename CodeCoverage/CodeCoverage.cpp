@@ -16,11 +16,24 @@
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 
 #include "CoverageLocationOpt.hpp"
+#include "Graph.hpp"
+#include "SingleBlockGraph.hpp"
 #include "CoverageSnippet.hpp"
 #include "LoopCloneOptimizer.hpp"
+#include "OverheadPredictor.hpp"
+#include "InlinePlanner.hpp"
+#include "IndirectCallPromotion.hpp"
+#include "StaticFrequencyEstimator.hpp"
+#include "BlockLayout.hpp"
+#include "HotColdSplit.hpp"
+#include "HotAlignment.hpp"
+#include "CallChainClustering.hpp"
+#include "ProfileInference.hpp"
+#include "BinaryProfile.hpp"
 
 using namespace Dyninst;
 using namespace PatchAPI;
@@ -36,11 +49,28 @@ bool threadLocalMemory = true;
 bool verbose = false;
 bool emptyInst = false;
 bool enableProfile = false;
+bool predictOverhead = false;
+bool staticLoopClone = false;
+bool predictOnly = false;
+bool blockLayout = false;
+bool hotColdSplit = false;
 
 int nops = 0;
 int loop_clone_limit = 5;
+int static_clone_limit = 1;
+int shard_index = 0;
+int shard_count = 1;
+uint64_t cluster_page_size = 4096;
+int align_hot_code = 0;
+int align_max_skip = -1;
+uint64_t align_budget = 4096;
 
 double pgo_ratio = 0.9;
+double static_clone_ratio = 0.3;
+double inline_budget = 10.0;
+double inline_caller_cap = 2.0;
+double promote_min_ratio = 0.8;
+uint64_t promote_min_count = 1000;
 
 extern int gsOffset;
 
@@ -49,28 +79,88 @@ std::string input_filename;
 std::string pgo_address_filename;
 std::string pgo_call_filename;
 std::string pgo_inline_filename;
+std::string pgo_indirect_filename;
 std::string mode = "none";
 std::string coverage_file;
+std::string budget_report_filename;
+std::string predict_json_filename;
+std::string infer_profile_filename;
+std::string export_cfg_filename;
 
-std::vector< std::pair<Address, Address> > callpairs;
-std::vector< std::pair<Address, Address> > callsites;
+CoverageAnalysisOptions analysisOptions;
+
+std::vector<CallEdge> callpairs;
+std::vector<InlineCallsite> callsites;
+std::vector<IndirectCallsite> indirectCallsites;
 
 void readPGOCallFile(std::string &filename) {
+    if (BinaryProfile::isBinaryProfile(filename)) {
+        BinaryProfile profile;
+        if (!profile.open(filename)) {
+            fprintf(stderr, "Cannot read %s\n", filename.c_str());
+            exit(1);
+        }
+        size_t n;
+        const ProfileCallEntry* table = profile.callPairs(n);
+        callpairs.reserve(callpairs.size() + n);
+        for (size_t i = 0; i < n; ++i) {
+            callpairs.emplace_back(CallEdge(table[i].from, table[i].to, table[i].metric));
+        }
+        return;
+    }
     std::ifstream infile(filename, std::fstream::in);
     uint64_t caller, callee;
     double metric;
     while (infile >> std::hex >> caller >> callee >> metric) {
-        callpairs.emplace_back(std::make_pair(caller, callee));
+        callpairs.emplace_back(CallEdge(caller, callee, metric));
     }
 }
 
 void readPGOInlineFile(std::string &filename) {
+    if (BinaryProfile::isBinaryProfile(filename)) {
+        BinaryProfile profile;
+        if (!profile.open(filename)) {
+            fprintf(stderr, "Cannot read %s\n", filename.c_str());
+            exit(1);
+        }
+        size_t n;
+        const ProfileCallEntry* table = profile.callsites(n);
+        callsites.reserve(callsites.size() + n);
+        for (size_t i = 0; i < n; ++i) {
+            callsites.emplace_back(InlineCallsite(table[i].from, table[i].to, table[i].metric));
+        }
+        return;
+    }
     std::ifstream infile(filename, std::fstream::in);
     uint64_t callsite, callee;
     double metric;
     while (infile >> std::hex >> callsite >> callee >> metric) {
-        callsites.emplace_back(std::make_pair(callsite, callee));
+        callsites.emplace_back(InlineCallsite(callsite, callee, metric));
+    }
+}
+
+// The indirect call profile of libcg, one line per call site:
+// callsite caller total n target1 count1 ... targetn countn
+void readPGOIndirectFile(std::string &filename) {
+    FILE* f = fopen(filename.c_str(), "r");
+    if (f == nullptr) {
+        fprintf(stderr, "Cannot read %s\n", filename.c_str());
+        exit(1);
+    }
+    uint64_t n;
+    if (fscanf(f, "%lu", &n) != 1) n = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        IndirectCallsite site;
+        uint64_t caller, targets;
+        if (fscanf(f, "%lx %lx %lu %lu", &site.callsite, &caller, &site.total, &targets) != 4) break;
+        for (uint64_t j = 0; j < targets; ++j) {
+            uint64_t target, count;
+            if (fscanf(f, "%lx %lu", &target, &count) != 2) break;
+            site.targets.emplace_back(target, count);
+        }
+        indirectCallsites.emplace_back(site);
     }
+    fclose(f);
 }
 
 void parse_command_line(int argc, char** argv) {
@@ -118,7 +208,16 @@ void parse_command_line(int argc, char** argv) {
 
         if (strcmp(argv[i], "--pgo-address-file") == 0) {
             pgo_address_filename = argv[i+1];
-            LoopCloneOptimizer::readPGOFile(pgo_address_filename);
+            if (!LoopCloneOptimizer::readPGOFile(pgo_address_filename)) {
+                fprintf(stderr, "Cannot read %s\n", pgo_address_filename.c_str());
+                exit(1);
+            }
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--infer-profile") == 0) {
+            infer_profile_filename = argv[i+1];
             i += 1;
             continue;
         }
@@ -130,6 +229,12 @@ void parse_command_line(int argc, char** argv) {
             continue;
         }
 
+        if (strcmp(argv[i], "--cluster-page-size") == 0) {
+            cluster_page_size = strtoull(argv[i+1], NULL, 0);
+            i += 1;
+            continue;
+        }
+
         if (strcmp(argv[i], "--pgo-inline-file") == 0) {
             pgo_inline_filename = argv[i+1];
             readPGOInlineFile(pgo_inline_filename);
@@ -137,6 +242,37 @@ void parse_command_line(int argc, char** argv) {
             continue;
         }
 
+        if (strcmp(argv[i], "--inline-budget") == 0) {
+            inline_budget = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--inline-caller-cap") == 0) {
+            inline_caller_cap = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--promote-indirect") == 0) {
+            pgo_indirect_filename = argv[i+1];
+            readPGOIndirectFile(pgo_indirect_filename);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--promote-min-ratio") == 0) {
+            promote_min_ratio = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--promote-min-count") == 0) {
+            promote_min_count = strtoull(argv[i+1], NULL, 10);
+            i += 1;
+            continue;
+        }
+
         if (strcmp(argv[i], "--loop-clone-limit") == 0) {
             loop_clone_limit = atoi(argv[i+1]);
             i += 1;
@@ -149,6 +285,64 @@ void parse_command_line(int argc, char** argv) {
             continue;
         }
 
+        if (strcmp(argv[i], "--static-loop-clone") == 0) {
+            staticLoopClone = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--static-clone-ratio") == 0) {
+            static_clone_ratio = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--static-clone-limit") == 0) {
+            static_clone_limit = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--block-layout") == 0) {
+            blockLayout = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--hot-cold-split") == 0) {
+            hotColdSplit = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--cold-coverage-file") == 0) {
+            if (!HotColdSplit::readCoverageFile(argv[i+1])) {
+                fprintf(stderr, "Cannot read coverage file %s\n", argv[i+1]);
+                exit(1);
+            }
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--align-hot-code") == 0) {
+            align_hot_code = atoi(argv[i+1]);
+            if (align_hot_code < 2 || (align_hot_code & (align_hot_code - 1)) != 0) {
+                fprintf(stderr, "Invalid alignment %s, expect a power of two\n", argv[i+1]);
+                exit(1);
+            }
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--align-max-skip") == 0) {
+            align_max_skip = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--align-budget") == 0) {
+            align_budget = strtoull(argv[i+1], NULL, 10);
+            i += 1;
+            continue;
+        }
+
         if (strcmp(argv[i], "--empty-inst") == 0) {
             emptyInst = true;
             continue;
@@ -165,12 +359,117 @@ void parse_command_line(int argc, char** argv) {
             continue;
         }
 
+        if (strcmp(argv[i], "--analysis-block-budget") == 0) {
+            analysisOptions.maxBlocks = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--analysis-time-budget") == 0) {
+            analysisOptions.maxSeconds = strtod(argv[i+1], NULL);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--analysis-fallback-mode") == 0) {
+            analysisOptions.fallbackMode = std::string(argv[i+1]);
+            if (analysisOptions.fallbackMode != "leaf" && analysisOptions.fallbackMode != "none") {
+                fprintf(stderr, "Invalid fallback mode %s, expect leaf or none\n", argv[i+1]);
+                exit(1);
+            }
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--analysis-budget-report") == 0) {
+            budget_report_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--export-cfg") == 0) {
+            export_cfg_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--dominator-engine") == 0) {
+            GraphAnalysis::DominatorEngine engine;
+            if (!GraphAnalysis::Graph::parseDominatorEngine(argv[i+1], engine)) {
+                fprintf(stderr, "Unknown dominator engine %s, expect lt, snca or chk\n", argv[i+1]);
+                exit(1);
+            }
+            GraphAnalysis::Graph::setDominatorEngine(engine);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--parallel-block-threshold") == 0) {
+            analysisOptions.parallelBlocks = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--predict-overhead") == 0) {
+            predictOverhead = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--predict-overhead-json") == 0) {
+            predictOverhead = true;
+            predict_json_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--predict-only") == 0) {
+            predictOverhead = true;
+            predictOnly = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--shard") == 0) {
+            if (sscanf(argv[i+1], "%d/%d", &shard_index, &shard_count) != 2 ||
+                shard_count <= 0 || shard_index < 0 || shard_index >= shard_count) {
+                fprintf(stderr, "Invalid shard %s, expect k/N with 0 <= k < N\n", argv[i+1]);
+                exit(1);
+            }
+            i += 1;
+            continue;
+        }
+
         if (argv[i][0] == '-') {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             exit(1);
         }
         input_filename = std::string(argv[i]);
     }
+    // With relocated function pointers, vtables and function pointers hold
+    // the relocated address of the hot target, which the promotion guard,
+    // comparing with the original address, would never match
+    if (!indirectCallsites.empty() && enableFuncPointerReloc) {
+        fprintf(stderr, "--promote-indirect requires --disable-function-pointer-reloc\n");
+        exit(1);
+    }
+    // The padding of a loop header only aligns it if the fall-through
+    // source stays right before the header, which block layout does not keep
+    if (align_hot_code > 0 && (blockLayout || hotColdSplit)) {
+        fprintf(stderr, "--align-hot-code cannot be used with --block-layout or --hot-cold-split\n");
+        exit(1);
+    }
+    // Global memory slots are separate allocations with no slot map,
+    // so the dumps of the shards could not be merged
+    if (shard_count > 1 && !threadLocalMemory) {
+        fprintf(stderr, "--shard cannot be used with --use-global-memory\n");
+        exit(1);
+    }
+    // The slot map covers the blocks picked by the analysis. A time budget
+    // makes that choice depend on the machine load, so the shards could
+    // end up with different slot maps
+    if (shard_count > 1 && analysisOptions.maxSeconds > 0) {
+        fprintf(stderr, "--shard cannot be used with --analysis-time-budget, use --analysis-block-budget\n");
+        exit(1);
+    }
 }
 
 static bool skipFunction(BPatch_function * f) {
@@ -183,6 +482,34 @@ static bool skipFunction(BPatch_function * f) {
     return r->getRegionName() != ".text";
 }
 
+// The shard of a function only depends on its address,
+// so every shard built from the same binary agrees on the partition.
+static bool inShard(PatchFunction *f) {
+    uint64_t h = f->addr();
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (int)(h % shard_count) == shard_index;
+}
+
+void reserveSlots(std::map<PatchFunction*, std::set<PatchBlock*> > &instBlocksMap) {
+    // Assign coverage slots for every instrumented block in the binary,
+    // not just the ones in this shard, in block address order, so slot i
+    // belongs to the i-th address of the slot map --print-coverage writes.
+    // Each shard then shares the same slot map and the dumps can be merged.
+    std::set<Address> addrs;
+    for (auto &it : instBlocksMap) {
+        for (auto b : it.second) {
+            addrs.insert(b->start());
+        }
+    }
+    for (auto addr : addrs) {
+        ThreadLocalMemCoverageSnippet::reserveSlot(addr);
+    }
+}
+
 void InstrumentBlock(PatchFunction *f, PatchBlock* b) {
     Snippet::Ptr coverage = threadLocalMemory ?
         ThreadLocalMemCoverageSnippet::create(new ThreadLocalMemCoverageSnippet(b->start())) :
@@ -194,6 +521,39 @@ void InstrumentBlock(PatchFunction *f, PatchBlock* b) {
     p->pushBack(coverage);
 }
 
+// Write the CFG of every function as an edge list for GraphTest.
+// The entry is node 1 and the virtual exit of the SingleBlockGraph node n.
+void exportCFGs(std::vector<PatchFunction*> &funcs) {
+    FILE* f = fopen(export_cfg_filename.c_str(), "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", export_cfg_filename.c_str());
+        return;
+    }
+    for (auto pf : funcs) {
+        GraphAnalysis::SingleBlockGraph cfg(pf);
+        const GraphAnalysis::Graph::NodeList& nodes = cfg.getAllNodes();
+        GraphAnalysis::Node::Ptr entry = cfg.getEntries()[0];
+        GraphAnalysis::Node::Ptr exit = cfg.getExits()[0];
+        std::map<GraphAnalysis::Node*, int> id;
+        id[entry.get()] = 1;
+        id[exit.get()] = nodes.size();
+        int next = 2;
+        size_t edges = 0;
+        for (auto &n : nodes) {
+            if (n != entry && n != exit) id[n.get()] = next++;
+            edges += n->outEdgeList().size();
+        }
+        fprintf(f, "%lu %lu\n", nodes.size(), edges);
+        for (auto &n : nodes) {
+            for (auto &t : n->outEdgeList()) {
+                fprintf(f, "%d %d\n", id[n.get()], id[t.get()]);
+            }
+        }
+    }
+    fclose(f);
+    printf("Export %lu CFGs to %s\n", funcs.size(), export_cfg_filename.c_str());
+}
+
 void determineAnalysisOrder(std::vector<PatchFunction*> &funcs) {
     std::map<Address, int> funcsBlockCount;
     for (auto f: funcs) {
@@ -218,88 +578,176 @@ void determineAnalysisOrder(std::vector<PatchFunction*> &funcs) {
 
 }
 
-void determineInstrumentationOrder(std::vector<PatchFunction*> &funcs) {
-    std::map<Address, std::vector<Address>* > addr_maps;
-    for (auto& pair : callpairs) {
-        Address &from = pair.first;
-        Address &to = pair.second;
-        if (from == to) continue;
-        auto from_it = addr_maps.find(from);
-        if (from_it == addr_maps.end()) {
-            std::vector<Address>* from_vec = new std::vector<Address>;
-            from_vec->push_back(from);
-            from_it = addr_maps.insert(make_pair(from, from_vec)).first;
-        }
-        auto to_it = addr_maps.find(to);
-        if (to_it == addr_maps.end()) {
-            from_it->second->push_back(to);
-        } else if (to_it->second != from_it->second) {
-            std::vector<Address>* to_vec = to_it->second;
-            from_it->second->insert(from_it->second->end(), to_vec->begin(), to_vec->end());
-            for (auto addr: *to_vec) {
-                addr_maps[addr] = from_it->second;
-            }
-            delete to_vec;
-        }
-    }
-    std::vector<Address> order;
-    set< std::vector<Address>* > processed;
-    for (auto it : addr_maps) {
-        if (processed.find(it.second) != processed.end()) continue;
-        processed.insert(it.second);
-        order.insert(order.end(), it.second->begin(), it.second->end());
+struct FallbackRecord {
+    int blocks;
+    double seconds;
+    std::string reason;
+};
+
+void printBudgetReport(std::map<PatchFunction*, FallbackRecord> &fallbacks) {
+    if (fallbacks.empty()) return;
+    printf("%lu functions exceed the analysis budget and fall back to mode %s\n",
+        fallbacks.size(), analysisOptions.fallbackMode.c_str());
+    if (budget_report_filename == "") return;
+    FILE* f = fopen(budget_report_filename.c_str(), "w");
+    if (f == nullptr) return;
+    std::vector<PatchFunction*> sorted;
+    for (auto &it : fallbacks) {
+        sorted.emplace_back(it.first);
     }
-    std::map<Address, int> funcOrder;
-    int i = 0;
-    for (auto addr : order) {
-        funcOrder[addr] = i++;
+    sort(sorted.begin(), sorted.end(),
+        [] (PatchFunction* a, PatchFunction* b) { return a->addr() < b->addr(); }
+    );
+    fprintf(f, "%lu\n", sorted.size());
+    for (auto pf : sorted) {
+        FallbackRecord &r = fallbacks[pf];
+        fprintf(f, "%lx %s %d %.3lf %s\n", pf->addr(), pf->name().c_str(), r.blocks, r.seconds, r.reason.c_str());
     }
-    sort(funcs.begin(), funcs.end(),
-        [&funcOrder] (PatchFunction* a, PatchFunction *b) {
-            Address addra = a->addr();
-            auto ita = funcOrder.find(addra);
-            int orderA;
-            if (ita == funcOrder.end()) orderA = 100000000; else orderA = ita->second;
+    fclose(f);
+}
 
-            Address addrb = b->addr();
-            auto itb = funcOrder.find(addrb);
-            int orderB;
-            if (itb == funcOrder.end()) orderB = 100000000; else orderB = itb->second;
+void determineInstrumentationOrder(std::vector<PatchFunction*> &funcs, std::map<PatchFunction*, BPatch_function*> &bpatchFuncs) {
+    // Without a call profile, this keeps functions in address order
+    sort(funcs.begin(), funcs.end(),
+        [] (PatchFunction* a, PatchFunction* b) { return a->addr() < b->addr(); }
+    );
+    std::vector<uint64_t> addrs, sizes;
+    for (auto f : funcs) {
+        uint64_t size = 0;
+        for (auto b : f->blocks()) {
+            size += b->end() - b->start();
+        }
+        addrs.emplace_back(f->addr());
+        sizes.emplace_back(size);
+    }
+    CallChainClustering c3(addrs, sizes);
+    for (auto &e : callpairs) {
+        c3.addCalls(e.caller, e.callee, e.metric);
+    }
+    c3.cluster(cluster_page_size);
 
-            if (orderA != orderB) return orderA < orderB;
-            return addra < addrb;
+    std::vector<PatchFunction*> ordered;
+    std::vector<bool> placed(funcs.size(), false);
+    for (auto i : c3.getOrder()) {
+        ordered.emplace_back(funcs[i]);
+        placed[i] = true;
+    }
+    for (size_t i = 0; i < funcs.size(); ++i) {
+        if (!placed[i]) ordered.emplace_back(funcs[i]);
+    }
+    funcs.swap(ordered);
+    if (!c3.getOrder().empty()) {
+        printf("Cluster %lu hot functions into %lu clusters\n", c3.getOrder().size(), c3.getClusterCount());
+        // Sizes without the instrumentation
+        if (cluster_page_size > 0) {
+            printf("Hot text: %lu bytes, %lu pages of %lu bytes before, %lu pages after\n", c3.hotBytes(),
+                c3.hotPages(cluster_page_size, false), cluster_page_size, c3.hotPages(cluster_page_size, true));
         }
-    );
+    }
+
+    // Dyninst emits the relocated functions by increasing layout order,
+    // so the clusters are packed at the start of .dyninstInst
+    for (size_t i = 0; i < funcs.size(); ++i) {
+        bpatchFuncs[funcs[i]]->setLayoutOrder(i);
+    }
 }
 
 void performInlining(std::vector<PatchFunction*>& funcs) {
-    std::map<Address, std::pair<PatchFunction*, PatchBlock*> > callSiteMap;
-    PatchObject* obj = nullptr;
-    for (auto f: funcs) {
-        obj = f->obj();
-        for (auto b : f->callBlocks()) {
-            callSiteMap[b->end()] = std::make_pair(f, b);
-        }
-    }
-    PatchModifier::beginInlineSet(obj);
-    for (auto & callsite : callsites) {
-        auto cit = callSiteMap.find(callsite.first);
-        if (cit == callSiteMap.end()) continue;
-        PatchFunction* caller = cit->second.first;
-        PatchBlock* callBlock = cit->second.second;
-        bool indirect = false;
-        for (auto e : callBlock->targets()) {
-            if (e->sinkEdge()) {
-                indirect = true;
+    if (callsites.empty()) return;
+    InlinePlanner planner(funcs, callsites);
+    planner.plan(inline_budget, inline_caller_cap);
+    planner.perform();
+}
+
+void promoteIndirectCalls(std::vector<PatchFunction*>& funcs) {
+    if (indirectCallsites.empty()) return;
+    IndirectCallPromotion promotion(funcs, indirectCallsites, promote_min_ratio, promote_min_count);
+    promotion.perform();
+}
+
+void layoutBlocks(std::vector<PatchFunction*>& funcs, std::map<PatchFunction*, std::set<PatchBlock*> > &instBlocksMap) {
+    bool reorder = blockLayout;
+    bool split = hotColdSplit;
+    if (reorder && !LoopCloneOptimizer::hasPGOData()) {
+        fprintf(stderr, "Block layout requires a profile\n");
+        reorder = false;
+    }
+    if (split && !HotColdSplit::canSplit()) {
+        fprintf(stderr, "Hot/cold splitting requires a profile or coverage dumps\n");
+        split = false;
+    }
+    if (!reorder && !split) return;
+
+    int probeSize = threadLocalMemory ?
+        ThreadLocalMemCoverageSnippet::codeSize() :
+        GlobalMemCoverageSnippet::codeSize();
+    std::vector<BlockLayout*> layouts(funcs.size(), nullptr);
+    std::vector<HotColdSplit*> splits(funcs.size(), nullptr);
+    size_t totalFunc = funcs.size();
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < totalFunc; ++i) {
+        std::set<uint64_t> instAddrs;
+        auto it = instBlocksMap.find(funcs[i]);
+        if (it != instBlocksMap.end()) {
+            for (auto b : it->second) {
+                instAddrs.insert(b->start());
+            }
+        }
+        BlockLayout* layout = new BlockLayout(funcs[i], instAddrs, probeSize);
+        if (reorder && layout->hasProfile()) {
+            layout->computeOrder();
+        } else {
+            layout->originalOrder();
+        }
+        layouts[i] = layout;
+        if (split) {
+            splits[i] = new HotColdSplit(funcs[i]);
+        }
+    }
+
+    double origScore = 0, newScore = 0;
+    int reordered = 0, splitted = 0;
+    uint64_t hotBytes = 0, coldBytes = 0, nextColdOrder = 0;
+    // Cold parts are emitted in the order of the functions
+    for (size_t i = 0; i < totalFunc; ++i) {
+        BlockLayout* layout = layouts[i];
+        HotColdSplit* hcs = splits[i];
+        bool changed = false;
+        if (reorder && layout->hasProfile()) {
+            double o = layout->originalScore();
+            double n = layout->newScore();
+            if (verbose) {
+                printf("Layout %s at %lx: ext-TSP score %.2lf -> %.2lf\n", funcs[i]->name().c_str(), funcs[i]->addr(), o, n);
             }
+            origScore += o;
+            newScore += n;
+            ++reordered;
+            changed = true;
         }
-        if (indirect) continue;
-        Address calleeAddress = callsite.second;
-        if (PatchModifier::inlineCall(caller, callBlock, calleeAddress)) {
-            printf("Inline callsite %lx, callee %lx\n", callsite.first, calleeAddress);
+        if (hcs != nullptr) {
+            hotBytes += hcs->getHotBytes();
+            coldBytes += hcs->getColdBytes();
+            if (hcs->hasColdBlocks()) {
+                if (verbose) {
+                    printf("Split %s at %lx: %lu hot bytes, %lu cold bytes\n", funcs[i]->name().c_str(), funcs[i]->addr(),
+                        hcs->getHotBytes(), hcs->getColdBytes());
+                }
+                ++splitted;
+                changed = true;
+            }
         }
+        if (changed) {
+            layout->apply(hcs, nextColdOrder);
+        }
+        delete layout;
+        delete hcs;
+    }
+    if (reorder) {
+        printf("Reorder blocks of %d functions, ext-TSP score %.2lf -> %.2lf\n", reordered, origScore, newScore);
+    }
+    if (split) {
+        printf("Split %d functions, %lu hot bytes, %lu bytes moved to the cold area\n", splitted, hotBytes, coldBytes);
     }
-    PatchModifier::endInlineSet();
 }
 
 int main(int argc, char** argv) {
@@ -311,22 +759,47 @@ int main(int argc, char** argv) {
     image = binEdit->getImage();
     std::vector<BPatch_function*>* origFuncs = image->getProcedures();
     std::vector<PatchFunction*> funcs;
+    std::map<PatchFunction*, BPatch_function*> bpatchFuncs;
 
     for (auto f : *origFuncs) {
         if (skipFunction(f)) {
             continue;
         }
-        f->setLayoutOrder((uint64_t)(f->getBaseAddr()));
         // BPatch_flowGraph cannot be constructed in parallel;
         f->getCFG();
         PatchFunction *pf = Dyninst::PatchAPI::convert(f);
         funcs.emplace_back(pf);
+        bpatchFuncs[pf] = f;
+    }
+
+    if (export_cfg_filename != "") {
+        exportCFGs(funcs);
+    }
+
+    if (infer_profile_filename != "") {
+        if (!LoopCloneOptimizer::hasPGOData()) {
+            fprintf(stderr, "Profile inference requires --pgo-address-file\n");
+        } else {
+            ProfileInference::run(funcs);
+            if (!ProfileInference::writeProfile(infer_profile_filename)) {
+                fprintf(stderr, "Cannot write %s\n", infer_profile_filename.c_str());
+            }
+        }
     }
 
     performInlining(funcs);
+    promoteIndirectCalls(funcs);
     determineAnalysisOrder(funcs);
 
     tbb::concurrent_hash_map<PatchFunction*, std::set<PatchBlock*> > concurInstBlocksMap;
+    tbb::concurrent_hash_map<PatchFunction*, FallbackRecord> concurFallbackMap;
+    // Without a profile, rank the instrumented blocks of innermost loops
+    // by their estimated frequency, which is how often their probes run.
+    // Estimates are only relative to one entry of each function, so
+    // LoopCloneOptimizer applies the tighter --static-clone-ratio and
+    // --static-clone-limit to them
+    bool staticProfile = staticLoopClone && pgo_address_filename == "";
+    tbb::concurrent_hash_map<Address, double> concurStaticProfile;
     size_t totalFunc = funcs.size();
     #pragma omp parallel for schedule(dynamic)
     for (size_t i = 0; i < totalFunc; ++i) {
@@ -334,7 +807,14 @@ int main(int argc, char** argv) {
         if (verbose) {
             printf("Function %s at %lx\n", pf->name().c_str(), pf->addr());
         }
-        CoverageLocationOpt clo(pf, mode, verbose);
+        CoverageLocationOpt clo(pf, mode, verbose, analysisOptions);
+        if (clo.fellBack()) {
+            tbb::concurrent_hash_map<PatchFunction*, FallbackRecord>::accessor fa;
+            concurFallbackMap.insert(fa, pf);
+            fa->second.blocks = pf->blocks().size();
+            fa->second.seconds = clo.getAnalysisTime();
+            fa->second.reason = clo.getFallbackReason();
+        }
 
         tbb::concurrent_hash_map<PatchFunction*, std::set<PatchBlock*> >::accessor a;
         assert(concurInstBlocksMap.insert(a, std::make_pair(pf, std::set<PatchBlock*>())));
@@ -351,9 +831,35 @@ int main(int argc, char** argv) {
             }
             instBlocks.insert(b);
         }
+
+        if (staticProfile && !instBlocks.empty()) {
+            std::set<PatchBlock*> innermost;
+            std::vector<PatchLoop*> loops;
+            pf->getLoops(loops);
+            for (auto l : loops) {
+                std::vector<PatchLoop*> inner;
+                l->getContainedLoops(inner);
+                if (!inner.empty()) continue;
+                std::vector<PatchBlock*> blocks;
+                l->getLoopBasicBlocks(blocks);
+                innermost.insert(blocks.begin(), blocks.end());
+            }
+            StaticFrequencyEstimator sfe(pf);
+            for (auto b : instBlocks) {
+                if (innermost.find(b) == innermost.end()) continue;
+                double metric = sfe.getFrequency(b);
+                if (metric <= 0) continue;
+                tbb::concurrent_hash_map<Address, double>::accessor sa;
+                concurStaticProfile.insert(sa, b->start());
+                sa->second += metric;
+            }
+        }
     }
 
-    determineInstrumentationOrder(funcs);
+    std::map<PatchFunction*, FallbackRecord> fallbacks(concurFallbackMap.begin(), concurFallbackMap.end());
+    printBudgetReport(fallbacks);
+
+    determineInstrumentationOrder(funcs, bpatchFuncs);
     std::map<PatchFunction*, std::set<PatchBlock*> > instBlocksMap;
     for (auto pf : funcs) {
         tbb::concurrent_hash_map<PatchFunction*, std::set<PatchBlock*> >::accessor a;
@@ -361,9 +867,59 @@ int main(int argc, char** argv) {
         instBlocksMap[pf] = a->second;
     }
 
-    if (pgo_address_filename != "") {
-        LoopCloneOptimizer lco(instBlocksMap, funcs);
-        lco.instrument();
+    if (threadLocalMemory) {
+        reserveSlots(instBlocksMap);
+    }
+    if (shard_count > 1) {
+        // Functions outside of this shard are left unmodified
+        std::vector<PatchFunction*> shardFuncs;
+        for (auto pf : funcs) {
+            if (inShard(pf)) {
+                shardFuncs.emplace_back(pf);
+            } else {
+                instBlocksMap.erase(pf);
+            }
+        }
+        printf("Shard %d/%d: instrument %lu of %lu functions\n",
+            shard_index, shard_count, shardFuncs.size(), funcs.size());
+        funcs.swap(shardFuncs);
+    }
+
+    if (staticProfile) {
+        for (auto &it : concurStaticProfile) {
+            LoopCloneOptimizer::addPGOBlock(it.first, it.second);
+        }
+    }
+
+    std::unique_ptr<LoopCloneOptimizer> lco;
+    if (pgo_address_filename != "" || staticProfile) {
+        lco.reset(new LoopCloneOptimizer(instBlocksMap, funcs, staticProfile));
+    }
+
+    if (predictOverhead) {
+        OverheadPredictor predictor(instBlocksMap, funcs, lco.get());
+        predictor.print(verbose);
+        if (predict_json_filename != "" && !predictor.writeJSON(predict_json_filename)) {
+            fprintf(stderr, "Cannot write %s\n", predict_json_filename.c_str());
+        }
+        if (predictOnly) return 0;
+    }
+
+    // Hot blocks are picked on the original CFG and
+    // padded in their loop clones after instrumentation
+    std::unique_ptr<HotAlignment> alignment;
+    if (align_hot_code > 0) {
+        if (!LoopCloneOptimizer::hasPGOData()) {
+            fprintf(stderr, "Hot code alignment requires a profile\n");
+        } else {
+            if (align_max_skip < 0) align_max_skip = align_hot_code - 1;
+            alignment.reset(new HotAlignment(align_hot_code, align_max_skip));
+            alignment->plan(funcs, align_budget);
+        }
+    }
+
+    if (lco != nullptr) {
+        lco->instrument();
     } else {
         for (auto pf : funcs) {
             pf->markModified();
@@ -373,6 +929,14 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (alignment != nullptr) {
+        alignment->apply();
+    }
+
+    if (blockLayout || hotColdSplit) {
+        layoutBlocks(funcs, instBlocksMap);
+    }
+
     binEdit->writeFile(output_filename.c_str());
     printf("Require %d bytes memory in instrumentation region\n", ThreadLocalMemCoverageSnippet::gsOffset);
     ThreadLocalMemCoverageSnippet::printCoverage(coverage_file);
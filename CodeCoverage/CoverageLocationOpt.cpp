@@ -3,44 +3,66 @@
 #include "SingleBlockGraph.hpp"
 #include "MultiBlockGraph.hpp"
 
+#include <atomic>
+
 using Dyninst::PatchAPI::PatchFunction;
 using Dyninst::PatchAPI::PatchBlock;
 using Dyninst::PatchAPI::PatchLoop;
+using GraphAnalysis::Graph;
 using GraphAnalysis::SingleBlockGraph;
 using GraphAnalysis::SBGNode;
 using GraphAnalysis::MultiBlockGraph;
 using GraphAnalysis::MBGNode;
 
-CoverageLocationOpt::CoverageLocationOpt(PatchFunction* f, std::string mode, bool v) {
+CoverageLocationOpt::CoverageLocationOpt(PatchFunction* f, std::string mode, bool v,
+        const CoverageAnalysisOptions& opts): options(opts) {
     verbose = v;
     realCode = true;
+    analysisTime = 0;
+    startTime = std::chrono::steady_clock::now();
     if (mode == "none" || f->exitBlocks().empty()) {
         for (auto b : f->blocks()) {
             instMap[b->start()] = true;
         }
         return;
     }
+    if (options.maxBlocks > 0 && (int)f->blocks().size() > options.maxBlocks) {
+        fallback(f, nullptr, nullptr,
+            std::to_string(f->blocks().size()) + " blocks exceed block budget " + std::to_string(options.maxBlocks));
+        return;
+    }
     // convert function to the graph analysis graph
     SingleBlockGraph::Ptr cfg = std::make_shared<SingleBlockGraph>(f);
     if (verbose) {
         fprintf(stderr, "CFG\n");
         cfg->Print(true);
     }
-    // get the super block dominator graph
-    MultiBlockGraph::Ptr sbdg = std::make_shared<MultiBlockGraph>(cfg);
+    // get the super block dominator graph, giving up as soon
+    // as the time budget runs out
+    MultiBlockGraph::Ptr sbdg = std::make_shared<MultiBlockGraph>(cfg, [this] () { return overTimeBudget(); });
+    if (!sbdg->isComplete()) {
+        fallback(f, cfg, nullptr, "time budget exceeded while building super block dominator graph");
+        return;
+    }
     if (verbose) {
         fprintf(stderr, "SBDG\n");
         sbdg->Print(true);
     }
 
-    computeLoopNestLevels(f);
+    computeLoopNestLevels(f, loopNestLevel);
 
-    determineBlocks(cfg, sbdg, mode);    
+    if (!determineBlocks(cfg, sbdg, mode)) {
+        fallback(f, cfg, sbdg, "time budget exceeded while choosing blocks");
+        return;
+    }
+    analysisTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
 }
 
 CoverageLocationOpt::CoverageLocationOpt(SingleBlockGraph::Ptr cfg, MultiBlockGraph::Ptr sbdg, std::string mode) {
     verbose = false;
     realCode = false;
+    analysisTime = 0;
+    startTime = std::chrono::steady_clock::now();
     if (mode == "none") {
         for (auto& n : sbdg->getAllNodes()) {
             MBGNode::Ptr mbgn = std::static_pointer_cast<MBGNode>(n);
@@ -57,7 +79,32 @@ bool CoverageLocationOpt::needInstrumentation(uint64_t addr) {
     return instMap.find(addr) != instMap.end();
 }
 
-void CoverageLocationOpt::determineBlocks(SingleBlockGraph::Ptr cfg, MultiBlockGraph::Ptr sbdg, std::string& mode) {
+bool CoverageLocationOpt::overTimeBudget() {
+    if (options.maxSeconds <= 0) return false;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    return elapsed.count() > options.maxSeconds;
+}
+
+void CoverageLocationOpt::fallback(PatchFunction* f, SingleBlockGraph::Ptr cfg, MultiBlockGraph::Ptr sbdg, const std::string& reason) {
+    fallbackReason = reason;
+    instMap.clear();
+    // Leaf mode only instruments the exits of the super block dominator graph,
+    // which is cheap once the graph is built.
+    std::string leaf("leaf");
+    if (options.fallbackMode == "leaf" && sbdg != nullptr) {
+        determineBlocks(cfg, sbdg, leaf);
+    } else {
+        for (auto b : f->blocks()) {
+            instMap[b->start()] = true;
+        }
+    }
+    analysisTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (verbose) {
+        printf("Function %s at %lx falls back: %s\n", f->name().c_str(), f->addr(), reason.c_str());
+    }
+}
+
+bool CoverageLocationOpt::determineBlocks(SingleBlockGraph::Ptr cfg, MultiBlockGraph::Ptr sbdg, std::string& mode) {
     std::set<MBGNode::Ptr> exitNodes;
     for (auto& n : sbdg->getExits()) {
         MBGNode::Ptr mbgn = std::static_pointer_cast<MBGNode>(n);
@@ -66,16 +113,49 @@ void CoverageLocationOpt::determineBlocks(SingleBlockGraph::Ptr cfg, MultiBlockG
         uint64_t addr = realCode ? instB->start() : ((uint64_t)instB);
         instMap[addr] = true;
     }
-    if (mode == "leaf") return;
-    for (auto & n : sbdg->getAllNodes()) {
-        MBGNode::Ptr mbgn = std::static_pointer_cast<MBGNode>(n);
-        if (exitNodes.find(mbgn) != exitNodes.end()) continue;
-        if (hasPathWithoutChild(cfg, mbgn)) {
-            PatchBlock* instB = chooseSBRep(mbgn);
-            uint64_t addr = realCode ? instB->start() : ((uint64_t)instB);
-            instMap[addr] = true;
+    if (mode == "leaf") return true;
+
+    // Each super block is checked independently. For large functions,
+    // split the checks into tasks so that threads idling at the end of the
+    // parallel loop over functions can steal them instead of leaving
+    // the largest function to run alone on one thread.
+    const Graph::NodeList& nodes = sbdg->getAllNodes();
+    std::vector<PatchBlock*> chosen(nodes.size(), nullptr);
+    std::atomic<bool> outOfTime(false);
+    size_t total = nodes.size();
+    if (options.parallelBlocks > 0 && (int)cfg->getAllNodes().size() > options.parallelBlocks) {
+        #pragma omp taskloop grainsize(8) shared(nodes, chosen, outOfTime, exitNodes, cfg)
+        for (size_t i = 0; i < total; ++i) {
+            if (outOfTime.load(std::memory_order_relaxed)) continue;
+            if (overTimeBudget()) {
+                outOfTime = true;
+                continue;
+            }
+            chosen[i] = checkSuperBlock(cfg, std::static_pointer_cast<MBGNode>(nodes[i]), exitNodes);
+        }
+    } else {
+        for (size_t i = 0; i < total; ++i) {
+            if (overTimeBudget()) {
+                outOfTime = true;
+                break;
+            }
+            chosen[i] = checkSuperBlock(cfg, std::static_pointer_cast<MBGNode>(nodes[i]), exitNodes);
         }
     }
+    if (outOfTime) return false;
+
+    for (auto instB : chosen) {
+        if (instB == nullptr) continue;
+        uint64_t addr = realCode ? instB->start() : ((uint64_t)instB);
+        instMap[addr] = true;
+    }
+    return true;
+}
+
+PatchBlock* CoverageLocationOpt::checkSuperBlock(SingleBlockGraph::Ptr cfg, MBGNode::Ptr mbgn, const std::set<MBGNode::Ptr>& exitNodes) {
+    if (exitNodes.find(mbgn) != exitNodes.end()) return nullptr;
+    if (!hasPathWithoutChild(cfg, mbgn)) return nullptr;
+    return chooseSBRep(mbgn);
 }
 
 PatchBlock* CoverageLocationOpt::chooseSBRep(MBGNode::Ptr mbgn) {
@@ -145,17 +225,17 @@ bool CoverageLocationOpt::hasPathWithoutChild(SingleBlockGraph::Ptr cfg, MBGNode
     return true;
 }
 
-void CoverageLocationOpt::computeLoopNestLevels(PatchFunction* f) {
+void CoverageLocationOpt::computeLoopNestLevels(PatchFunction* f, std::unordered_map<PatchBlock*, int>& loopNestLevel) {
     loopNestLevel.clear();
 
     vector<PatchLoop*> loops;
     f->getOuterLoops(loops);
     for (auto l : loops) {
-        computeLoopNestLevelsImpl(l, 1);
+        computeLoopNestLevelsImpl(l, 1, loopNestLevel);
     }
 }
 
-void CoverageLocationOpt::computeLoopNestLevelsImpl(PatchLoop *l , int level) {
+void CoverageLocationOpt::computeLoopNestLevelsImpl(PatchLoop *l , int level, std::unordered_map<PatchBlock*, int>& loopNestLevel) {
     vector<PatchBlock*> blocks;
     l->getLoopBasicBlocksExclusive(blocks);
     for (auto b : blocks) {
@@ -165,6 +245,6 @@ void CoverageLocationOpt::computeLoopNestLevelsImpl(PatchLoop *l , int level) {
     vector<PatchLoop*> loops;
     l->getOuterLoops(loops);
     for (auto nl : loops) {
-        computeLoopNestLevelsImpl(nl, level + 1);
+        computeLoopNestLevelsImpl(nl, level + 1, loopNestLevel);
     }
 }
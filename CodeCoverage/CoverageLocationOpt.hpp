@@ -4,6 +4,8 @@
 #include <string>
 #include <unordered_map>
 #include <memory>
+#include <set>
+#include <chrono>
 
 namespace Dyninst {
     namespace PatchAPI {
@@ -19,30 +21,65 @@ namespace GraphAnalysis {
     class MBGNode;
 }
 
+struct CoverageAnalysisOptions {
+    // Functions with more blocks than this are not analyzed, 0 means no limit
+    int maxBlocks;
+    // Analysis time allowed for one function in seconds, 0 means no limit
+    double maxSeconds;
+    // Mode used for functions exceeding the budget, either "leaf" or "none"
+    std::string fallbackMode;
+    // Functions with more blocks than this analyze their super blocks
+    // as parallel tasks, 0 disables it
+    int parallelBlocks;
+
+    CoverageAnalysisOptions(): maxBlocks(0), maxSeconds(0), fallbackMode("none"), parallelBlocks(1000) {}
+};
+
 class CoverageLocationOpt {
     bool realCode;
     bool verbose;
     std::unordered_map<uint64_t, bool> instMap;
     std::unordered_map<Dyninst::PatchAPI::PatchBlock*, int> loopNestLevel;
 
-    void determineBlocks(
+    CoverageAnalysisOptions options;
+    std::chrono::steady_clock::time_point startTime;
+    double analysisTime;
+    std::string fallbackReason;
+
+    bool determineBlocks(
         std::shared_ptr<GraphAnalysis::SingleBlockGraph>,
         std::shared_ptr<GraphAnalysis::MultiBlockGraph>,
         std::string&);
+    bool overTimeBudget();
+    void fallback(Dyninst::PatchAPI::PatchFunction*,
+        std::shared_ptr<GraphAnalysis::SingleBlockGraph>,
+        std::shared_ptr<GraphAnalysis::MultiBlockGraph>,
+        const std::string&);
 
-    void computeLoopNestLevels(Dyninst::PatchAPI::PatchFunction*);
-    void computeLoopNestLevelsImpl(Dyninst::PatchAPI::PatchLoop* , int);    
+    static void computeLoopNestLevelsImpl(Dyninst::PatchAPI::PatchLoop*, int,
+        std::unordered_map<Dyninst::PatchAPI::PatchBlock*, int>&);
 
     Dyninst::PatchAPI::PatchBlock* chooseSBRep(std::shared_ptr<GraphAnalysis::MBGNode> mbgn);
+    Dyninst::PatchAPI::PatchBlock* checkSuperBlock(
+        std::shared_ptr<GraphAnalysis::SingleBlockGraph>,
+        std::shared_ptr<GraphAnalysis::MBGNode>,
+        const std::set<std::shared_ptr<GraphAnalysis::MBGNode> >&);
     bool hasPathWithoutChild(std::shared_ptr<GraphAnalysis::SingleBlockGraph>, std::shared_ptr<GraphAnalysis::MBGNode>);
 public:
-    CoverageLocationOpt(Dyninst::PatchAPI::PatchFunction*, std::string, bool);
+    CoverageLocationOpt(Dyninst::PatchAPI::PatchFunction*, std::string, bool,
+        const CoverageAnalysisOptions& = CoverageAnalysisOptions());
     CoverageLocationOpt(
         std::shared_ptr<GraphAnalysis::SingleBlockGraph>,
         std::shared_ptr<GraphAnalysis::MultiBlockGraph>,
         std::string);
 
+    static void computeLoopNestLevels(Dyninst::PatchAPI::PatchFunction*,
+        std::unordered_map<Dyninst::PatchAPI::PatchBlock*, int>&);
+
     bool needInstrumentation(uint64_t);
+    bool fellBack() { return !fallbackReason.empty(); }
+    const std::string& getFallbackReason() { return fallbackReason; }
+    double getAnalysisTime() { return analysisTime; }
 };
 
 #endif
\ No newline at end of file
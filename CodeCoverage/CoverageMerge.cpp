@@ -0,0 +1,108 @@
+// Merge coverage dumps collected from binaries rewritten with
+// CodeCoverage --shard k/N into one coverage view. Sharding requires the
+// default thread local coverage slots and no analysis time budget.
+//
+// All shards of a binary share the slot map written by --print-coverage,
+// where the i-th block address owns slot i, as CodeCoverage reserves
+// the slots in block address order. A dump is the raw image of the
+// coverage slots, one byte per slot, non-zero meaning the block was covered.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+std::vector<uint64_t> slotAddrs;
+std::vector<unsigned char> covered;
+std::string output_filename;
+
+static bool readSlotMap(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return false;
+    int slots;
+    if (fscanf(f, "%d", &slots) != 1) {
+        fclose(f);
+        return false;
+    }
+    uint64_t addr;
+    while ((int)slotAddrs.size() < slots && fscanf(f, "%lx", &addr) == 1) {
+        slotAddrs.push_back(addr);
+    }
+    fclose(f);
+    if ((int)slotAddrs.size() != slots) {
+        fprintf(stderr, "Slot map %s has %lu entries, expect %d\n", filename, slotAddrs.size(), slots);
+        return false;
+    }
+    covered.assign(slots, 0);
+    return true;
+}
+
+static bool mergeDump(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) return false;
+    std::vector<unsigned char> buf(covered.size() + 1);
+    size_t n = fread(buf.data(), 1, buf.size(), f);
+    fclose(f);
+    if (n != covered.size()) {
+        fprintf(stderr, "Dump %s has %lu slots, expect %lu. Was it produced from the same binary?\n",
+            filename, n, covered.size());
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        covered[i] |= buf[i];
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::vector<const char*> inputs;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--output") == 0) {
+            i += 1;
+            output_filename = std::string(argv[i]);
+            continue;
+        }
+        if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+        inputs.push_back(argv[i]);
+    }
+    if (inputs.size() < 2) {
+        fprintf(stderr, "Usage: %s [--output file] <slot map> <dump> [<dump> ...]\n", argv[0]);
+        exit(1);
+    }
+
+    if (!readSlotMap(inputs[0])) {
+        fprintf(stderr, "Cannot read slot map %s\n", inputs[0]);
+        exit(1);
+    }
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        if (!mergeDump(inputs[i])) {
+            fprintf(stderr, "Cannot merge dump %s\n", inputs[i]);
+            exit(1);
+        }
+    }
+
+    FILE* out = stdout;
+    if (output_filename != "") {
+        out = fopen(output_filename.c_str(), "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s\n", output_filename.c_str());
+            exit(1);
+        }
+    }
+    int total = 0;
+    for (size_t i = 0; i < covered.size(); ++i) {
+        if (covered[i]) total += 1;
+    }
+    fprintf(out, "%d\n", total);
+    for (size_t i = 0; i < covered.size(); ++i) {
+        if (covered[i]) fprintf(out, "%lx\n", slotAddrs[i]);
+    }
+    if (out != stdout) fclose(out);
+    fprintf(stderr, "Covered %d of %lu blocks from %lu dumps\n", total, covered.size(), inputs.size() - 1);
+    return 0;
+}
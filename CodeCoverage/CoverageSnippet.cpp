@@ -23,14 +23,22 @@ bool CoverageSnippet::generateNOPs(Dyninst::Buffer& buf) {
 
 std::map<Address, Address> GlobalMemCoverageSnippet::locMap;
 
+Address GlobalMemCoverageSnippet::reserveSlot(Address blockAddr) {
+    auto it = locMap.find(blockAddr);
+    if (it != locMap.end()) return it->second;
+    Address loc = binEdit->allocateStaticMemoryRegion(1, "");
+    locMap.emplace(blockAddr, loc);
+    return loc;
+}
+
 GlobalMemCoverageSnippet::GlobalMemCoverageSnippet(Address blockAddr) {
-    auto it = locMap.find(blockAddr);    
-    if (it == locMap.end()) {
-        memLoc = binEdit->allocateStaticMemoryRegion(1, "");
-        locMap.emplace(blockAddr, memLoc);
-    } else {
-        memLoc = it->second;
-    }
+    memLoc = reserveSlot(blockAddr);
+}
+
+int GlobalMemCoverageSnippet::codeSize() {
+    // Keep in sync with generate
+    if (emptyInst) return 0;
+    return 7 + nops;
 }
 
 bool GlobalMemCoverageSnippet::generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) {
@@ -56,14 +64,22 @@ void GlobalMemCoverageSnippet::print() {
 int ThreadLocalMemCoverageSnippet::gsOffset = 0;
 std::map<Address, int> ThreadLocalMemCoverageSnippet::locMap;
 
-ThreadLocalMemCoverageSnippet::ThreadLocalMemCoverageSnippet(Address blockAddr) {
+int ThreadLocalMemCoverageSnippet::reserveSlot(Address blockAddr) {
     auto it = locMap.find(blockAddr);
-    if (it == locMap.end()) {
-        offset = gsOffset++;
-        locMap.emplace(blockAddr, offset);        
-    } else {
-        offset = it->second;
-    }
+    if (it != locMap.end()) return it->second;
+    int slot = gsOffset++;
+    locMap.emplace(blockAddr, slot);
+    return slot;
+}
+
+ThreadLocalMemCoverageSnippet::ThreadLocalMemCoverageSnippet(Address blockAddr) {
+    offset = reserveSlot(blockAddr);
+}
+
+int ThreadLocalMemCoverageSnippet::codeSize() {
+    // Keep in sync with generate
+    if (emptyInst) return 9;
+    return 9 + nops;
 }
 
 bool ThreadLocalMemCoverageSnippet::generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) {
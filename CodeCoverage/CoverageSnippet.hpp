@@ -15,6 +15,8 @@ class GlobalMemCoverageSnippet : public CoverageSnippet {
     Dyninst::Address memLoc;
     static std::map<Dyninst::Address, Dyninst::Address> locMap;
 public:
+    static Dyninst::Address reserveSlot(Dyninst::Address);
+    static int codeSize();
     GlobalMemCoverageSnippet(Dyninst::Address);
     bool generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) override;
     const char* snippetName() const override { return "coverage"; }
@@ -26,6 +28,8 @@ class ThreadLocalMemCoverageSnippet : public CoverageSnippet {
     static std::map<Dyninst::Address, int> locMap;    
 public:
     static int gsOffset;
+    static int reserveSlot(Dyninst::Address);
+    static int codeSize();
     static void printCoverage(std::string&);
     ThreadLocalMemCoverageSnippet(Dyninst::Address);
     bool generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) override;
@@ -1,5 +1,7 @@
 #include "Graph.hpp"
 #include <assert.h>
+#include <cstdio>
+#include <cstring>
 
 namespace GraphAnalysis {
 
@@ -110,7 +112,36 @@ void Graph::postDominatorTree(EdgeList& elist) {
     dominatorComputation(elist, TraversalDirection::Natural);
 }
 
+DominatorEngine Graph::dominatorEngine = DominatorEngine::SemiNCA;
+
+bool Graph::parseDominatorEngine(const char* name, DominatorEngine& e) {
+    if (strcmp(name, "lt") == 0) {
+        e = DominatorEngine::LengauerTarjan;
+    } else if (strcmp(name, "snca") == 0) {
+        e = DominatorEngine::SemiNCA;
+    } else if (strcmp(name, "chk") == 0) {
+        e = DominatorEngine::CooperHarveyKennedy;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void Graph::dominatorComputation(EdgeList& output, Graph::TraversalDirection dir) {
+    switch (dominatorEngine) {
+        case DominatorEngine::LengauerTarjan:
+            lengauerTarjan(output, dir);
+            break;
+        case DominatorEngine::SemiNCA:
+            semiNCA(output, dir);
+            break;
+        case DominatorEngine::CooperHarveyKennedy:
+            cooperHarveyKennedy(output, dir);
+            break;
+    }
+}
+
+void Graph::lengauerTarjan(EdgeList& output, Graph::TraversalDirection dir) {
     for (size_t i = naturalOrder.size()-1; i > 0; i--) {
         Node::Ptr block = naturalOrder[i];
         Node::Ptr parent = block->parent;
@@ -122,6 +153,8 @@ void Graph::dominatorComputation(EdgeList& output, Graph::TraversalDirection dir
             block->outEdgeList() : block->inEdgeList();
 
         for (auto &s : edgelist) {
+            // Unreachable predecessors would become semidominators
+            if (s->dfs_no == -1) continue;
             Node::Ptr pred = s->eval();
             if (pred->sdno() < block->sdno()) {
                 block->semiDom = pred->semiDom;
@@ -155,6 +188,116 @@ void Graph::dominatorComputation(EdgeList& output, Graph::TraversalDirection dir
     }
 }
 
+// The Semi-NCA and CHK engines work on DFS numbers shifted by one.
+// Number 0 is a virtual root above all DFS roots, so that a graph with
+// several entries (or exits) still has a single dominator tree, and
+// nodes dominated only by the virtual root get no immediate dominator.
+
+void Graph::semiNCA(EdgeList& output, Graph::TraversalDirection dir) {
+    int n = naturalOrder.size();
+    std::vector<int> parent(n + 1, 0), semi(n + 1), idom(n + 1, 0), label(n + 1), ancestor(n + 1, -1);
+    std::vector<int> stack;
+    for (int i = 0; i <= n; ++i) {
+        semi[i] = label[i] = i;
+    }
+    for (int i = 1; i <= n; ++i) {
+        Node::Ptr& p = naturalOrder[i-1]->parent;
+        parent[i] = (p == nullptr) ? 0 : p->dfs_no + 1;
+    }
+
+    for (int w = n; w >= 1; --w) {
+        Node::Ptr& block = naturalOrder[w-1];
+        const Node::EdgeList& edgelist = (dir == TraversalDirection::Natural) ?
+            block->outEdgeList() : block->inEdgeList();
+        semi[w] = parent[w];
+        for (auto &s : edgelist) {
+            if (s->dfs_no == -1) continue;
+            int v = s->dfs_no + 1;
+            // Evaluate v with iterative path compression
+            if (ancestor[v] != -1) {
+                int x = v;
+                while (ancestor[ancestor[x]] != -1) {
+                    stack.emplace_back(x);
+                    x = ancestor[x];
+                }
+                while (!stack.empty()) {
+                    x = stack.back();
+                    stack.pop_back();
+                    if (semi[label[ancestor[x]]] < semi[label[x]]) {
+                        label[x] = label[ancestor[x]];
+                    }
+                    ancestor[x] = ancestor[ancestor[x]];
+                }
+            }
+            int u = label[v];
+            if (semi[u] < semi[w]) semi[w] = semi[u];
+        }
+        label[w] = w;
+        ancestor[w] = parent[w];
+    }
+
+    // The immediate dominator is the nearest common
+    // ancestor of the parent and the semidominator
+    for (int w = 1; w <= n; ++w) {
+        idom[w] = parent[w];
+        while (idom[w] > semi[w]) {
+            idom[w] = idom[idom[w]];
+        }
+    }
+
+    for (int w = 1; w <= n; ++w) {
+        if (idom[w] == 0) continue;
+        output.emplace_back(std::make_pair(naturalOrder[idom[w]-1], naturalOrder[w-1]));
+    }
+}
+
+void Graph::cooperHarveyKennedy(EdgeList& output, Graph::TraversalDirection dir) {
+    int n = naturalOrder.size();
+    // Postorder numbers, with the virtual root last
+    std::vector<int> post(n + 1), idom(n + 1, -1);
+    for (size_t i = 0; i < reverseOrder.size(); ++i) {
+        post[reverseOrder[i]->dfs_no + 1] = i;
+    }
+    post[0] = n;
+    idom[0] = 0;
+
+    auto intersect = [&post, &idom] (int a, int b) {
+        while (a != b) {
+            while (post[a] < post[b]) a = idom[a];
+            while (post[b] < post[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // Reverse postorder
+        for (auto it = reverseOrder.rbegin(); it != reverseOrder.rend(); ++it) {
+            Node::Ptr& block = *it;
+            int b = block->dfs_no + 1;
+            int newIdom = (block->parent == nullptr) ? 0 : -1;
+            const Node::EdgeList& edgelist = (dir == TraversalDirection::Natural) ?
+                block->outEdgeList() : block->inEdgeList();
+            for (auto &s : edgelist) {
+                if (s->dfs_no == -1) continue;
+                int p = s->dfs_no + 1;
+                if (idom[p] == -1) continue;
+                newIdom = (newIdom == -1) ? p : intersect(p, newIdom);
+            }
+            if (idom[b] != newIdom) {
+                idom[b] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    for (int w = 1; w <= n; ++w) {
+        if (idom[w] <= 0) continue;
+        output.emplace_back(std::make_pair(naturalOrder[idom[w]-1], naturalOrder[w-1]));
+    }
+}
+
 void Graph::SCC(std::vector< std::set<Node::Ptr> > &sccList){
     initializeDominatorInfo();
     for (auto& n: allNodes) {
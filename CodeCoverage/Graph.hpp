@@ -4,6 +4,7 @@
 #include <vector>
 #include <set>
 #include <memory>
+#include <functional>
 
 namespace GraphAnalysis {
 
@@ -33,12 +34,23 @@ protected:
     std::set<Ptr> bucket;
 };
 
+// Algorithm used by dominatorTree and postDominatorTree:
+// Lengauer-Tarjan with balanced path compression, Semi-NCA
+// (Georgiadis, "Linear-Time Algorithms for Dominators and Related
+// Problems", 2005), or the iterative algorithm of Cooper, Harvey and
+// Kennedy, "A Simple, Fast Dominance Algorithm", 2001.
+// All three give the same tree.
+enum class DominatorEngine { LengauerTarjan, SemiNCA, CooperHarveyKennedy };
+
 class Graph {
+    static DominatorEngine dominatorEngine;
 
 public:
     using Ptr = std::shared_ptr<Graph>;
     using NodeList = std::vector<Node::Ptr>;
     using EdgeList = std::vector< std::pair< Node::Ptr, Node::Ptr> >;
+    // Polled during long graph constructions, which stop once it returns true
+    using StopCheck = std::function<bool()>;
     void addNode(Node::Ptr);
     void addEntry(Node::Ptr);
     void addExit(Node::Ptr);
@@ -51,12 +63,20 @@ public:
     const NodeList& getEntries() { return entries; }
     const NodeList& getExits() { return exits; }
     void Print(bool);
+
+    static void setDominatorEngine(DominatorEngine e) { dominatorEngine = e; }
+    static DominatorEngine getDominatorEngine() { return dominatorEngine; }
+    // Parse "lt", "snca" or "chk"
+    static bool parseDominatorEngine(const char*, DominatorEngine&);
 protected:
     enum class TraversalDirection { Natural, Reverse };
     void link(Node::Ptr parent, Node::Ptr block);
     void DFS(Node::Ptr, TraversalDirection);
     void initializeDominatorInfo();
     void dominatorComputation(EdgeList& output, Graph::TraversalDirection dir);
+    void lengauerTarjan(EdgeList& output, Graph::TraversalDirection dir);
+    void semiNCA(EdgeList& output, Graph::TraversalDirection dir);
+    void cooperHarveyKennedy(EdgeList& output, Graph::TraversalDirection dir);
 
     std::vector<Node::Ptr> naturalOrder, reverseOrder;
     int currentDepthNo;
@@ -2,30 +2,563 @@
 #include "MultiBlockGraph.hpp"
 #include "CoverageLocationOpt.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <dirent.h>
+#include <sys/stat.h>
+
 using Dyninst::PatchAPI::PatchBlock;
 using namespace GraphAnalysis;
 
-int main(int argc, char** argv) {
-    FILE* f = fopen(argv[1], "r");
-    int n, e;
-    fscanf(f, "%d %d", &n, &e);
+// Nodes are numbered from 1, node 1 is the entry and node n the exit
+struct EdgeListGraph {
+    int n;
+    std::vector< std::pair<int, int> > edges;
+};
+
+static bool readOneGraph(FILE* f, EdgeListGraph& g) {
+    int e;
+    if (fscanf(f, "%d %d", &g.n, &e) != 2) return false;
+    g.edges.clear();
+    for (int i = 1; i <= e; ++i) {
+        int s, t;
+        if (fscanf(f, "%d %d", &s, &t) != 2) return false;
+        g.edges.emplace_back(std::make_pair(s, t));
+    }
+    return true;
+}
+
+static bool readEdgeList(const char* filename, EdgeListGraph& g) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return false;
+    bool ret = readOneGraph(f, g);
+    fclose(f);
+    return ret;
+}
+
+// A corpus file holds any number of graphs one after another,
+// as written by CodeCoverage --export-cfg. A directory is read file by file.
+static bool readCorpus(const char* path, std::vector<EdgeListGraph>& graphs) {
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (dir == NULL) return false;
+        std::vector<std::string> files;
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.') continue;
+            files.emplace_back(std::string(path) + "/" + ent->d_name);
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        for (auto &file : files) {
+            if (!readCorpus(file.c_str(), graphs)) return false;
+        }
+        return true;
+    }
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return false;
+    EdgeListGraph g;
+    while (readOneGraph(f, g)) {
+        graphs.emplace_back(g);
+    }
+    fclose(f);
+    return true;
+}
 
+static SingleBlockGraph::Ptr buildGraph(EdgeListGraph& g) {
     SingleBlockGraph::Ptr cfg = std::make_shared<SingleBlockGraph>();
-    for (int i = 1; i <= n; ++i) {
+    for (int i = 1; i <= g.n; ++i) {
         SBGNode::Ptr node = std::make_shared<SBGNode>((PatchBlock*)(i));
         cfg->addSBGNode(node);
     }
 
-    for (int i = 1; i <= e; ++i) {
-        int s, t;
-        fscanf(f, "%d %d", &s, &t);
-        SBGNode::Ptr source = cfg->lookupNode((PatchBlock*)(s));
-        SBGNode::Ptr target = cfg->lookupNode((PatchBlock*)(t));
+    for (auto &e : g.edges) {
+        SBGNode::Ptr source = cfg->lookupNode((PatchBlock*)(e.first));
+        SBGNode::Ptr target = cfg->lookupNode((PatchBlock*)(e.second));
         source->addOutEdge(target);
         target->addInEdge(source);
     }
     cfg->addEntry(cfg->lookupNode((PatchBlock*)1));
-    cfg->addExit(cfg->lookupNode((PatchBlock*)n));
+    cfg->addExit(cfg->lookupNode((PatchBlock*)(g.n)));
+    return cfg;
+}
+
+static void randomGraph(std::mt19937& rng, int n, EdgeListGraph& g) {
+    g.n = n;
+    g.edges.clear();
+    std::uniform_int_distribution<int> node(1, n);
+    std::uniform_int_distribution<int> degree(1, 3);
+    for (int i = 1; i < n; ++i) {
+        int d = degree(rng);
+        for (int j = 0; j < d; ++j) {
+            g.edges.emplace_back(std::make_pair(i, node(rng)));
+        }
+    }
+}
+
+// Structured graphs are built from regions with a single entry and a
+// single exit: blocks, sequences, if-then-else and while loops
+struct Region {
+    int entry, exit;
+};
+
+static Region structuredRegion(std::mt19937& rng, int budget, double loopRatio, EdgeListGraph& g) {
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    if (budget <= 1) {
+        int b = ++g.n;
+        return Region{b, b};
+    }
+    double r = coin(rng);
+    if (r < loopRatio && budget >= 3) {
+        // head -> body -> head, head -> exit
+        int head = ++g.n;
+        Region body = structuredRegion(rng, budget - 2, loopRatio, g);
+        int exit = ++g.n;
+        g.edges.emplace_back(std::make_pair(head, body.entry));
+        g.edges.emplace_back(std::make_pair(body.exit, head));
+        g.edges.emplace_back(std::make_pair(head, exit));
+        return Region{head, exit};
+    }
+    if (r < loopRatio + (1.0 - loopRatio) / 2 && budget >= 4) {
+        int head = ++g.n;
+        int left = (budget - 2) / 2;
+        Region then = structuredRegion(rng, left, loopRatio, g);
+        Region other = structuredRegion(rng, budget - 2 - left, loopRatio, g);
+        int join = ++g.n;
+        g.edges.emplace_back(std::make_pair(head, then.entry));
+        g.edges.emplace_back(std::make_pair(head, other.entry));
+        g.edges.emplace_back(std::make_pair(then.exit, join));
+        g.edges.emplace_back(std::make_pair(other.exit, join));
+        return Region{head, join};
+    }
+    std::uniform_int_distribution<int> split(1, budget - 1);
+    int first = split(rng);
+    Region a = structuredRegion(rng, first, loopRatio, g);
+    Region b = structuredRegion(rng, budget - first, loopRatio, g);
+    g.edges.emplace_back(std::make_pair(a.exit, b.entry));
+    return Region{a.entry, b.exit};
+}
+
+// Renumber so that the region entry is node 1 and its exit node n
+static void renumber(EdgeListGraph& g, Region r) {
+    std::vector<int> id(g.n + 1);
+    for (int i = 0; i <= g.n; ++i) {
+        id[i] = i;
+    }
+    std::swap(id[r.entry], id[1]);
+    int exit = id[r.exit];
+    for (int i = 0; i <= g.n; ++i) {
+        if (id[i] == g.n) id[i] = exit;
+        else if (id[i] == exit) id[i] = g.n;
+    }
+    for (auto &e : g.edges) {
+        e.first = id[e.first];
+        e.second = id[e.second];
+    }
+}
+
+static void structuredGraph(std::mt19937& rng, int n, double loopRatio, EdgeListGraph& g) {
+    g.n = 0;
+    g.edges.clear();
+    Region r = structuredRegion(rng, n, loopRatio, g);
+    renumber(g, r);
+}
+
+// A reducible graph with extra edges between random nodes,
+// which jump into the middle of loops
+static void irreducibleGraph(std::mt19937& rng, int n, EdgeListGraph& g) {
+    structuredGraph(rng, n, 0.3, g);
+    std::uniform_int_distribution<int> node(1, g.n);
+    int extra = std::max(1, g.n / 10);
+    for (int i = 0; i < extra; ++i) {
+        g.edges.emplace_back(std::make_pair(node(rng), node(rng)));
+    }
+}
+
+static bool generateGraph(const std::string& family, std::mt19937& rng, int n, EdgeListGraph& g) {
+    if (family == "random") {
+        randomGraph(rng, n, g);
+    } else if (family == "reducible") {
+        structuredGraph(rng, n, 0.2, g);
+    } else if (family == "irreducible") {
+        irreducibleGraph(rng, n, g);
+    } else if (family == "loopnest") {
+        structuredGraph(rng, n, 0.7, g);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static int nodeId(const Node::Ptr& n) {
+    return (int)(uint64_t)std::static_pointer_cast<SBGNode>(n)->getPatchBlock();
+}
+
+// Immediate dominators from the textbook dataflow formulation:
+// Dom(root) = {root}, Dom(v) = {v} + intersection of Dom(p) over predecessors p.
+// 0 means no immediate dominator.
+static void naiveDominators(EdgeListGraph& g, bool post, std::vector<int>& idom) {
+    int n = g.n;
+    int root = post ? n : 1;
+    std::vector< std::vector<int> > preds(n + 1), succs(n + 1);
+    for (auto &e : g.edges) {
+        int s = post ? e.second : e.first;
+        int t = post ? e.first : e.second;
+        preds[t].emplace_back(s);
+        succs[s].emplace_back(t);
+    }
+    std::vector<bool> reached(n + 1, false);
+    std::vector<int> stack(1, root);
+    reached[root] = true;
+    while (!stack.empty()) {
+        int v = stack.back();
+        stack.pop_back();
+        for (auto t : succs[v]) {
+            if (reached[t]) continue;
+            reached[t] = true;
+            stack.emplace_back(t);
+        }
+    }
+
+    std::vector< std::vector<bool> > dom(n + 1, std::vector<bool>(n + 1, true));
+    dom[root].assign(n + 1, false);
+    dom[root][root] = true;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 1; v <= n; ++v) {
+            if (v == root || !reached[v]) continue;
+            std::vector<bool> d(n + 1, true);
+            for (auto p : preds[v]) {
+                if (!reached[p]) continue;
+                for (int i = 1; i <= n; ++i) {
+                    d[i] = d[i] && dom[p][i];
+                }
+            }
+            d[v] = true;
+            if (d != dom[v]) {
+                dom[v] = d;
+                changed = true;
+            }
+        }
+    }
+
+    // The immediate dominator is the strict dominator with the most dominators
+    idom.assign(n + 1, 0);
+    for (int v = 1; v <= n; ++v) {
+        if (v == root || !reached[v]) continue;
+        int best = 0, bestSize = -1;
+        for (int d = 1; d <= n; ++d) {
+            if (d == v || !dom[v][d]) continue;
+            int size = 0;
+            for (int i = 1; i <= n; ++i) {
+                if (dom[d][i]) size += 1;
+            }
+            if (size > bestSize) {
+                best = d;
+                bestSize = size;
+            }
+        }
+        idom[v] = best;
+    }
+}
+
+static const char* engineName(DominatorEngine e) {
+    switch (e) {
+        case DominatorEngine::LengauerTarjan: return "lt";
+        case DominatorEngine::SemiNCA: return "snca";
+        case DominatorEngine::CooperHarveyKennedy: return "chk";
+    }
+    return "unknown";
+}
+
+// Return the number of engines that disagree with the naive solver
+static int checkGraph(EdgeListGraph& g, const char* name) {
+    int failures = 0;
+    DominatorEngine saved = Graph::getDominatorEngine();
+    for (int post = 0; post < 2; ++post) {
+        std::vector<int> expected;
+        naiveDominators(g, post, expected);
+        for (auto engine : {DominatorEngine::LengauerTarjan, DominatorEngine::SemiNCA, DominatorEngine::CooperHarveyKennedy}) {
+            Graph::setDominatorEngine(engine);
+            SingleBlockGraph::Ptr cfg = buildGraph(g);
+            Graph::EdgeList elist;
+            if (post) {
+                cfg->postDominatorTree(elist);
+            } else {
+                cfg->dominatorTree(elist);
+            }
+            std::vector<int> idom(g.n + 1, 0);
+            for (auto &e : elist) {
+                idom[nodeId(e.second)] = nodeId(e.first);
+            }
+            for (int v = 1; v <= g.n; ++v) {
+                if (idom[v] == expected[v]) continue;
+                fprintf(stderr, "%s: %s %s mismatch at node %d: expect %d, get %d\n",
+                    name, engineName(engine), post ? "post-dominator" : "dominator", v, expected[v], idom[v]);
+                failures += 1;
+                break;
+            }
+        }
+    }
+    Graph::setDominatorEngine(saved);
+    return failures;
+}
+
+static int checkDominators(int argc, char** argv) {
+    int graphs = 1000;
+    int nodes = 50;
+    unsigned seed = 1;
+    std::vector<const char*> corpus;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--graphs") == 0) {
+            graphs = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--nodes") == 0) {
+            nodes = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoul(argv[i+1], NULL, 10);
+            i += 1;
+            continue;
+        }
+        corpus.push_back(argv[i]);
+    }
+
+    int failures = 0;
+    size_t corpusGraphs = 0;
+    for (auto path : corpus) {
+        std::vector<EdgeListGraph> graphs;
+        if (!readCorpus(path, graphs)) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            return 1;
+        }
+        for (size_t i = 0; i < graphs.size(); ++i) {
+            char name[256];
+            snprintf(name, sizeof(name), "%s graph %lu", path, i);
+            failures += checkGraph(graphs[i], name);
+        }
+        corpusGraphs += graphs.size();
+    }
+
+    // Cycle through all generated families
+    const char* families[] = {"random", "reducible", "irreducible", "loopnest"};
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> size(2, std::max(2, nodes));
+    for (int i = 0; i < graphs; ++i) {
+        EdgeListGraph g;
+        const char* family = families[i % 4];
+        generateGraph(family, rng, size(rng), g);
+        char name[64];
+        snprintf(name, sizeof(name), "%s graph %d (seed %u)", family, i, seed);
+        failures += checkGraph(g, name);
+    }
+    printf("Checked %lu corpus graphs and %d generated graphs, %d failures\n", corpusGraphs, graphs, failures);
+    return failures == 0 ? 0 : 1;
+}
+
+// Time of each analysis phase, in seconds
+struct PhaseTimes {
+    double dominator, postDominator, scc, mbg, clo;
+    PhaseTimes(): dominator(0), postDominator(0), scc(0), mbg(0), clo(0) {}
+    double total() const { return dominator + postDominator + scc + mbg + clo; }
+};
+
+struct BenchResult {
+    std::string family;
+    int graphs;
+    uint64_t nodes, edges;
+    PhaseTimes times;
+    BenchResult(const std::string& f): family(f), graphs(0), nodes(0), edges(0) {}
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point& start) {
+    auto now = std::chrono::steady_clock::now();
+    double ret = std::chrono::duration<double>(now - start).count();
+    start = now;
+    return ret;
+}
+
+static void benchGraph(EdgeListGraph& g, int repeat, BenchResult& r) {
+    for (int i = 0; i < repeat; ++i) {
+        SingleBlockGraph::Ptr cfg = buildGraph(g);
+        auto start = std::chrono::steady_clock::now();
+        Graph::EdgeList domEdges, postDomEdges;
+        cfg->dominatorTree(domEdges);
+        r.times.dominator += secondsSince(start);
+        cfg->postDominatorTree(postDomEdges);
+        r.times.postDominator += secondsSince(start);
+        std::vector< std::set<Node::Ptr> > sccList;
+        cfg->SCC(sccList);
+        r.times.scc += secondsSince(start);
+        // Reuse the trees, so this only times the super block graph itself
+        MultiBlockGraph::Ptr sbdg = std::make_shared<MultiBlockGraph>(cfg, domEdges, postDomEdges);
+        r.times.mbg += secondsSince(start);
+        CoverageLocationOpt clo(cfg, sbdg, std::string("exact"));
+        r.times.clo += secondsSince(start);
+    }
+    r.graphs += 1;
+    r.nodes += g.n;
+    r.edges += g.edges.size();
+}
+
+static void printBenchResult(FILE* f, BenchResult& r, bool json, bool last) {
+    if (json) {
+        fprintf(f, "    {\"family\": \"%s\", \"graphs\": %d, \"nodes\": %lu, \"edges\": %lu, "
+            "\"dominator\": %.6lf, \"post_dominator\": %.6lf, \"scc\": %.6lf, \"mbg\": %.6lf, "
+            "\"coverage_location_opt\": %.6lf, \"total\": %.6lf}%s\n",
+            r.family.c_str(), r.graphs, r.nodes, r.edges,
+            r.times.dominator, r.times.postDominator, r.times.scc, r.times.mbg, r.times.clo, r.times.total(),
+            last ? "" : ",");
+    } else {
+        fprintf(f, "%-12s %6d graphs %9lu nodes %9lu edges: dom %.4lf s, post-dom %.4lf s, SCC %.4lf s, MBG %.4lf s, CLO %.4lf s, total %.4lf s\n",
+            r.family.c_str(), r.graphs, r.nodes, r.edges,
+            r.times.dominator, r.times.postDominator, r.times.scc, r.times.mbg, r.times.clo, r.times.total());
+    }
+}
+
+static int benchmark(int argc, char** argv) {
+    int graphs = 100;
+    int nodes = 1000;
+    int repeat = 1;
+    unsigned seed = 1;
+    std::string json_filename;
+    std::vector<std::string> families;
+    std::vector<const char*> corpus;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--family") == 0) {
+            families.emplace_back(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--graphs") == 0) {
+            graphs = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--nodes") == 0) {
+            nodes = atoi(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = std::max(1, atoi(argv[i+1]));
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoul(argv[i+1], NULL, 10);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dominator-engine") == 0) {
+            DominatorEngine engine;
+            if (!Graph::parseDominatorEngine(argv[i+1], engine)) {
+                fprintf(stderr, "Unknown dominator engine %s, expect lt, snca or chk\n", argv[i+1]);
+                return 1;
+            }
+            Graph::setDominatorEngine(engine);
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--json") == 0) {
+            json_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--corpus") == 0) {
+            corpus.push_back(argv[i+1]);
+            i += 1;
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        return 1;
+    }
+    if (families.empty() && corpus.empty()) {
+        families = {"random", "reducible", "irreducible", "loopnest"};
+    }
+
+    std::vector<BenchResult> results;
+    for (auto &family : families) {
+        BenchResult r(family);
+        // Every family gets the same sequence of sizes
+        std::mt19937 rng(seed);
+        for (int i = 0; i < graphs; ++i) {
+            EdgeListGraph g;
+            if (!generateGraph(family, rng, nodes, g)) {
+                fprintf(stderr, "Unknown graph family %s, expect random, reducible, irreducible or loopnest\n", family.c_str());
+                return 1;
+            }
+            benchGraph(g, repeat, r);
+        }
+        results.emplace_back(r);
+    }
+    for (auto path : corpus) {
+        std::vector<EdgeListGraph> graphs;
+        if (!readCorpus(path, graphs)) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            return 1;
+        }
+        BenchResult r(std::string("corpus:") + path);
+        for (auto &g : graphs) {
+            benchGraph(g, repeat, r);
+        }
+        results.emplace_back(r);
+    }
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        printBenchResult(stdout, results[i], false, i + 1 == results.size());
+    }
+    if (json_filename != "") {
+        FILE* f = fopen(json_filename.c_str(), "w");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot open %s\n", json_filename.c_str());
+            return 1;
+        }
+        fprintf(f, "{\n  \"dominator_engine\": \"%s\",\n  \"repeat\": %d,\n  \"seed\": %u,\n  \"results\": [\n",
+            engineName(Graph::getDominatorEngine()), repeat, seed);
+        for (size_t i = 0; i < results.size(); ++i) {
+            printBenchResult(f, results[i], true, i + 1 == results.size());
+        }
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <edge list>\n", argv[0]);
+        fprintf(stderr, "       %s --check-dominators [--graphs N] [--nodes N] [--seed N] [<corpus> ...]\n", argv[0]);
+        fprintf(stderr, "       %s --bench [--family random|reducible|irreducible|loopnest] [--graphs N] [--nodes N]\n"
+                        "              [--repeat N] [--seed N] [--dominator-engine lt|snca|chk] [--corpus path] [--json file]\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "--check-dominators") == 0) {
+        return checkDominators(argc, argv);
+    }
+    if (strcmp(argv[1], "--bench") == 0) {
+        return benchmark(argc, argv);
+    }
+
+    EdgeListGraph g;
+    if (!readEdgeList(argv[1], g)) {
+        fprintf(stderr, "Cannot read %s\n", argv[1]);
+        return 1;
+    }
+    SingleBlockGraph::Ptr cfg = buildGraph(g);
+    int n = g.n;
     fprintf(stderr, "CFG\n");
     cfg->Print(false);
 
@@ -42,4 +575,4 @@ int main(int argc, char** argv) {
     for (int i = 1; i <= n; ++i) {
         if (clo.needInstrumentation(i)) fprintf(stderr, "\t <%d>\n", i);
     }
-}
\ No newline at end of file
+}
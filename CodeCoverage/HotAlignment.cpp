@@ -0,0 +1,148 @@
+#include "HotAlignment.hpp"
+#include "LoopCloneOptimizer.hpp"
+
+#include "PatchCFG.h"
+#include "Point.h"
+#include "PatchMgr.h"
+#include "PatchObject.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <set>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+using Dyninst::PatchAPI::PatchEdge;
+using Dyninst::PatchAPI::PatchLoop;
+using Dyninst::PatchAPI::PatchMgr;
+using Dyninst::PatchAPI::Point;
+
+// Recommended multi-byte NOPs, from the Intel SDM
+static const unsigned char NOPs[9][9] = {
+    {0x90},
+    {0x66, 0x90},
+    {0x0f, 0x1f, 0x00},
+    {0x0f, 0x1f, 0x40, 0x00},
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+AlignmentSnippet::AlignmentSnippet(int a, int skip): alignment(a), maxSkip(skip) {}
+
+int AlignmentSnippet::codeSize(int alignment, int maxSkip) {
+    return std::min(alignment - 1, maxSkip);
+}
+
+bool AlignmentSnippet::generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) {
+    int padding = (alignment - buf.curAddr() % alignment) % alignment;
+    if (padding > maxSkip) return true;
+    while (padding > 0) {
+        int len = std::min(padding, 9);
+        buf.copy(NOPs[len - 1], len);
+        padding -= len;
+    }
+    return true;
+}
+
+HotAlignment::HotAlignment(int a, int skip): alignment(a), maxSkip(skip), budget(0) {}
+
+static double blockCount(PatchBlock* b) {
+    // Samples are proportional to both execution count and block size
+    return LoopCloneOptimizer::getPGOMetric(b->start()) / std::max<uint64_t>(1, b->end() - b->start());
+}
+
+// The fall-through edges into a loop header that are not back edges.
+// Back edges come from a block of the loop in the same loop clone.
+void HotAlignment::getEntryEdges(PatchBlock* header, const std::set<uint64_t>& loopBlocks, std::vector<PatchEdge*>& edges) {
+    for (auto e : header->sources()) {
+        if (e->sinkEdge() || e->interproc()) continue;
+        if (e->type() != Dyninst::ParseAPI::FALLTHROUGH && e->type() != Dyninst::ParseAPI::COND_NOT_TAKEN) continue;
+        PatchBlock* src = e->src();
+        if (src->getCloneVersion() == header->getCloneVersion() && loopBlocks.find(src->start()) != loopBlocks.end()) continue;
+        edges.push_back(e);
+    }
+}
+
+void HotAlignment::plan(std::vector<PatchFunction*>& funcs, uint64_t maxBytes) {
+    budget = maxBytes;
+    std::vector<Candidate> candidates;
+    for (auto f : funcs) {
+        std::map<PatchBlock*, std::set<uint64_t> > headers;
+        std::vector<PatchLoop*> loops;
+        f->getLoops(loops);
+        for (auto l : loops) {
+            // Irreducible loops have no single header to align
+            std::vector<PatchBlock*> entries;
+            if (l->getLoopEntries(entries) != 1) continue;
+            std::vector<PatchBlock*> blocks;
+            l->getLoopBasicBlocks(blocks);
+            std::set<uint64_t>& loopBlocks = headers[entries[0]];
+            for (auto b : blocks) {
+                loopBlocks.insert(b->start());
+            }
+        }
+        for (auto &it : headers) {
+            std::vector<PatchEdge*> edges;
+            getEntryEdges(it.first, it.second, edges);
+            if (edges.empty()) continue;
+            double count = blockCount(it.first);
+            if (count > 0) candidates.push_back(Candidate{f, it.first, count, edges.size(), it.second});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+        [] (const Candidate& a, const Candidate& b) {
+            if (a.count != b.count) return a.count > b.count;
+            return a.block->start() < b.block->start();
+        }
+    );
+
+    uint64_t size = AlignmentSnippet::codeSize(alignment, maxSkip);
+    uint64_t used = 0;
+    for (auto &c : candidates) {
+        uint64_t padding = c.entryEdges * size;
+        if (budget > 0 && used + padding > budget) break;
+        used += padding;
+        selected.push_back(c);
+    }
+}
+
+void HotAlignment::apply() {
+    int loops = 0, skipped = 0, overBudget = 0;
+    uint64_t size = AlignmentSnippet::codeSize(alignment, maxSkip);
+    uint64_t used = 0;
+    for (auto &c : selected) {
+        PatchBlock* b = LoopCloneOptimizer::getSteadyStateBlock(c.func, c.block);
+        PatchMgr::Ptr mgr = c.func->obj()->mgr();
+        // The steady-state clone may be entered from other clones by branches only
+        std::vector<PatchEdge*> edges;
+        getEntryEdges(b, c.loopBlocks, edges);
+        if (edges.empty()) {
+            ++skipped;
+            continue;
+        }
+        if (budget > 0 && used + edges.size() * size > budget) {
+            ++overBudget;
+            continue;
+        }
+        used += edges.size() * size;
+        for (auto e : edges) {
+            Point* p = mgr->findPoint(Dyninst::PatchAPI::Location::EdgeInstance(c.func, e), Point::EdgeDuring, true);
+            assert(p != nullptr);
+            p->pushBack(AlignmentSnippet::create(new AlignmentSnippet(alignment, maxSkip)));
+        }
+        c.func->markModified();
+        ++loops;
+    }
+    printf("Align %d loop headers to %d bytes, at most %lu bytes of padding\n", loops, alignment, used);
+    if (skipped > 0) {
+        printf("Skip %d loop headers only entered by branches\n", skipped);
+    }
+    if (overBudget > 0) {
+        printf("Skip %d loop headers whose clones exceed the padding budget\n", overBudget);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef HOT_ALIGNMENT_HPP
+#define HOT_ALIGNMENT_HPP
+
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include "Snippet.h"
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+        class PatchEdge;
+    }
+}
+
+// Pad with NOPs up to the next alignment boundary of the relocated code,
+// skipping the padding if it would take more than maxSkip bytes,
+// like .p2align with a max skip. The padding is computed from the
+// address the snippet is generated at.
+class AlignmentSnippet : public Dyninst::PatchAPI::Snippet {
+    int alignment;
+    int maxSkip;
+public:
+    AlignmentSnippet(int alignment, int maxSkip);
+    // Keep in sync with generate
+    static int codeSize(int alignment, int maxSkip);
+    bool generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) override;
+    const char* snippetName() const override { return "alignment"; }
+};
+
+// Align hot loop headers in the relocated code. Candidates are ranked
+// by the execution count of their header in the profile, and are aligned
+// in that order until the worst case padding reaches the byte budget,
+// so cold code is never padded.
+//
+// The padding sits on the fall-through edges that enter the loop, so it
+// runs once per loop entry and not on every back edge. Each of these
+// edges gets its own padding and is charged to the budget. Loops only
+// entered by branches have no place for it and are not aligned.
+// Function entries are not aligned: the only place for their padding
+// is the entry block, where it would run on every call.
+class HotAlignment {
+    struct Candidate {
+        Dyninst::PatchAPI::PatchFunction* func;
+        Dyninst::PatchAPI::PatchBlock* block;
+        double count;
+        // Fall-through edges entering the loop, one padding each
+        size_t entryEdges;
+        // Start addresses of the blocks of the loop
+        std::set<uint64_t> loopBlocks;
+    };
+
+    static void getEntryEdges(Dyninst::PatchAPI::PatchBlock* header, const std::set<uint64_t>& loopBlocks,
+                              std::vector<Dyninst::PatchAPI::PatchEdge*>& edges);
+
+    std::vector<Candidate> selected;
+    int alignment;
+    int maxSkip;
+    uint64_t budget;
+
+public:
+    HotAlignment(int alignment, int maxSkip);
+    // Pick the blocks to align, before loop cloning changes the CFG
+    void plan(std::vector<Dyninst::PatchAPI::PatchFunction*>&, uint64_t budget);
+    // Insert the padding into the loop clone that execution settles in,
+    // whose entry edges may differ from the original loop, so the budget
+    // is checked again
+    void apply();
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "HotColdSplit.hpp"
+#include "LoopCloneOptimizer.hpp"
+
+#include "PatchCFG.h"
+
+#include <fstream>
+#include <unordered_set>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+
+static std::unordered_set<uint64_t> coveredBlocks;
+static bool coverageLoaded = false;
+
+bool HotColdSplit::readCoverageFile(const std::string& filename) {
+    // Same format as the output of CoverageMerge:
+    // number of covered blocks, then the covered block addresses
+    std::ifstream infile(filename, std::fstream::in);
+    if (!infile.is_open()) return false;
+    int total;
+    if (!(infile >> total)) return false;
+    uint64_t addr;
+    while (infile >> std::hex >> addr) {
+        coveredBlocks.insert(addr);
+    }
+    coverageLoaded = true;
+    return true;
+}
+
+bool HotColdSplit::hasCoverage() {
+    return coverageLoaded;
+}
+
+bool HotColdSplit::canSplit() {
+    return coverageLoaded || LoopCloneOptimizer::hasPGOData();
+}
+
+HotColdSplit::HotColdSplit(PatchFunction* f) {
+    hotBytes = 0;
+    coldBytes = 0;
+    bool useProfile = LoopCloneOptimizer::hasPGOData();
+    // Earlier loop versions only run until their blocks get covered,
+    // so only the last version of a cloned loop can be hot
+    std::set<PatchBlock*> steadyBlocks;
+    LoopCloneOptimizer::getSteadyStateBlocks(f, steadyBlocks);
+    bool sampled = false;
+    bool entryCovered = true;
+    for (auto b : f->blocks()) {
+        bool cold = false;
+        if (useProfile) {
+            if (LoopCloneOptimizer::getPGOMetric(b->start()) > 0) sampled = true;
+            if (steadyBlocks.find(b) == steadyBlocks.end() || LoopCloneOptimizer::getPGOMetric(b->start()) == 0) {
+                cold = true;
+            }
+        }
+        if (coverageLoaded && coveredBlocks.find(b->start()) == coveredBlocks.end()) {
+            cold = true;
+            if (b == f->entry()) entryCovered = false;
+        }
+        // Samples may miss the entry of a function that runs,
+        // it still starts the hot part
+        if (b == f->entry()) cold = false;
+        if (cold) {
+            coldBlocks.insert(b);
+            coldBytes += b->end() - b->start();
+        } else {
+            hotBytes += b->end() - b->start();
+        }
+    }
+    // A function that never runs is cold as a whole,
+    // splitting it would only add jumps between the two parts
+    if (!entryCovered || (useProfile && !sampled)) {
+        coldBlocks.clear();
+        hotBytes += coldBytes;
+        coldBytes = 0;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef HOT_COLD_SPLIT_HPP
+#define HOT_COLD_SPLIT_HPP
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+// Blocks placed in the cold area at the end of .dyninstInst get layout
+// orders from here on. See BlockLayout::apply for how the orders are used.
+static const uint64_t ColdLayoutBase = 1ULL << 62;
+
+// Split a relocated function into a hot part and a cold part.
+// A block is cold if it has no samples in the profile or it was never
+// covered in the coverage dumps. The entry block always stays hot, even
+// without samples. A function whose entry was never covered, or with no
+// samples at all, is cold as a whole and is not split.
+class HotColdSplit {
+    std::set<Dyninst::PatchAPI::PatchBlock*> coldBlocks;
+    uint64_t hotBytes;
+    uint64_t coldBytes;
+
+public:
+    static bool readCoverageFile(const std::string&);
+    static bool hasCoverage();
+    static bool canSplit();
+
+    HotColdSplit(Dyninst::PatchAPI::PatchFunction*);
+    bool isCold(Dyninst::PatchAPI::PatchBlock* b) { return coldBlocks.find(b) != coldBlocks.end(); }
+    bool hasColdBlocks() { return !coldBlocks.empty(); }
+    uint64_t getHotBytes() { return hotBytes; }
+    uint64_t getColdBytes() { return coldBytes; }
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "IndirectCallPromotion.hpp"
+
+#include "CFG.h"
+#include "PatchCFG.h"
+#include "Point.h"
+#include "PatchMgr.h"
+#include "PatchObject.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <map>
+
+using Dyninst::Address;
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+using Dyninst::PatchAPI::PatchMgr;
+using Dyninst::PatchAPI::Point;
+
+PromotionSnippet::PromotionSnippet(const std::vector<unsigned char>& c, uint64_t h, int len):
+    compare(c), hot(h), callLength(len) {}
+
+bool PromotionSnippet::generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) {
+    Address addr = buf.curAddr();
+    buf.copy(compare.data(), compare.size());
+    const unsigned char jne[2] = {0x75, 0x07};
+    buf.copy(jne, 2);
+    unsigned char call[5] = {0xe8};
+    *(int32_t*)(&call[1]) = (int32_t)((int64_t)hot - (int64_t)(addr + compare.size() + 2 + 5));
+    buf.copy(call, 5);
+    // The relocated indirect call keeps its length, as its operand
+    // does not depend on the address of the code
+    const unsigned char jmp[2] = {0xeb, (unsigned char)callLength};
+    buf.copy(jmp, 2);
+    return true;
+}
+
+// Turn call *<operand> (ff /2) into cmpq $imm32, <operand> (REX.W 81 /7)
+static bool makeCompare(const unsigned char* insn, int length, uint64_t hot, std::vector<unsigned char>& compare) {
+    int i = 0;
+    // notrack prefix of indirect branches with CET
+    if (i < length && insn[i] == 0x3e) ++i;
+    unsigned char rex = 0;
+    if (i < length && (insn[i] & 0xf0) == 0x40) rex = insn[i++];
+    if (i + 2 > length || insn[i] != 0xff) return false;
+    unsigned char modrm = insn[i + 1];
+    if (((modrm >> 3) & 7) != 2) return false;
+    // RIP-relative operands would need a new displacement
+    if ((modrm >> 6) == 0 && (modrm & 7) == 5) return false;
+
+    compare.clear();
+    compare.push_back(0x48 | (rex & 0x07));
+    compare.push_back(0x81);
+    compare.push_back((modrm & 0xc7) | 0x38);
+    compare.insert(compare.end(), insn + i + 2, insn + length);
+    int32_t imm = (int32_t)hot;
+    compare.insert(compare.end(), (unsigned char*)&imm, (unsigned char*)&imm + 4);
+    return true;
+}
+
+IndirectCallPromotion::IndirectCallPromotion(std::vector<PatchFunction*>& funcs, std::vector<IndirectCallsite>& callsites, double minRatio, uint64_t minCount) {
+    totalCalls = 0;
+    promotedCalls = 0;
+
+    std::map<Address, std::pair<PatchFunction*, PatchBlock*> > callSiteMap;
+    std::map<Address, PatchFunction*> funcMap;
+    for (auto f : funcs) {
+        funcMap[f->addr()] = f;
+        for (auto b : f->callBlocks()) {
+            callSiteMap[b->end()] = std::make_pair(f, b);
+        }
+    }
+
+    int total = 0;
+    for (auto &site : callsites) {
+        totalCalls += site.total;
+        ++total;
+        if (site.targets.empty() || site.total < minCount) continue;
+        uint64_t hot = site.targets[0].first;
+        uint64_t count = site.targets[0].second;
+        if (count < site.total * minRatio) continue;
+        if (hot > 0x7fffffff || funcMap.find(hot) == funcMap.end()) continue;
+
+        auto cit = callSiteMap.find(site.callsite);
+        if (cit == callSiteMap.end()) continue;
+        PatchBlock* callBlock = cit->second.second;
+        bool indirect = false;
+        for (auto e : callBlock->targets()) {
+            if (e->sinkEdge() && e->type() == Dyninst::ParseAPI::CALL) indirect = true;
+        }
+        if (!indirect) continue;
+
+        int length = callBlock->end() - callBlock->last();
+        const unsigned char* insn = (const unsigned char*)callBlock->block()->region()->getPtrToInstruction(callBlock->last());
+        Candidate c;
+        if (insn == nullptr || !makeCompare(insn, length, hot, c.compare)) continue;
+        c.caller = cit->second.first;
+        c.callBlock = callBlock;
+        c.hot = hot;
+        c.count = count;
+        candidates.emplace_back(c);
+        promotedCalls += count;
+    }
+    printf("Promote %lu of %d indirect callsites, covering %.2lf percent of indirect calls\n",
+        candidates.size(), total, totalCalls > 0 ? promotedCalls * 100.0 / totalCalls : 0.0);
+}
+
+void IndirectCallPromotion::perform() {
+    for (auto &c : candidates) {
+        PatchMgr::Ptr mgr = c.caller->obj()->mgr();
+        Point* p = mgr->findPoint(Dyninst::PatchAPI::Location::BlockInstance(c.caller, c.callBlock, true), Point::PreCall, true);
+        assert(p != nullptr);
+        c.caller->markModified();
+        int length = c.callBlock->end() - c.callBlock->last();
+        // Nothing may be emitted between the snippet and the call it jumps over
+        p->pushBack(PromotionSnippet::create(new PromotionSnippet(c.compare, c.hot, length)));
+    }
+}
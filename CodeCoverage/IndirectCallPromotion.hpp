@@ -0,0 +1,77 @@
+#ifndef INDIRECT_CALL_PROMOTION_HPP
+#define INDIRECT_CALL_PROMOTION_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "Snippet.h"
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+// The target profile of an indirect call site, written by libcg.
+// The call site is named by its return address.
+struct IndirectCallsite {
+    uint64_t callsite;
+    uint64_t total;
+    std::vector<std::pair<uint64_t, uint64_t> > targets;
+};
+
+// Emitted right before an indirect call, compare its target with the hot
+// one and call the hot target directly if they match, then jump over the
+// indirect call:
+//
+//     cmpq $hot, <operand of the call>
+//     jne 1f
+//     call hot
+//     jmp 2f
+// 1:  call *<operand>
+// 2:
+//
+// The operand is copied from the call, so the target is loaded the same way.
+// Flags are dead at a call, so the compare can clobber them.
+class PromotionSnippet : public Dyninst::PatchAPI::Snippet {
+    std::vector<unsigned char> compare;
+    uint64_t hot;
+    int callLength;
+public:
+    PromotionSnippet(const std::vector<unsigned char>& compare, uint64_t hot, int callLength);
+    bool generate(Dyninst::PatchAPI::Point* pt, Dyninst::Buffer& buf) override;
+    const char* snippetName() const override { return "promotion"; }
+};
+
+// Promote the hottest target of an indirect call site to a guarded direct
+// call when it takes at least minRatio of the calls of the site.
+// Only calls through a register or a memory operand that is not
+// RIP-relative are promoted, and the hot target must be a function of
+// the binary whose address fits in the 32-bit immediate of the compare.
+// The guard compares with the original address of the hot target and
+// calls it there, so function pointers must keep their original values:
+// CodeCoverage requires --disable-function-pointer-reloc with it.
+// The snippet jumps over the call that follows it, which relies on the
+// snippet being the last one at the PreCall point and on Dyninst
+// emitting the relocated call right after it with its original length;
+// tests/promotion.sh checks both paths on a rewritten binary.
+class IndirectCallPromotion {
+    struct Candidate {
+        Dyninst::PatchAPI::PatchFunction* caller;
+        Dyninst::PatchAPI::PatchBlock* callBlock;
+        uint64_t hot;
+        uint64_t count;
+        std::vector<unsigned char> compare;
+    };
+
+    std::vector<Candidate> candidates;
+    uint64_t totalCalls;
+    uint64_t promotedCalls;
+
+public:
+    IndirectCallPromotion(std::vector<Dyninst::PatchAPI::PatchFunction*>&, std::vector<IndirectCallsite>&, double minRatio, uint64_t minCount);
+    void perform();
+};
+
+#endif
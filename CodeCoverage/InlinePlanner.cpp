@@ -0,0 +1,166 @@
+#include "InlinePlanner.hpp"
+
+#include "PatchCFG.h"
+#include "PatchModifier.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+
+using Dyninst::Address;
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+using Dyninst::PatchAPI::PatchObject;
+using Dyninst::PatchAPI::PatchModifier;
+
+// Small callers may always grow by this many bytes,
+// otherwise a tiny caller of a large hot callee could never inline it
+static const uint64_t MinCallerGrowth = 256;
+
+InlinePlanner::InlinePlanner(std::vector<PatchFunction*>& funcs, std::vector<InlineCallsite>& callsites) {
+    totalSize = 0;
+    totalGrowth = 0;
+    totalMetric = 0;
+    acceptedMetric = 0;
+
+    std::map<Address, std::pair<PatchFunction*, PatchBlock*> > callSiteMap;
+    std::map<Address, PatchFunction*> funcMap;
+    for (auto f : funcs) {
+        funcMap[f->addr()] = f;
+        uint64_t size = 0;
+        for (auto b : f->blocks()) {
+            size += b->end() - b->start();
+        }
+        origSize[f] = size;
+        effSize[f] = size;
+        instances[f] = 1;
+        totalSize += size;
+        for (auto b : f->callBlocks()) {
+            callSiteMap[b->end()] = std::make_pair(f, b);
+        }
+    }
+
+    for (auto & callsite : callsites) {
+        totalMetric += callsite.metric;
+        auto cit = callSiteMap.find(callsite.callsite);
+        if (cit == callSiteMap.end()) continue;
+        PatchBlock* callBlock = cit->second.second;
+        bool indirect = false;
+        for (auto e : callBlock->targets()) {
+            if (e->sinkEdge()) {
+                indirect = true;
+            }
+        }
+        if (indirect) continue;
+        auto fit = funcMap.find(callsite.callee);
+        if (fit == funcMap.end()) continue;
+        Candidate c(callsite);
+        c.caller = cit->second.first;
+        c.callee = fit->second;
+        c.callBlock = callBlock;
+        if (c.caller == c.callee) continue;
+        candidates.emplace_back(c);
+    }
+}
+
+bool InlinePlanner::reaches(PatchFunction* from, PatchFunction* to) {
+    std::set<PatchFunction*> visited;
+    std::vector<PatchFunction*> stack(1, from);
+    while (!stack.empty()) {
+        PatchFunction* f = stack.back();
+        stack.pop_back();
+        if (f == to) return true;
+        if (!visited.insert(f).second) continue;
+        for (auto &it : inlinedCallees[f]) {
+            stack.emplace_back(it.first);
+        }
+    }
+    return false;
+}
+
+void InlinePlanner::addSize(PatchFunction* f, uint64_t bytes) {
+    // Every function that has f inlined grows as well
+    effSize[f] += bytes;
+    for (auto &it : inlinedCallers[f]) {
+        addSize(it.first, bytes * it.second);
+    }
+}
+
+void InlinePlanner::addInstances(PatchFunction* f, uint64_t n) {
+    // Everything inlined into f gets copied along with it
+    instances[f] += n;
+    for (auto &it : inlinedCallees[f]) {
+        addInstances(it.first, n * it.second);
+    }
+}
+
+void InlinePlanner::plan(double budgetPercent, double callerCap) {
+    std::sort(candidates.begin(), candidates.end(),
+        [this] (const Candidate& a, const Candidate& b) {
+            double sa = a.site.metric / std::max<uint64_t>(1, origSize[a.callee]);
+            double sb = b.site.metric / std::max<uint64_t>(1, origSize[b.callee]);
+            if (sa != sb) return sa > sb;
+            return a.site.callsite < b.site.callsite;
+        }
+    );
+
+    uint64_t budget = std::numeric_limits<uint64_t>::max();
+    if (budgetPercent > 0) {
+        budget = (uint64_t)(totalSize * budgetPercent / 100.0);
+    }
+
+    for (auto &c : candidates) {
+        // Inlining a function that already contains the caller never ends
+        if (reaches(c.callee, c.caller)) continue;
+        uint64_t cost = effSize[c.callee];
+        uint64_t growth = cost * instances[c.caller];
+        if (totalGrowth + growth > budget) continue;
+        if (callerCap > 0) {
+            uint64_t origCaller = origSize[c.caller];
+            uint64_t limit = std::max((uint64_t)(origCaller * callerCap), origCaller + MinCallerGrowth);
+            if (effSize[c.caller] + cost > limit) continue;
+        }
+
+        totalGrowth += growth;
+        acceptedMetric += c.site.metric;
+        addSize(c.caller, cost);
+        addInstances(c.callee, instances[c.caller]);
+        inlinedCallees[c.caller][c.callee] += 1;
+        inlinedCallers[c.callee][c.caller] += 1;
+        accepted.emplace_back(&c);
+    }
+
+    printf("Inline %lu of %lu callsites, %lu bytes growth over %lu bytes of code, covering %.2lf percent metrics\n",
+        accepted.size(), candidates.size(), totalGrowth, totalSize,
+        totalMetric > 0 ? acceptedMetric * 100.0 / totalMetric : 0.0);
+}
+
+void InlinePlanner::orderBottomUp(PatchFunction* f, std::set<PatchFunction*>& visited, std::vector<Candidate*>& order) {
+    if (!visited.insert(f).second) return;
+    for (auto &it : inlinedCallees[f]) {
+        orderBottomUp(it.first, visited, order);
+    }
+    for (auto c : accepted) {
+        if (c->caller == f) order.emplace_back(c);
+    }
+}
+
+void InlinePlanner::perform() {
+    if (accepted.empty()) return;
+    // Inline into callees first, so that inlining a callee
+    // brings along everything that was planned to be inlined into it
+    std::vector<Candidate*> order;
+    std::set<PatchFunction*> visited;
+    for (auto c : accepted) {
+        orderBottomUp(c->caller, visited, order);
+    }
+
+    PatchObject* obj = accepted[0]->caller->obj();
+    PatchModifier::beginInlineSet(obj);
+    for (auto c : order) {
+        if (PatchModifier::inlineCall(c->caller, c->callBlock, c->site.callee)) {
+            printf("Inline callsite %lx, callee %lx\n", c->site.callsite, c->site.callee);
+        }
+    }
+    PatchModifier::endInlineSet();
+}
@@ -0,0 +1,62 @@
+#ifndef INLINE_PLANNER_HPP
+#define INLINE_PLANNER_HPP
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+struct InlineCallsite {
+    uint64_t callsite;
+    uint64_t callee;
+    double metric;
+    InlineCallsite(uint64_t s, uint64_t c, double m): callsite(s), callee(c), metric(m) {}
+};
+
+// Choose which profiled callsites to inline.
+// Callsites are ranked by metric per byte of callee code and accepted while
+// the total code growth stays within a global budget and the caller stays
+// within its own growth cap. Code growth accounts for nested inlines:
+// a callee carries everything already inlined into it, and every copy of
+// a caller receives what is inlined into the caller.
+class InlinePlanner {
+    struct Candidate {
+        InlineCallsite site;
+        Dyninst::PatchAPI::PatchFunction* caller;
+        Dyninst::PatchAPI::PatchFunction* callee;
+        Dyninst::PatchAPI::PatchBlock* callBlock;
+        Candidate(const InlineCallsite& s): site(s), caller(nullptr), callee(nullptr), callBlock(nullptr) {}
+    };
+
+    std::vector<Candidate> candidates;
+    std::vector<Candidate*> accepted;
+    std::map<Dyninst::PatchAPI::PatchFunction*, uint64_t> origSize, effSize, instances;
+    std::map<Dyninst::PatchAPI::PatchFunction*, std::map<Dyninst::PatchAPI::PatchFunction*, uint64_t> > inlinedCallees, inlinedCallers;
+    uint64_t totalSize;
+    uint64_t totalGrowth;
+    double totalMetric;
+    double acceptedMetric;
+
+    bool reaches(Dyninst::PatchAPI::PatchFunction*, Dyninst::PatchAPI::PatchFunction*);
+    void addSize(Dyninst::PatchAPI::PatchFunction*, uint64_t);
+    void addInstances(Dyninst::PatchAPI::PatchFunction*, uint64_t);
+    void orderBottomUp(Dyninst::PatchAPI::PatchFunction*,
+        std::set<Dyninst::PatchAPI::PatchFunction*>&,
+        std::vector<Candidate*>&);
+
+public:
+    InlinePlanner(std::vector<Dyninst::PatchAPI::PatchFunction*>&, std::vector<InlineCallsite>&);
+    // Budget is a percentage of the total code size and the cap
+    // a multiple of the caller size. 0 means no limit.
+    void plan(double budgetPercent, double callerCap);
+    void perform();
+};
+
+#endif
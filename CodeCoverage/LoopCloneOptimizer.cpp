@@ -1,5 +1,6 @@
 #include "LoopCloneOptimizer.hpp"
 #include "CoverageSnippet.hpp"
+#include "BinaryProfile.hpp"
 
 #include "BPatch.h"
 #include "BPatch_binaryEdit.h"
@@ -21,6 +22,9 @@ extern int gsOffset;
 extern std::string pgo_filename;
 extern int loop_clone_limit;
 extern double pgo_ratio;
+extern int static_clone_limit;
+extern double static_clone_ratio;
+extern int shard_count;
 
 struct PGOBlock {
     uint64_t addr;
@@ -28,7 +32,10 @@ struct PGOBlock {
     PGOBlock(uint64_t a, double m): addr(a), metric(m) {}
 };
 
-static std::vector<PGOBlock> pgoBlocks;
+// Metrics added one by one, from a text profile or by profile inference
+static std::unordered_map<uint64_t, double> pgoBlockMetrics;
+// A binary profile stays mapped and its address table is searched in place
+static BinaryProfile* mappedProfile = nullptr;
 static double totalMetrics = 0.0;
 
 using Dyninst::PatchAPI::Snippet;
@@ -89,8 +96,11 @@ static CoverageSnippet::Ptr getCoverageSnippet(Dyninst::Address addr) {
 
 LoopCloneOptimizer::LoopCloneOptimizer(
     std::map<PatchFunction*, std::set<PatchBlock*> > & blocks,
-    std::vector<PatchFunction*>& fs
+    std::vector<PatchFunction*>& fs,
+    bool staticProfile
 ): instBlocks(blocks), funcs(fs) {
+    double ratio = staticProfile ? static_clone_ratio : pgo_ratio;
+    int limit = staticProfile ? static_clone_limit : loop_clone_limit;
     std::set<PatchLoop*> containJumpTableOutside;
     for (auto & mapIt : instBlocks) {
         PatchFunction* f = mapIt.first;
@@ -116,10 +126,27 @@ LoopCloneOptimizer::LoopCloneOptimizer(
         }
     }
 
+    // Visit the profiled blocks of these functions from the hottest
+    std::vector<PGOBlock> pgoBlocks;
+    double shardMetrics = 0;
+    for (auto &it : origBlockMap) {
+        double metric = getPGOMetric(it.first);
+        if (metric > 0) pgoBlocks.emplace_back(PGOBlock(it.first, metric));
+        shardMetrics += metric;
+    }
+    std::sort(pgoBlocks.begin(), pgoBlocks.end(),
+        [] (const PGOBlock& a, const PGOBlock& b) {
+            if (a.metric != b.metric) return a.metric > b.metric;
+            return a.addr < b.addr;
+        }
+    );
+
+    // A shard only sees the metrics of its own functions,
+    // so the ratio applies to those instead of the whole binary
+    double targetMetrics = shard_count > 1 ? shardMetrics : totalMetrics;
     double optimized_metrics = 0;
     std::map<PatchLoop*, int> loopInstCount;
     for (auto& pgoBlock : pgoBlocks) {
-        if (origBlockMap.find(pgoBlock.addr) == origBlockMap.end()) continue;
         bool makeClone = false;
         for (auto b : origBlockMap[pgoBlock.addr]) {
             printf("Examine block [%lx, %lx)", b->start(), b->end());
@@ -132,7 +159,7 @@ LoopCloneOptimizer::LoopCloneOptimizer(
                 printf(", skip due to jump table computation outside loop\n");
                 continue;
             }
-            if (loopInstCount[l] < loop_clone_limit) {
+            if (loopInstCount[l] < limit) {
                 loopInstCount[l] += 1;
                 printf(", ok to clone, loop size %d\n", loopSizeMap[l]);
                 blocksToClone.insert(b);
@@ -142,9 +169,15 @@ LoopCloneOptimizer::LoopCloneOptimizer(
             }
         }
         if (makeClone) optimized_metrics += pgoBlock.metric;
-        if (optimized_metrics > pgo_ratio * totalMetrics) break;
+        if (optimized_metrics > ratio * targetMetrics) break;
     }
-    printf("Optimize %.2lf percent metrics\n", optimized_metrics * 100.0 / totalMetrics);
+    printf("Optimize %.2lf percent metrics\n", optimized_metrics * 100.0 / targetMetrics);
+}
+
+PatchLoop* LoopCloneOptimizer::getLoop(PatchBlock* b) {
+    auto it = origBlockLoopMap.find(b);
+    if (it == origBlockLoopMap.end()) return nullptr;
+    return it->second;
 }
 
 void LoopCloneOptimizer::instrument() {
@@ -340,18 +373,85 @@ void LoopCloneOptimizer::makeOneCopy(PatchFunction* f, int version, vector<Patch
 #include <fstream>
 
 bool LoopCloneOptimizer::readPGOFile(const std::string& filename) {
+    if (BinaryProfile::isBinaryProfile(filename)) {
+        BinaryProfile* profile = new BinaryProfile();
+        if (!profile->open(filename)) {
+            delete profile;
+            return false;
+        }
+        size_t n;
+        const ProfileAddressEntry* table = profile->addresses(n);
+        for (size_t i = 0; i < n; ++i) {
+            totalMetrics += table[i].metric;
+        }
+        delete mappedProfile;
+        mappedProfile = profile;
+        return true;
+    }
     std::ifstream infile(filename, std::fstream::in);
+    if (!infile.is_open()) return false;
     uint64_t addr;
     double metric;
     while (infile >> std::hex >> addr >> metric) {
-        addr -= 1;
-        pgoBlocks.emplace_back(PGOBlock(addr, metric));
-        totalMetrics += metric;
+        addPGOBlock(addr - 1, metric);
     }
-    std::sort(pgoBlocks.begin(), pgoBlocks.end(),
-        [] (const PGOBlock& a, const PGOBlock& b) {
-            return a.metric > b.metric;
-        }
-    );
     return true;
-}
\ No newline at end of file
+}
+
+void LoopCloneOptimizer::addPGOBlock(uint64_t addr, double metric) {
+    pgoBlockMetrics[addr] += metric;
+    totalMetrics += metric;
+}
+
+bool LoopCloneOptimizer::hasPGOData() {
+    size_t n = 0;
+    if (mappedProfile != nullptr) mappedProfile->addresses(n);
+    return !pgoBlockMetrics.empty() || n > 0;
+}
+
+void LoopCloneOptimizer::clearPGOData() {
+    pgoBlockMetrics.clear();
+    delete mappedProfile;
+    mappedProfile = nullptr;
+    totalMetrics = 0.0;
+}
+
+double LoopCloneOptimizer::getPGOMetric(uint64_t addr) {
+    double metric = 0.0;
+    auto it = pgoBlockMetrics.find(addr);
+    if (it != pgoBlockMetrics.end()) metric = it->second;
+    if (mappedProfile != nullptr) {
+        // Profile addresses are one past the block start, and
+        // equal addresses are next to each other in the table
+        size_t n;
+        const ProfileAddressEntry* end = mappedProfile->addresses(n) + n;
+        for (const ProfileAddressEntry* e = mappedProfile->findAddress(addr + 1); e != nullptr && e != end && e->addr == addr + 1; ++e) {
+            metric += e->metric;
+        }
+    }
+    return metric;
+}
+
+void LoopCloneOptimizer::getSteadyStateBlocks(PatchFunction* f, std::set<PatchBlock*>& steadyBlocks) {
+    std::map< std::pair<uint64_t, int>, PatchBlock*> steadyState;
+    for (auto b : f->blocks()) {
+        std::pair<uint64_t, int> key(b->start(), getInlineVersionNumber(b));
+        auto it = steadyState.find(key);
+        if (it == steadyState.end() || it->second->getCloneVersion() < b->getCloneVersion()) {
+            steadyState[key] = b;
+        }
+    }
+    for (auto &it : steadyState) {
+        steadyBlocks.insert(it.second);
+    }
+}
+
+PatchBlock* LoopCloneOptimizer::getSteadyStateBlock(PatchFunction* f, PatchBlock* orig) {
+    PatchBlock* ret = orig;
+    int inlineVersion = getInlineVersionNumber(orig);
+    for (auto b : f->blocks()) {
+        if (b->start() != orig->start() || getInlineVersionNumber(b) != inlineVersion) continue;
+        if (b->getCloneVersion() > ret->getCloneVersion()) ret = b;
+    }
+    return ret;
+}
@@ -35,8 +35,23 @@ class LoopCloneOptimizer {
 
 public:
     static bool readPGOFile(const std::string&);    
-    LoopCloneOptimizer(std::map<Dyninst::PatchAPI::PatchFunction*, std::set<Dyninst::PatchAPI::PatchBlock*> >&, std::vector<Dyninst::PatchAPI::PatchFunction*>&);
+    static void addPGOBlock(uint64_t, double);
+    static bool hasPGOData();
+    static void clearPGOData();
+    static double getPGOMetric(uint64_t);
+    // Blocks that execution settles in: for each block address and inline
+    // version, the loop clone with the highest loop version number
+    static void getSteadyStateBlocks(Dyninst::PatchAPI::PatchFunction*, std::set<Dyninst::PatchAPI::PatchBlock*>&);
+    // The steady-state copy of a block that existed before loop cloning
+    static Dyninst::PatchAPI::PatchBlock* getSteadyStateBlock(Dyninst::PatchAPI::PatchFunction*, Dyninst::PatchAPI::PatchBlock*);
+    // With a static profile, the selection uses --static-clone-ratio
+    // and --static-clone-limit instead of --pgo-ratio and --loop-clone-limit
+    LoopCloneOptimizer(std::map<Dyninst::PatchAPI::PatchFunction*, std::set<Dyninst::PatchAPI::PatchBlock*> >&, std::vector<Dyninst::PatchAPI::PatchFunction*>&, bool staticProfile = false);
     void instrument();
+
+    bool willClone(Dyninst::PatchAPI::PatchBlock* b) { return blocksToClone.find(b) != blocksToClone.end(); }
+    Dyninst::PatchAPI::PatchLoop* getLoop(Dyninst::PatchAPI::PatchBlock*);
+    int getLoopSize(Dyninst::PatchAPI::PatchLoop* l) { return loopSizeMap[l]; }
 };
 
 #endif
\ No newline at end of file
@@ -48,12 +48,21 @@ void MBGNode::PrintNodeData(bool realCode) {
     fprintf(stderr, ">");
 }
 
-MultiBlockGraph::MultiBlockGraph(SingleBlockGraph::Ptr cfg) {
+MultiBlockGraph::MultiBlockGraph(SingleBlockGraph::Ptr cfg, const StopCheck& stop): complete(false) {
     //Build the dominator graph and fill in domination informaiton in cfg
-    SingleBlockGraph::Ptr dominatorGraph = cfg->buildDominatorGraph();
+    SingleBlockGraph::Ptr dominatorGraph = cfg->buildDominatorGraph(stop);
+    if (dominatorGraph == nullptr) return;
+    build(dominatorGraph, stop);
+}
+
+MultiBlockGraph::MultiBlockGraph(SingleBlockGraph::Ptr cfg, const EdgeList& domEdges, const EdgeList& postDomEdges): complete(false) {
+    build(cfg->buildDominatorGraph(domEdges, postDomEdges), nullptr);
+}
 
+void MultiBlockGraph::build(SingleBlockGraph::Ptr dominatorGraph, const StopCheck& stop) {
     std::vector< std::set<Node::Ptr> > sccList;
     dominatorGraph->SCC(sccList);
+    if (stop && stop()) return;
 
     // Create new nodes
     for (const auto& scc : sccList) {
@@ -76,6 +85,7 @@ MultiBlockGraph::MultiBlockGraph(SingleBlockGraph::Ptr cfg) {
 
     // Create new edges
     for (auto & n1 : allNodes) {
+        if (stop && stop()) return;
         MBGNode::Ptr mbgn1 = static_pointer_cast<MBGNode>(n1);
         for (auto & n2: allNodes) {
             MBGNode::Ptr mbgn2 = static_pointer_cast<MBGNode>(n2);
@@ -92,6 +102,7 @@ MultiBlockGraph::MultiBlockGraph(SingleBlockGraph::Ptr cfg) {
         if (n->inEdgeList().empty()) addEntry(n);
         if (n->outEdgeList().empty()) addExit(n);
     }
+    complete = true;
 }
 
 }
\ No newline at end of file
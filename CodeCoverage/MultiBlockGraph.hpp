@@ -30,9 +30,18 @@ public:
 
 class MultiBlockGraph : public Graph {
     //std::unordered_map<Dyninst::PatchAPI::PatchBlock*, MBGNode::Ptr> nodeMap;
+    bool complete;
+    void build(std::shared_ptr<SingleBlockGraph> dominatorGraph, const StopCheck& stop);
 public:
     using Ptr = std::shared_ptr<MultiBlockGraph>;
-    MultiBlockGraph(std::shared_ptr<SingleBlockGraph>);
+    // The construction polls stop between its phases and while connecting
+    // super blocks, which is quadratic in their number, and gives up
+    // once it returns true
+    MultiBlockGraph(std::shared_ptr<SingleBlockGraph>, const StopCheck& stop = nullptr);
+    // From a dominator and a post-dominator tree of the CFG computed before
+    MultiBlockGraph(std::shared_ptr<SingleBlockGraph>, const EdgeList& domEdges, const EdgeList& postDomEdges);
+    // False if the construction was stopped, the graph is then unusable
+    bool isComplete() { return complete; }
 };
 
 }
@@ -0,0 +1,176 @@
+#include "OverheadPredictor.hpp"
+#include "CoverageLocationOpt.hpp"
+#include "CoverageSnippet.hpp"
+#include "LoopCloneOptimizer.hpp"
+
+#include "PatchCFG.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+using Dyninst::PatchAPI::PatchLoop;
+
+extern bool threadLocalMemory;
+extern int nops;
+extern std::string mode;
+extern std::string pgo_address_filename;
+
+OverheadPredictor::OverheadPredictor(
+    std::map<PatchFunction*, std::set<PatchBlock*> >& instBlocks,
+    std::vector<PatchFunction*>& funcs,
+    LoopCloneOptimizer* lco
+) {
+    // A static profile from --static-loop-clone is not better than loop nesting
+    useProfile = pgo_address_filename != "" && LoopCloneOptimizer::hasPGOData();
+    probeSize = threadLocalMemory ?
+        ThreadLocalMemCoverageSnippet::codeSize() :
+        GlobalMemCoverageSnippet::codeSize();
+    for (auto f : funcs) {
+        estimates.emplace_back(estimateFunction(f, instBlocks[f], lco));
+    }
+    std::sort(estimates.begin(), estimates.end(),
+        [] (const FunctionEstimate& a, const FunctionEstimate& b) {
+            if (a.dynamicProbes != b.dynamicProbes) return a.dynamicProbes > b.dynamicProbes;
+            return a.addedBytes > b.addedBytes;
+        }
+    );
+}
+
+double OverheadPredictor::blockWeight(PatchBlock* b, std::unordered_map<PatchBlock*, int>& loopNestLevel) {
+    if (useProfile) {
+        return LoopCloneOptimizer::getPGOMetric(b->start());
+    }
+    auto it = loopNestLevel.find(b);
+    int level = (it == loopNestLevel.end()) ? 0 : it->second;
+    return pow(10.0, level);
+}
+
+OverheadPredictor::FunctionEstimate OverheadPredictor::estimateFunction(
+    PatchFunction* f,
+    std::set<PatchBlock*>& instBlocks,
+    LoopCloneOptimizer* lco
+) {
+    FunctionEstimate e;
+    e.func = f;
+    e.probes = 0;
+    e.clonedLoops = 0;
+    e.addedBytes = 0;
+    e.dynamicProbes = 0;
+
+    std::unordered_map<PatchBlock*, int> loopNestLevel;
+    CoverageLocationOpt::computeLoopNestLevels(f, loopNestLevel);
+
+    // Group the instrumented blocks in loops that will be cloned,
+    // following the choices made by LoopCloneOptimizer::cloneALoop
+    std::map<PatchLoop*, std::vector<PatchBlock*> > clonedBlocks, otherBlocks;
+    for (auto b : instBlocks) {
+        PatchLoop* l = (lco == nullptr) ? nullptr : lco->getLoop(b);
+        if (l != nullptr && lco->willClone(b)) {
+            clonedBlocks[l].emplace_back(b);
+        }
+    }
+    for (auto b : instBlocks) {
+        PatchLoop* l = (lco == nullptr) ? nullptr : lco->getLoop(b);
+        if (l != nullptr && clonedBlocks.find(l) != clonedBlocks.end()) {
+            if (!lco->willClone(b)) otherBlocks[l].emplace_back(b);
+            continue;
+        }
+        e.probes += 1;
+        e.dynamicProbes += blockWeight(b, loopNestLevel);
+    }
+
+    for (auto &it : clonedBlocks) {
+        PatchLoop* l = it.first;
+        int k = it.second.size();
+        uint64_t versions = 1ULL << k;
+        e.clonedLoops += 1;
+        // Each copy duplicates the whole loop body
+        e.addedBytes += (versions - 1) * lco->getLoopSize(l);
+        // A cloned block is instrumented in the half of the versions that
+        // have not covered it yet, the other instrumented blocks in every version
+        e.probes += k * (versions / 2) + otherBlocks[l].size() * versions;
+        // Once a cloned block is covered, execution moves to a version
+        // without its probe, so it runs about once per entry of the loop nest
+        for (auto b : it.second) {
+            auto lit = loopNestLevel.find(b);
+            int level = (lit == loopNestLevel.end()) ? 0 : lit->second;
+            e.dynamicProbes += blockWeight(b, loopNestLevel) / pow(10.0, level);
+        }
+        for (auto b : otherBlocks[l]) {
+            e.dynamicProbes += blockWeight(b, loopNestLevel);
+        }
+    }
+    e.addedBytes += (uint64_t)e.probes * probeSize;
+    return e;
+}
+
+void OverheadPredictor::print(bool perFunction) {
+    int probes = 0, clonedLoops = 0;
+    uint64_t addedBytes = 0;
+    double dynamicProbes = 0;
+    for (auto &e : estimates) {
+        probes += e.probes;
+        clonedLoops += e.clonedLoops;
+        addedBytes += e.addedBytes;
+        dynamicProbes += e.dynamicProbes;
+    }
+    if (perFunction) {
+        printf("Predicted overhead per function (weighted by %s):\n", useProfile ? "profile samples" : "loop nesting");
+        for (auto &e : estimates) {
+            printf("\t%lx %s: %d probes, %d cloned loops, %lu bytes, %.2lf dynamic probes\n",
+                e.func->addr(), e.func->name().c_str(), e.probes, e.clonedLoops, e.addedBytes, e.dynamicProbes);
+        }
+    }
+    printf("Predicted overhead: %d probes of %d bytes, %d cloned loops, %lu bytes added, %.2lf dynamic probes (weighted by %s)\n",
+        probes, probeSize, clonedLoops, addedBytes, dynamicProbes, useProfile ? "profile samples" : "loop nesting");
+}
+
+static void printJSONString(FILE* f, const std::string& str) {
+    fputc('"', f);
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if ((unsigned char)c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool OverheadPredictor::writeJSON(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "w");
+    if (f == nullptr) return false;
+    int probes = 0;
+    uint64_t addedBytes = 0;
+    double dynamicProbes = 0;
+    for (auto &e : estimates) {
+        probes += e.probes;
+        addedBytes += e.addedBytes;
+        dynamicProbes += e.dynamicProbes;
+    }
+    fprintf(f, "{\n");
+    fprintf(f, "  \"mode\": ");
+    printJSONString(f, mode);
+    fprintf(f, ",\n  \"weight\": \"%s\",\n", useProfile ? "profile" : "loop-nest");
+    fprintf(f, "  \"probe_bytes\": %d,\n", probeSize);
+    fprintf(f, "  \"nops\": %d,\n", nops);
+    fprintf(f, "  \"total\": {\"probes\": %d, \"added_bytes\": %lu, \"dynamic_probes\": %.2lf},\n",
+        probes, addedBytes, dynamicProbes);
+    fprintf(f, "  \"functions\": [");
+    for (size_t i = 0; i < estimates.size(); ++i) {
+        FunctionEstimate &e = estimates[i];
+        fprintf(f, "%s\n    {\"addr\": \"%lx\", \"name\": ", i == 0 ? "" : ",", e.func->addr());
+        printJSONString(f, e.func->name());
+        fprintf(f, ", \"probes\": %d, \"cloned_loops\": %d, \"added_bytes\": %lu, \"dynamic_probes\": %.2lf}",
+            e.probes, e.clonedLoops, e.addedBytes, e.dynamicProbes);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    return true;
+}
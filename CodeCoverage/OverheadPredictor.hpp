@@ -0,0 +1,53 @@
+#ifndef OVERHEAD_PREDICTOR_HPP
+#define OVERHEAD_PREDICTOR_HPP
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+        class PatchLoop;
+    }
+}
+
+class LoopCloneOptimizer;
+
+// Estimate the cost of the coverage instrumentation before writing the binary.
+// Static cost is the number of bytes added to the relocated code.
+// Dynamic cost is the expected number of probe executions, where each block
+// is weighted by its profile samples, or by 10^loop nest level without a profile.
+class OverheadPredictor {
+    struct FunctionEstimate {
+        Dyninst::PatchAPI::PatchFunction* func;
+        int probes;
+        int clonedLoops;
+        uint64_t addedBytes;
+        double dynamicProbes;
+    };
+
+    std::vector<FunctionEstimate> estimates;
+    bool useProfile;
+    int probeSize;
+
+    double blockWeight(Dyninst::PatchAPI::PatchBlock*, std::unordered_map<Dyninst::PatchAPI::PatchBlock*, int>&);
+    FunctionEstimate estimateFunction(
+        Dyninst::PatchAPI::PatchFunction*,
+        std::set<Dyninst::PatchAPI::PatchBlock*>&,
+        LoopCloneOptimizer*);
+
+public:
+    OverheadPredictor(
+        std::map<Dyninst::PatchAPI::PatchFunction*, std::set<Dyninst::PatchAPI::PatchBlock*> >&,
+        std::vector<Dyninst::PatchAPI::PatchFunction*>&,
+        LoopCloneOptimizer*);
+    void print(bool perFunction);
+    bool writeJSON(const std::string&);
+};
+
+#endif
@@ -0,0 +1,131 @@
+// Convert the text PGO files of CodeCoverage into one binary profile,
+// see BinaryProfile.hpp for the layout.
+//
+// Usage: ProfileConvert [--address-file file] [--call-file file]
+//                       [--inline-file file] --output file
+
+#include "BinaryProfile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+std::string address_filename;
+std::string call_filename;
+std::string inline_filename;
+std::string output_filename;
+
+static bool readAddressFile(const std::string& filename, std::vector<ProfileAddressEntry>& table) {
+    FILE* f = fopen(filename.c_str(), "r");
+    if (f == NULL) return false;
+    ProfileAddressEntry e;
+    while (fscanf(f, "%lx %lf", &e.addr, &e.metric) == 2) {
+        table.push_back(e);
+    }
+    fclose(f);
+    std::stable_sort(table.begin(), table.end(),
+        [] (const ProfileAddressEntry& a, const ProfileAddressEntry& b) {
+            return a.addr < b.addr;
+        }
+    );
+    return true;
+}
+
+static bool readCallFile(const std::string& filename, std::vector<ProfileCallEntry>& table) {
+    FILE* f = fopen(filename.c_str(), "r");
+    if (f == NULL) return false;
+    ProfileCallEntry e;
+    while (fscanf(f, "%lx %lx %lf", &e.from, &e.to, &e.metric) == 3) {
+        table.push_back(e);
+    }
+    fclose(f);
+    std::stable_sort(table.begin(), table.end(),
+        [] (const ProfileCallEntry& a, const ProfileCallEntry& b) {
+            if (a.from != b.from) return a.from < b.from;
+            return a.to < b.to;
+        }
+    );
+    return true;
+}
+
+static uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~7ULL;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--address-file") == 0) {
+            address_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--call-file") == 0) {
+            call_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--inline-file") == 0) {
+            inline_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--output") == 0) {
+            output_filename = argv[i+1];
+            i += 1;
+            continue;
+        }
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(1);
+    }
+    if (output_filename == "") {
+        fprintf(stderr, "Usage: %s [--address-file file] [--call-file file] [--inline-file file] --output file\n", argv[0]);
+        exit(1);
+    }
+
+    std::vector<ProfileAddressEntry> addresses;
+    std::vector<ProfileCallEntry> callPairs, callsites;
+    if (address_filename != "" && !readAddressFile(address_filename, addresses)) {
+        fprintf(stderr, "Cannot read %s\n", address_filename.c_str());
+        exit(1);
+    }
+    if (call_filename != "" && !readCallFile(call_filename, callPairs)) {
+        fprintf(stderr, "Cannot read %s\n", call_filename.c_str());
+        exit(1);
+    }
+    if (inline_filename != "" && !readCallFile(inline_filename, callsites)) {
+        fprintf(stderr, "Cannot read %s\n", inline_filename.c_str());
+        exit(1);
+    }
+
+    ProfileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ProfileMagic, sizeof(ProfileMagic));
+    header.version = ProfileVersion;
+    header.headerSize = sizeof(ProfileHeader);
+    header.addressCount = addresses.size();
+    header.addressOffset = align8(sizeof(ProfileHeader));
+    header.callPairCount = callPairs.size();
+    header.callPairOffset = align8(header.addressOffset + addresses.size() * sizeof(ProfileAddressEntry));
+    header.callsiteCount = callsites.size();
+    header.callsiteOffset = align8(header.callPairOffset + callPairs.size() * sizeof(ProfileCallEntry));
+
+    FILE* out = fopen(output_filename.c_str(), "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open %s\n", output_filename.c_str());
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(addresses.data(), sizeof(ProfileAddressEntry), addresses.size(), out);
+    fwrite(callPairs.data(), sizeof(ProfileCallEntry), callPairs.size(), out);
+    fwrite(callsites.data(), sizeof(ProfileCallEntry), callsites.size(), out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Cannot write %s\n", output_filename.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Write %lu addresses, %lu call pairs, %lu callsites to %s\n",
+        addresses.size(), callPairs.size(), callsites.size(), output_filename.c_str());
+    return 0;
+}
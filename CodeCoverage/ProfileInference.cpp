@@ -0,0 +1,255 @@
+#include "ProfileInference.hpp"
+#include "LoopCloneOptimizer.hpp"
+#include "SingleBlockGraph.hpp"
+
+#include "PatchCFG.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <map>
+#include <queue>
+#include <unordered_map>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+using GraphAnalysis::SingleBlockGraph;
+using GraphAnalysis::SBGNode;
+using GraphAnalysis::Node;
+
+static const int64_t CostIncrease = 10;
+static const int64_t CostDecrease = 20;
+static const int64_t CostEdge = 1;
+static const int64_t Infinity = std::numeric_limits<int64_t>::max() / 4;
+
+// Samples are scaled so that the hottest block of a function
+// gets this count before solving in integers
+static const double MaxScaledCount = 10000.0;
+// Keep the sampled profile for functions larger than this
+static const size_t MaxInferenceBlocks = 5000;
+
+struct InferredFunction {
+    uint64_t addr;
+    double entryCount;
+    std::vector< std::pair<uint64_t, double> > blocks;
+    std::vector< std::pair< std::pair<uint64_t, uint64_t>, double> > edges;
+};
+
+static std::vector<InferredFunction> inferredFuncs;
+static std::map< std::pair<uint64_t, uint64_t>, double> inferredEdges;
+
+ProfileInference::ProfileInference(PatchFunction* f): func(f) {
+    entry = -1;
+    exit = -1;
+    scale = 0;
+    backArc = -1;
+    entryCount = 0;
+}
+
+int ProfileInference::addArc(int from, int to, int64_t cap, int64_t cost) {
+    int id = arcs.size();
+    arcs.push_back(Arc{to, cap, cost});
+    adj[from].emplace_back(id);
+    arcs.push_back(Arc{from, 0, -cost});
+    adj[to].emplace_back(id + 1);
+    return id;
+}
+
+void ProfileInference::solve(int source, int sink) {
+    // Successive shortest paths with Dijkstra over reduced costs.
+    // All initial costs are non-negative, so the potentials start at 0.
+    size_t n = adj.size();
+    std::vector<int64_t> potential(n, 0), dist(n);
+    std::vector<int> prevArc(n);
+    typedef std::pair<int64_t, int> QueueItem;
+    while (true) {
+        std::fill(dist.begin(), dist.end(), Infinity);
+        std::fill(prevArc.begin(), prevArc.end(), -1);
+        std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem> > q;
+        dist[source] = 0;
+        q.push(QueueItem(0, source));
+        while (!q.empty()) {
+            QueueItem cur = q.top();
+            q.pop();
+            int u = cur.second;
+            if (cur.first > dist[u]) continue;
+            for (auto id : adj[u]) {
+                Arc& a = arcs[id];
+                if (a.cap <= 0) continue;
+                int64_t d = dist[u] + a.cost + potential[u] - potential[a.to];
+                if (d < dist[a.to]) {
+                    dist[a.to] = d;
+                    prevArc[a.to] = id;
+                    q.push(QueueItem(d, a.to));
+                }
+            }
+        }
+        if (dist[sink] == Infinity) break;
+        for (size_t i = 0; i < n; ++i) {
+            if (dist[i] < Infinity) potential[i] += dist[i];
+        }
+        int64_t push = Infinity;
+        for (int v = sink; v != source; v = arcs[prevArc[v] ^ 1].to) {
+            push = std::min(push, arcs[prevArc[v]].cap);
+        }
+        for (int v = sink; v != source; v = arcs[prevArc[v] ^ 1].to) {
+            arcs[prevArc[v]].cap -= push;
+            arcs[prevArc[v] ^ 1].cap += push;
+        }
+    }
+}
+
+bool ProfileInference::infer() {
+    SingleBlockGraph::Ptr cfg = std::make_shared<SingleBlockGraph>(func);
+    const Node::Ptr& entryNode = cfg->getEntries()[0];
+    const Node::Ptr& exitNode = cfg->getExits()[0];
+    std::unordered_map<Node*, int> index;
+    for (auto n : cfg->getAllNodes()) {
+        index[n.get()] = blocks.size();
+        if (n == entryNode) entry = blocks.size();
+        if (n == exitNode) exit = blocks.size();
+        blocks.emplace_back(std::static_pointer_cast<SBGNode>(n)->getPatchBlock());
+    }
+    if (blocks.size() > MaxInferenceBlocks) return false;
+
+    std::vector<double> density(blocks.size(), 0);
+    double maxDensity = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if ((int)i == exit) continue;
+        PatchBlock* b = blocks[i];
+        density[i] = LoopCloneOptimizer::getPGOMetric(b->start()) / std::max<uint64_t>(1, b->end() - b->start());
+        maxDensity = std::max(maxDensity, density[i]);
+    }
+    if (maxDensity <= 0) return false;
+    scale = MaxScaledCount / maxDensity;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        samples.emplace_back(llround(density[i] * scale));
+    }
+
+    // Node 2i is the in node of block i and 2i+1 its out node
+    int n = blocks.size();
+    int source = 2 * n;
+    int sink = 2 * n + 1;
+    adj.resize(2 * n + 2);
+    for (int i = 0; i < n; ++i) {
+        // The samples are taken as flow through the block up front,
+        // which leaves an excess at the out node and a deficit at the in node
+        incArcs.emplace_back(addArc(2 * i, 2 * i + 1, Infinity, CostIncrease));
+        decArcs.emplace_back(addArc(2 * i + 1, 2 * i, samples[i], CostDecrease));
+        if (samples[i] > 0) {
+            addArc(source, 2 * i + 1, samples[i], 0);
+            addArc(2 * i, sink, samples[i], 0);
+        }
+    }
+    for (auto n : cfg->getAllNodes()) {
+        int u = index[n.get()];
+        std::set<int> targets;
+        for (auto t : n->outEdgeList()) {
+            targets.insert(index[t.get()]);
+        }
+        for (auto v : targets) {
+            cfgEdges.emplace_back(std::make_pair(u, v));
+            edgeArcs.emplace_back(addArc(2 * u + 1, 2 * v, Infinity, CostEdge));
+        }
+    }
+    backArc = addArc(2 * exit + 1, 2 * entry, Infinity, 0);
+
+    solve(source, sink);
+
+    // Flow on an arc is the residual capacity of its reverse arc
+    for (int i = 0; i < n; ++i) {
+        int64_t count = samples[i] + arcs[incArcs[i] ^ 1].cap - arcs[decArcs[i] ^ 1].cap;
+        blockCounts.emplace_back(count / scale);
+    }
+    for (size_t i = 0; i < cfgEdges.size(); ++i) {
+        edgeCounts.emplace_back(arcs[edgeArcs[i] ^ 1].cap / scale);
+    }
+    entryCount = arcs[backArc ^ 1].cap / scale;
+    return true;
+}
+
+void ProfileInference::run(std::vector<PatchFunction*>& funcs) {
+    std::vector<InferredFunction> results(funcs.size());
+    // Not vector<bool>, whose elements share words across iterations
+    std::vector<char> inferred(funcs.size(), 0);
+    size_t totalFunc = funcs.size();
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < totalFunc; ++i) {
+        ProfileInference pi(funcs[i]);
+        if (!pi.infer()) continue;
+        InferredFunction& r = results[i];
+        r.addr = funcs[i]->addr();
+        r.entryCount = pi.entryCount;
+        for (size_t j = 0; j < pi.blocks.size(); ++j) {
+            if ((int)j == pi.exit) continue;
+            r.blocks.emplace_back(std::make_pair(pi.blocks[j]->start(), pi.blockCounts[j]));
+        }
+        for (size_t j = 0; j < pi.cfgEdges.size(); ++j) {
+            int u = pi.cfgEdges[j].first;
+            int v = pi.cfgEdges[j].second;
+            if (u == pi.exit || v == pi.exit) continue;
+            r.edges.emplace_back(std::make_pair(std::make_pair(pi.blocks[u]->start(), pi.blocks[v]->start()), pi.edgeCounts[j]));
+        }
+        inferred[i] = 1;
+    }
+
+    // Inferred counts become the block metrics, in samples as before.
+    // Functions that were not inferred keep their sampled metrics.
+    std::vector< std::pair<uint64_t, double> > metrics;
+    for (size_t i = 0; i < totalFunc; ++i) {
+        if (inferred[i]) {
+            std::unordered_map<uint64_t, uint64_t> sizes;
+            for (auto b : funcs[i]->blocks()) {
+                sizes[b->start()] = b->end() - b->start();
+            }
+            for (auto &it : results[i].blocks) {
+                if (it.second > 0) metrics.emplace_back(std::make_pair(it.first, it.second * sizes[it.first]));
+            }
+            for (auto &it : results[i].edges) {
+                inferredEdges[it.first] += it.second;
+            }
+            inferredFuncs.emplace_back(results[i]);
+        } else {
+            for (auto b : funcs[i]->blocks()) {
+                double m = LoopCloneOptimizer::getPGOMetric(b->start());
+                if (m > 0) metrics.emplace_back(std::make_pair(b->start(), m));
+            }
+        }
+    }
+    LoopCloneOptimizer::clearPGOData();
+    for (auto &it : metrics) {
+        LoopCloneOptimizer::addPGOBlock(it.first, it.second);
+    }
+    printf("Infer block and edge counts for %lu functions\n", inferredFuncs.size());
+}
+
+bool ProfileInference::hasProfile() {
+    return !inferredFuncs.empty();
+}
+
+bool ProfileInference::getEdgeCount(uint64_t src, uint64_t trg, double& count) {
+    auto it = inferredEdges.find(std::make_pair(src, trg));
+    if (it == inferredEdges.end()) return false;
+    count = it->second;
+    return true;
+}
+
+bool ProfileInference::writeProfile(const std::string& filename) {
+    // Counts are executions per unit of samples per byte,
+    // so they are comparable across functions
+    FILE* f = fopen(filename.c_str(), "w");
+    if (f == nullptr) return false;
+    for (auto &r : inferredFuncs) {
+        fprintf(f, "F %lx %.6lf\n", r.addr, r.entryCount);
+        for (auto &it : r.blocks) {
+            fprintf(f, "B %lx %.6lf\n", it.first, it.second);
+        }
+        for (auto &it : r.edges) {
+            fprintf(f, "E %lx %lx %.6lf\n", it.first.first, it.first.second, it.second);
+        }
+    }
+    fclose(f);
+    return true;
+}
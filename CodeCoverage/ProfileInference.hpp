@@ -0,0 +1,64 @@
+#ifndef PROFILE_INFERENCE_HPP
+#define PROFILE_INFERENCE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+// Reconcile the sampled block profile of a function into block and edge
+// counts that conserve flow, by solving a minimum cost flow problem over
+// the SingleBlockGraph of the function, in the spirit of
+// He et al., "Profile Inference Revisited", POPL 2022.
+//
+// Every block is split into an in node and an out node. Increasing the
+// count of a block above its samples costs CostIncrease per unit,
+// decreasing it costs CostDecrease, and every unit of flow over a CFG
+// edge costs CostEdge. The virtual exit flows back into the entry, so
+// a solution is a circulation.
+class ProfileInference {
+    struct Arc {
+        int to;
+        int64_t cap;
+        int64_t cost;
+    };
+
+    Dyninst::PatchAPI::PatchFunction* func;
+    std::vector<Dyninst::PatchAPI::PatchBlock*> blocks;
+    std::vector< std::pair<int, int> > cfgEdges;
+    std::vector<int64_t> samples;
+    int entry, exit;
+    double scale;
+
+    std::vector<Arc> arcs;
+    std::vector< std::vector<int> > adj;
+    std::vector<int> incArcs, decArcs, edgeArcs;
+    int backArc;
+
+    int addArc(int from, int to, int64_t cap, int64_t cost);
+    void solve(int source, int sink);
+
+public:
+    std::vector<double> blockCounts;
+    std::vector<double> edgeCounts;
+    double entryCount;
+
+    ProfileInference(Dyninst::PatchAPI::PatchFunction*);
+    // Return false if the function has no samples or is too large
+    bool infer();
+
+    // Infer all functions in parallel and replace the
+    // block metrics used by LoopCloneOptimizer
+    static void run(std::vector<Dyninst::PatchAPI::PatchFunction*>&);
+    static bool hasProfile();
+    static bool writeProfile(const std::string&);
+    static bool getEdgeCount(uint64_t src, uint64_t trg, double& count);
+};
+
+#endif
@@ -75,7 +75,15 @@ SingleBlockGraph::~SingleBlockGraph() {
     //printf("Destructor SingleBlockGraph: has %lu nodes\n", nodeMap.size());
 }
 
-SingleBlockGraph::Ptr SingleBlockGraph::buildDominatorGraph() {
+SingleBlockGraph::Ptr SingleBlockGraph::buildDominatorGraph(const StopCheck& stop) {
+    Graph::EdgeList domEdges, postDomEdges;
+    dominatorTree(domEdges);
+    if (stop && stop()) return nullptr;
+    postDominatorTree(postDomEdges);
+    return buildDominatorGraph(domEdges, postDomEdges);
+}
+
+SingleBlockGraph::Ptr SingleBlockGraph::buildDominatorGraph(const EdgeList& domEdges, const EdgeList& postDomEdges) {
     // Create an empty graph
     SingleBlockGraph::Ptr ret(new SingleBlockGraph());
 
@@ -100,31 +108,24 @@ SingleBlockGraph::Ptr SingleBlockGraph::buildDominatorGraph() {
         ret->addExit(nodeMap[sbgn]);
     }
 
-    // Add edges based on dominator tree
-    Graph::EdgeList elist;
-    dominatorTree(elist);    
-    for (const auto& edge : elist) {
-        SBGNode::Ptr source = std::static_pointer_cast<SBGNode>(edge.first);
-        SBGNode::Ptr target = std::static_pointer_cast<SBGNode>(edge.second);
-        nodeMap[source]->addOutEdge(nodeMap[target]);
-        nodeMap[target]->addInEdge(nodeMap[source]);
-    }
-
-    // Add edges based on post dominator tree
-    elist.clear();
-    postDominatorTree(elist);    
-    for (const auto& edge : elist) {
-        SBGNode::Ptr source = std::static_pointer_cast<SBGNode>(edge.first);
-        SBGNode::Ptr target = std::static_pointer_cast<SBGNode>(edge.second);
-        nodeMap[source]->addOutEdge(nodeMap[target]);
-        nodeMap[target]->addInEdge(nodeMap[source]);
+    // Add edges based on dominator tree and post dominator tree
+    for (const EdgeList* elist : {&domEdges, &postDomEdges}) {
+        for (const auto& edge : *elist) {
+            SBGNode::Ptr source = std::static_pointer_cast<SBGNode>(edge.first);
+            SBGNode::Ptr target = std::static_pointer_cast<SBGNode>(edge.second);
+            nodeMap[source]->addOutEdge(nodeMap[target]);
+            nodeMap[target]->addInEdge(nodeMap[source]);
+        }
     }
 
     return ret;
 }
 
 SBGNode::Ptr SingleBlockGraph::lookupNode(Dyninst::PatchAPI::PatchBlock* b) {
-    return nodeMap[b];
+    // Use find so that concurrent lookups never insert into the map
+    auto it = nodeMap.find(b);
+    if (it == nodeMap.end()) return nullptr;
+    return it->second;
 }
 
 void SingleBlockGraph::addSBGNode(SBGNode::Ptr n) {
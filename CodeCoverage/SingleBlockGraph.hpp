@@ -34,7 +34,10 @@ public:
     SingleBlockGraph(Dyninst::PatchAPI::PatchFunction*);
     SingleBlockGraph() {}
     ~SingleBlockGraph();
-    Ptr buildDominatorGraph();
+    // Returns nullptr if stop returns true between the two trees
+    Ptr buildDominatorGraph(const StopCheck& stop = nullptr);
+    // The same graph from a dominator and a post-dominator tree computed before
+    Ptr buildDominatorGraph(const EdgeList& domEdges, const EdgeList& postDomEdges);
     SBGNode::Ptr lookupNode(Dyninst::PatchAPI::PatchBlock*);
     void addSBGNode(SBGNode::Ptr);
 };
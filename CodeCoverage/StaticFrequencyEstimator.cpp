@@ -0,0 +1,248 @@
+#include "StaticFrequencyEstimator.hpp"
+#include "CoverageLocationOpt.hpp"
+
+#include "PatchCFG.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+
+using Dyninst::PatchAPI::PatchFunction;
+using Dyninst::PatchAPI::PatchBlock;
+
+// Branch heuristics and their probabilities from Wu and Larus,
+// "Static Branch Frequency and Program Profile Analysis", MICRO 1994
+static const double LoopBranchProb = 0.88;
+static const double LoopExitProb = 0.80;
+static const double CallProb = 0.78;
+static const double ReturnProb = 0.72;
+
+// Upper bound of the probability of going around a loop again,
+// which caps the frequency multiplier of a single loop
+static const double MaxCyclicProb = 0.999;
+
+// Dempster-Shafer combination of two independent predictions
+static double combine(double p, double q) {
+    double taken = p * q;
+    double notTaken = (1 - p) * (1 - q);
+    return taken / (taken + notTaken);
+}
+
+StaticFrequencyEstimator::StaticFrequencyEstimator(PatchFunction* f) {
+    buildGraph(f);
+    if (blocks.empty()) return;
+    int entry = blockIndex[f->entry()];
+    findBackEdges(entry);
+    computeBranchProbabilities(f);
+
+    // Find loops as the targets of back edges and their bodies
+    std::vector<bool> reachable(blocks.size(), false);
+    std::vector<int> stack(1, entry);
+    reachable[entry] = true;
+    while (!stack.empty()) {
+        int b = stack.back();
+        stack.pop_back();
+        for (auto id : outEdges[b]) {
+            int t = edges[id].trg;
+            if (reachable[t]) continue;
+            reachable[t] = true;
+            stack.push_back(t);
+        }
+    }
+
+    std::map<int, std::vector<bool> > loopBodies;
+    for (auto& e : edges) {
+        if (!e.back || !reachable[e.src]) continue;
+        std::vector<bool>& body = loopBodies[e.trg];
+        if (body.empty()) {
+            body.assign(blocks.size(), false);
+            body[e.trg] = true;
+        }
+        if (body[e.src]) continue;
+        body[e.src] = true;
+        stack.assign(1, e.src);
+        while (!stack.empty()) {
+            int b = stack.back();
+            stack.pop_back();
+            for (auto id : inEdges[b]) {
+                int s = edges[id].src;
+                if (body[s] || !reachable[s]) continue;
+                body[s] = true;
+                stack.push_back(s);
+            }
+        }
+    }
+
+    // Inner loops are smaller than the loops containing them
+    std::vector< std::pair<int, int> > loopOrder;
+    for (auto& it : loopBodies) {
+        int size = std::count(it.second.begin(), it.second.end(), true);
+        loopOrder.emplace_back(size, it.first);
+    }
+    std::sort(loopOrder.begin(), loopOrder.end());
+
+    freq.assign(blocks.size(), 0);
+    for (auto& loop : loopOrder) {
+        propagate(loop.second, loopBodies[loop.second], false);
+    }
+    propagate(entry, reachable, true);
+}
+
+void StaticFrequencyEstimator::buildGraph(PatchFunction* f) {
+    for (auto b : f->blocks()) {
+        blocks.emplace_back(b);
+    }
+    std::sort(blocks.begin(), blocks.end(),
+        [] (PatchBlock* a, PatchBlock* b) { return a->start() < b->start(); }
+    );
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blockIndex[blocks[i]] = i;
+    }
+    outEdges.resize(blocks.size());
+    inEdges.resize(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        for (auto e : blocks[i]->targets()) {
+            if (e->sinkEdge() || e->interproc()) continue;
+            if (e->type() == Dyninst::ParseAPI::CATCH) continue;
+            auto it = blockIndex.find(e->trg());
+            if (it == blockIndex.end()) continue;
+            Edge edge;
+            edge.src = i;
+            edge.trg = it->second;
+            edge.prob = 0;
+            edge.back = false;
+            edge.freq = 0;
+            edge.backProb = 0;
+            outEdges[i].emplace_back(edges.size());
+            inEdges[it->second].emplace_back(edges.size());
+            edges.emplace_back(edge);
+        }
+    }
+}
+
+void StaticFrequencyEstimator::findBackEdges(int entry) {
+    // Iterative DFS, an edge to a block on the DFS stack is a back edge
+    enum { White, Gray, Black };
+    std::vector<int> color(blocks.size(), White);
+    std::vector< std::pair<int, size_t> > stack;
+    stack.emplace_back(entry, 0);
+    color[entry] = Gray;
+    while (!stack.empty()) {
+        int b = stack.back().first;
+        size_t& next = stack.back().second;
+        if (next == outEdges[b].size()) {
+            color[b] = Black;
+            stack.pop_back();
+            continue;
+        }
+        Edge& e = edges[outEdges[b][next++]];
+        if (color[e.trg] == Gray) {
+            e.back = true;
+        } else if (color[e.trg] == White) {
+            color[e.trg] = Gray;
+            stack.emplace_back(e.trg, 0);
+        }
+    }
+}
+
+void StaticFrequencyEstimator::computeBranchProbabilities(PatchFunction* f) {
+    std::unordered_map<PatchBlock*, int> loopNestLevel;
+    CoverageLocationOpt::computeLoopNestLevels(f, loopNestLevel);
+    auto level = [&loopNestLevel] (PatchBlock* b) {
+        auto it = loopNestLevel.find(b);
+        return it == loopNestLevel.end() ? 0 : it->second;
+    };
+    const PatchFunction::Blockset& callBlocks = f->callBlocks();
+    const PatchFunction::Blockset& exitBlocks = f->exitBlocks();
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        std::vector<int>& out = outEdges[i];
+        if (out.size() != 2) {
+            for (auto id : out) {
+                edges[id].prob = 1.0 / out.size();
+            }
+            continue;
+        }
+        Edge& e0 = edges[out[0]];
+        Edge& e1 = edges[out[1]];
+        PatchBlock* t0 = blocks[e0.trg];
+        PatchBlock* t1 = blocks[e1.trg];
+        // Probability of taking e0
+        double p = 0.5;
+        if (e0.back != e1.back) {
+            p = combine(p, e0.back ? LoopBranchProb : 1 - LoopBranchProb);
+        } else {
+            bool exit0 = level(t0) < level(blocks[i]);
+            bool exit1 = level(t1) < level(blocks[i]);
+            if (exit0 != exit1) {
+                p = combine(p, exit0 ? 1 - LoopExitProb : LoopExitProb);
+            }
+        }
+        bool call0 = callBlocks.find(t0) != callBlocks.end();
+        bool call1 = callBlocks.find(t1) != callBlocks.end();
+        if (call0 != call1) {
+            p = combine(p, call0 ? 1 - CallProb : CallProb);
+        }
+        bool ret0 = exitBlocks.find(t0) != exitBlocks.end();
+        bool ret1 = exitBlocks.find(t1) != exitBlocks.end();
+        if (ret0 != ret1) {
+            p = combine(p, ret0 ? 1 - ReturnProb : ReturnProb);
+        }
+        e0.prob = p;
+        e1.prob = 1 - p;
+    }
+}
+
+void StaticFrequencyEstimator::propagate(int head, std::vector<bool>& region, bool isFunction) {
+    // Blocks become ready once all their forward predecessors in the region are done
+    std::vector<int> pending(blocks.size(), 0);
+    for (auto& e : edges) {
+        if (e.back || !region[e.src] || !region[e.trg]) continue;
+        pending[e.trg] += 1;
+    }
+    std::deque<int> ready(1, head);
+    std::vector<bool> done(blocks.size(), false);
+    while (!ready.empty()) {
+        int b = ready.front();
+        ready.pop_front();
+        if (done[b]) continue;
+        done[b] = true;
+
+        double cyclic = 0;
+        for (auto id : inEdges[b]) {
+            if (edges[id].back) cyclic += edges[id].backProb;
+        }
+        if (b == head) {
+            // The loop being processed is normalized to one entry of its head.
+            // At function level, the entry may itself head an inner loop.
+            freq[b] = 1;
+            if (!isFunction) cyclic = 0;
+        } else {
+            freq[b] = 0;
+            for (auto id : inEdges[b]) {
+                Edge& e = edges[id];
+                if (!e.back && region[e.src]) freq[b] += e.freq;
+            }
+        }
+        if (cyclic > MaxCyclicProb) cyclic = MaxCyclicProb;
+        freq[b] /= 1 - cyclic;
+
+        for (auto id : outEdges[b]) {
+            Edge& e = edges[id];
+            e.freq = e.prob * freq[b];
+            if (e.trg == head) {
+                e.backProb = e.freq;
+            }
+            if (e.back || !region[e.trg] || e.trg == head) continue;
+            pending[e.trg] -= 1;
+            if (pending[e.trg] == 0) ready.push_back(e.trg);
+        }
+    }
+}
+
+double StaticFrequencyEstimator::getFrequency(PatchBlock* b) {
+    auto it = blockIndex.find(b);
+    if (it == blockIndex.end() || freq.empty()) return 0;
+    return freq[it->second];
+}
@@ -0,0 +1,44 @@
+#ifndef STATIC_FREQUENCY_ESTIMATOR_HPP
+#define STATIC_FREQUENCY_ESTIMATOR_HPP
+
+#include <unordered_map>
+#include <vector>
+
+namespace Dyninst {
+    namespace PatchAPI {
+        class PatchFunction;
+        class PatchBlock;
+    }
+}
+
+// Estimate block frequencies of a function without a profile.
+// Branch probabilities come from the Wu-Larus heuristics that apply to
+// a CFG without instruction semantics (loop branch, loop exit, call and
+// return), and are propagated into block frequencies with loops handled
+// from the innermost out. Frequencies are relative to one function entry.
+class StaticFrequencyEstimator {
+    struct Edge {
+        int src, trg;
+        double prob;
+        bool back;
+        double freq;
+        double backProb;
+    };
+
+    std::vector<Dyninst::PatchAPI::PatchBlock*> blocks;
+    std::unordered_map<Dyninst::PatchAPI::PatchBlock*, int> blockIndex;
+    std::vector<Edge> edges;
+    std::vector< std::vector<int> > outEdges, inEdges;
+    std::vector<double> freq;
+
+    void buildGraph(Dyninst::PatchAPI::PatchFunction*);
+    void findBackEdges(int entry);
+    void computeBranchProbabilities(Dyninst::PatchAPI::PatchFunction*);
+    void propagate(int head, std::vector<bool>& region, bool isFunction);
+
+public:
+    StaticFrequencyEstimator(Dyninst::PatchAPI::PatchFunction*);
+    double getFrequency(Dyninst::PatchAPI::PatchBlock*);
+};
+
+#endif
@@ -0,0 +1,39 @@
+// Block layout test. pick branches to a hot block that gcc, told the
+// branch is unlikely, places after the cold one. Each block records the
+// address its call to mark returns to, so the program can tell how its
+// blocks are laid out: tests/layout.sh checks that the hot block comes
+// before the cold one after --block-layout, and tests/split.sh that the
+// cold block moves after the code of later with --hot-cold-split.
+#include <stdio.h>
+
+enum { Hot, Cold, Later };
+static void* returns[3];
+
+__attribute__((noinline)) void mark(int which) {
+    returns[which] = __builtin_return_address(0);
+}
+
+__attribute__((noinline)) int pick(int x) {
+    if (__builtin_expect(x >= 0, 0)) {
+        mark(Hot);
+        return x + 1;
+    }
+    mark(Cold);
+    return x - 1;
+}
+
+__attribute__((noinline)) int later(int x) {
+    mark(Later);
+    return x * 2;
+}
+
+int main() {
+    int sum = 0;
+    for (int i = 0; i < 1000; ++i) {
+        sum += pick(i);
+    }
+    sum += pick(-5) + later(7);
+    printf("sum %d hot-first %d cold-last %d\n", sum,
+        returns[Hot] < returns[Cold], returns[Cold] > returns[Later]);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Rewrite tests/layout.c with --block-layout and a profile where the
+# out-of-line branch target of pick is hot. Check that the rewritten
+# binary computes the same result and emits the hot block right after
+# the branch, before the cold block. Run from the CodeCoverage
+# directory after make.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+gcc -O2 -no-pie -fcf-protection=none tests/layout.c -o $dir/layout
+
+# Blocks on the hot path of pick: the entry, the target of the
+# conditional branch and the block after the call in the target
+read entry hot hotnext <<< $(objdump -d --no-show-raw-insn $dir/layout | awk '
+    /<pick>:/ { inside = 1; entry = $1; next }
+    inside && /^$/ { exit }
+    inside {
+        sub(":", "", $1)
+        if (after) { hotnext = $1; after = 0 }
+        if (target == "" && $2 ~ /^j/ && $2 != "jmp") target = $3
+        if (target != "" && $1 == target) intarget = 1
+        if (intarget && hotnext == "" && $2 == "call") after = 1
+    }
+    END { print entry, target, hotnext }')
+if [ -z "$entry" ] || [ -z "$hot" ] || [ -z "$hotnext" ]; then
+    echo "Cannot find the hot path of pick"
+    exit 1
+fi
+# Profile addresses are one past the block start
+for addr in $entry $hot $hotnext; do
+    printf "%x 1000\n" $((0x$addr + 1))
+done > $dir/profile
+
+./CodeCoverage --pgo-address-file $dir/profile --block-layout \
+    --output $dir/layout.rw $dir/layout > $dir/log
+if ! grep -q "Reorder blocks of [1-9]" $dir/log; then
+    cat $dir/log
+    echo "FAIL: no function was reordered"
+    exit 1
+fi
+
+expected=$($dir/layout)
+actual=$($dir/layout.rw)
+if [ "$expected" == "${expected/hot-first 0 cold-last 0/}" ]; then
+    echo "FAIL: gcc did not place the hot block after the cold one: $expected"
+    exit 1
+fi
+expected=${expected/hot-first 0/hot-first 1}
+if [ "$actual" != "$expected" ]; then
+    echo "FAIL: expected \"$expected\", got \"$actual\""
+    exit 1
+fi
+echo "PASS: $actual"
@@ -0,0 +1,36 @@
+// Indirect call promotion test. dispatch makes one indirect call, whose
+// hot target is promoted by tests/promotion.sh. Each target records the
+// address it returns to: in the original binary both return to the
+// indirect call, in the promoted binary the hot one returns to the
+// direct call of the guard.
+#include <stdio.h>
+
+static void* hot_return;
+static void* cold_return;
+
+__attribute__((noinline)) int hot(int x) {
+    hot_return = __builtin_return_address(0);
+    return x + 1;
+}
+
+__attribute__((noinline)) int cold(int x) {
+    cold_return = __builtin_return_address(0);
+    return x * 2;
+}
+
+int (* volatile targets[2])(int) = {hot, cold};
+
+__attribute__((noinline)) int dispatch(int i, int x) {
+    return targets[i](x) + 3;
+}
+
+int main() {
+    int sum = 0;
+    for (int i = 0; i < 1000; ++i) {
+        sum += dispatch(i % 10 == 0, i);
+    }
+    int hit = dispatch(0, 5);
+    int miss = dispatch(1, 5);
+    printf("sum %d hit %d miss %d promoted %d\n", sum, hit, miss, hot_return != cold_return);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Rewrite tests/promotion.c with its indirect call promoted and check that
+# both the hit path and the miss path of the guard compute the same
+# results as the original binary, and that the hit path takes the direct
+# call. Run from the CodeCoverage directory after make.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+gcc -O2 -no-pie -fcf-protection=none tests/promotion.c -o $dir/promotion
+
+# The call site is named by the return address of the indirect call
+callsite=$(objdump -d --no-show-raw-insn $dir/promotion | awk '
+    /<dispatch>:/ { inside = 1; next }
+    inside && found { sub(":", "", $1); print $1; exit }
+    inside && /call +\*/ { found = 1 }')
+caller=$(nm $dir/promotion | awk '$3 == "dispatch" { print $1 }')
+hot=$(nm $dir/promotion | awk '$3 == "hot" { print $1 }')
+if [ -z "$callsite" ] || [ -z "$caller" ] || [ -z "$hot" ]; then
+    echo "Cannot find the indirect call of dispatch"
+    exit 1
+fi
+echo 1 > $dir/profile
+echo "$callsite $caller 1000 1 $hot 900" >> $dir/profile
+
+./CodeCoverage --promote-indirect $dir/profile --disable-function-pointer-reloc \
+    --output $dir/promotion.rw $dir/promotion > $dir/log
+if ! grep -q "Promote 1 of 1 indirect callsites" $dir/log; then
+    cat $dir/log
+    echo "FAIL: the call site was not promoted"
+    exit 1
+fi
+
+expected=$($dir/promotion)
+actual=$($dir/promotion.rw)
+if [ "${expected% promoted 0}" != "${actual% promoted 1}" ] || [ "$actual" == "${actual% promoted 1}" ]; then
+    echo "FAIL: expected \"${expected% promoted 0} promoted 1\", got \"$actual\""
+    exit 1
+fi
+echo "PASS: $actual"